@@ -0,0 +1,344 @@
+/*
+ * OpenConnect (SSL + DTLS) VPN client
+ *
+ * Copyright © 2008-2015 Intel Corporation.
+ *
+ * Author: David Woodhouse <dwmw2@infradead.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ */
+
+#include <config.h>
+
+#include <sys/types.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+
+#include "openconnect-internal.h"
+
+/*
+ * Servers may push thousands of split routes, many of them overlapping
+ * or adjacent. Before they reach the script or the kernel, we put them
+ * into a binary trie per address family and read back the smallest set
+ * of prefixes which covers the same addresses.
+ *
+ * Where both lists are given, an address is in the result if the
+ * longest prefix matching it is an include; exactly what the kernel
+ * would do if it had all of them as routes. So excludes are subtracted
+ * from includes and need not be passed on. Only if there are no
+ * includes for a family (i.e. everything goes to the VPN) are the
+ * excludes themselves needed, and then they are just merged.
+ */
+
+enum {
+	MARK_NONE = 0,		/* Also "part in, part out" from trie_walk() */
+	MARK_IN,
+	MARK_OUT,
+};
+
+struct cidr_node {
+	uint32_t child[2];	/* 0 for none; the root is never a child */
+	unsigned char mark;
+};
+
+struct cidr_trie {
+	struct cidr_node *nodes;
+	uint32_t nr, alloc;
+	int family;
+	struct oc_split_include **result;
+	int nr_result;
+};
+
+static int addr_bit(const unsigned char *addr, int bit)
+{
+	return (addr[bit / 8] >> (7 - bit % 8)) & 1;
+}
+
+int parse_cidr(const char *str, struct oc_cidr *c)
+{
+	char addr[INET6_ADDRSTRLEN + 1], *slash, *end;
+	struct in_addr mask;
+	long plen;
+
+	memset(c, 0, sizeof(*c));
+	slash = strchr(str, '/');
+	if (!slash)
+		slash = (char *)str + strlen(str);
+	if (slash - str >= (int)sizeof(addr))
+		return -EINVAL;
+	memcpy(addr, str, slash - str);
+	addr[slash - str] = 0;
+	if (*slash)
+		slash++;
+	else
+		slash = NULL;
+
+	if (inet_pton(AF_INET6, addr, c->addr) == 1) {
+		c->family = AF_INET6;
+		plen = 128;
+		if (slash) {
+			plen = strtol(slash, &end, 10);
+			if (end == slash || *end || plen < 0 || plen > 128)
+				return -EINVAL;
+		}
+	} else if (inet_pton(AF_INET, addr, c->addr) == 1) {
+		c->family = AF_INET;
+		plen = 32;
+		if (slash) {
+			plen = strtol(slash, &end, 10);
+			if (*end == '.' && inet_pton(AF_INET, slash, &mask) == 1) {
+				/* mask is /A.B.C.D */
+				uint32_t m = ntohl(mask.s_addr);
+
+				for (plen = 0; plen < 32 && (m & (0x80000000 >> plen)); plen++)
+					;
+			} else if (end == slash || *end || plen < 0 || plen > 32)
+				return -EINVAL;
+		}
+	} else
+		return -EINVAL;
+
+	c->plen = plen;
+	return 0;
+}
+
+static int trie_insert(struct cidr_trie *t, struct oc_cidr *c, int mark)
+{
+	uint32_t n = 0;
+	int i;
+
+	for (i = 0; i < c->plen; i++) {
+		int bit = addr_bit(c->addr, i);
+
+		if (!t->nodes[n].child[bit]) {
+			if (t->nr == t->alloc) {
+				struct cidr_node *new;
+
+				new = realloc(t->nodes, t->alloc * 2 * sizeof(*new));
+				if (!new)
+					return -ENOMEM;
+				t->nodes = new;
+				t->alloc *= 2;
+			}
+			memset(&t->nodes[t->nr], 0, sizeof(t->nodes[0]));
+			t->nodes[n].child[bit] = t->nr++;
+		}
+		n = t->nodes[n].child[bit];
+	}
+
+	/* Given the same prefix as both, the exclude wins */
+	if (t->nodes[n].mark != MARK_OUT)
+		t->nodes[n].mark = mark;
+	return 0;
+}
+
+/* Not inet_ntop() because Windows doesn't have it; we don't bother
+ * to compress zeroes in IPv6 addresses since nobody reads them. */
+static int trie_emit(struct cidr_trie *t, const unsigned char *addr, int plen)
+{
+	struct oc_split_include *inc;
+	char *p;
+	int i;
+
+	inc = malloc(sizeof(*inc) + 45);
+	if (!inc)
+		return -ENOMEM;
+	p = (char *)(inc + 1);
+	inc->route = p;
+
+	if (t->family == AF_INET)
+		p += sprintf(p, "%d.%d.%d.%d", addr[0], addr[1], addr[2], addr[3]);
+	else for (i = 0; i < 16; i += 2)
+		p += sprintf(p, "%s%x", i ? ":" : "", (addr[i] << 8) | addr[i + 1]);
+	sprintf(p, "/%d", plen);
+
+	inc->next = *t->result;
+	*t->result = inc;
+	t->nr_result++;
+	return 0;
+}
+
+/* Returns MARK_IN or MARK_OUT if the whole of this subtree is one or
+ * the other, and it's then up to the parent whether to emit it. If
+ * it's mixed, the parts which are wholly in have been emitted. */
+static int trie_walk(struct cidr_trie *t, uint32_t n, int depth,
+		     unsigned char *addr, int state)
+{
+	struct cidr_node *node = &t->nodes[n];
+	int res[2], bit;
+
+	if (node->mark)
+		state = node->mark;
+	if (!node->child[0] && !node->child[1])
+		return state;
+
+	for (bit = 0; bit < 2; bit++) {
+		if (!node->child[bit]) {
+			res[bit] = state;
+			continue;
+		}
+		if (bit)
+			addr[depth / 8] |= 0x80 >> (depth % 8);
+		res[bit] = trie_walk(t, node->child[bit], depth + 1, addr, state);
+		addr[depth / 8] &= ~(0x80 >> (depth % 8));
+		if (res[bit] < 0)
+			return res[bit];
+	}
+
+	if (res[0] == res[1] && res[0] != MARK_NONE)
+		return res[0];
+
+	for (bit = 0; bit < 2; bit++) {
+		if (res[bit] == MARK_IN) {
+			int ret;
+
+			if (bit)
+				addr[depth / 8] |= 0x80 >> (depth % 8);
+			ret = trie_emit(t, addr, depth + 1);
+			addr[depth / 8] &= ~(0x80 >> (depth % 8));
+			if (ret)
+				return ret;
+		}
+	}
+	return MARK_NONE;
+}
+
+/* Add the minimal set of prefixes covering the @family addresses in
+ * @in but not in @out to @result. Returns the number added. */
+static int collapse(int family, struct oc_split_include *in,
+		    struct oc_split_include *out, struct oc_split_include **result)
+{
+	struct cidr_trie t;
+	struct oc_cidr c;
+	unsigned char addr[16];
+	int ret = 0;
+
+	memset(&t, 0, sizeof(t));
+	t.family = family;
+	t.result = result;
+	t.alloc = 256;
+	t.nodes = calloc(t.alloc, sizeof(*t.nodes));
+	if (!t.nodes)
+		return -ENOMEM;
+	t.nr = 1;
+
+	for (; in && !ret; in = in->next) {
+		if (!parse_cidr(in->route, &c) && c.family == family)
+			ret = trie_insert(&t, &c, MARK_IN);
+	}
+	for (; out && !ret; out = out->next) {
+		if (!parse_cidr(out->route, &c) && c.family == family)
+			ret = trie_insert(&t, &c, MARK_OUT);
+	}
+
+	if (!ret) {
+		memset(addr, 0, sizeof(addr));
+		ret = trie_walk(&t, 0, 0, addr, MARK_OUT);
+		if (ret == MARK_IN)
+			ret = trie_emit(&t, addr, 0);
+	}
+
+	free(t.nodes);
+	return ret < 0 ? ret : t.nr_result;
+}
+
+static int count_routes(struct openconnect_info *vpninfo,
+			struct oc_split_include *list, int include,
+			int *nr_v4, int *nr_v6)
+{
+	struct oc_cidr c;
+	int nr = 0;
+
+	for (; list; list = list->next) {
+		nr++;
+		if (parse_cidr(list->route, &c)) {
+			if (include)
+				vpn_progress(vpninfo, PRG_ERR,
+					     _("Discard bad split include: \"%s\"\n"),
+					     list->route);
+			else
+				vpn_progress(vpninfo, PRG_ERR,
+					     _("Discard bad split exclude: \"%s\"\n"),
+					     list->route);
+		} else if (c.family == AF_INET)
+			(*nr_v4)++;
+		else
+			(*nr_v6)++;
+	}
+	return nr;
+}
+
+void free_split_list(struct oc_split_include *list)
+{
+	while (list) {
+		struct oc_split_include *next = list->next;
+		free(list);
+		list = next;
+	}
+}
+
+int aggregate_split_routes(struct openconnect_info *vpninfo,
+			   struct oc_split_include *includes,
+			   struct oc_split_include *excludes,
+			   struct oc_split_include **inc_result,
+			   struct oc_split_include **exc_result)
+{
+	static const int families[2] = { AF_INET, AF_INET6 };
+	int nr_incs[2] = { 0, 0 }, nr_excs[2] = { 0, 0 };
+	int nr_in, nr_ex, out_in = 0, out_ex = 0;
+	int i, ret = 0;
+
+	*inc_result = *exc_result = NULL;
+
+	nr_in = count_routes(vpninfo, includes, 1, &nr_incs[0], &nr_incs[1]);
+	nr_ex = count_routes(vpninfo, excludes, 0, &nr_excs[0], &nr_excs[1]);
+
+	for (i = 0; i < 2 && ret >= 0; i++) {
+		ret = 0;
+		if (!nr_incs[i]) {
+			if (nr_excs[i])
+				ret = collapse(families[i], excludes, NULL, exc_result);
+			if (ret > 0)
+				out_ex += ret;
+			continue;
+		}
+
+		ret = collapse(families[i], includes, excludes, inc_result);
+		if (ret > 0) {
+			out_in += ret;
+		} else if (!ret) {
+			/* The excludes swallowed every include. Don't let that
+			 * turn into sending everything to the VPN instead. */
+			ret = collapse(families[i], includes, NULL, inc_result);
+			if (ret > 0) {
+				out_in += ret;
+				ret = collapse(families[i], excludes, NULL, exc_result);
+				if (ret > 0)
+					out_ex += ret;
+			}
+		}
+	}
+
+	if (ret < 0) {
+		free_split_list(*inc_result);
+		free_split_list(*exc_result);
+		*inc_result = *exc_result = NULL;
+		return ret;
+	}
+
+	if (nr_in || nr_ex)
+		vpn_progress(vpninfo, PRG_DEBUG,
+			     _("Aggregated %d split includes and %d excludes into %d and %d routes\n"),
+			     nr_in, nr_ex, out_in, out_ex);
+	return 0;
+}
@@ -0,0 +1,560 @@
+/*
+ * OpenConnect (SSL + DTLS) VPN client
+ *
+ * Copyright © 2008-2015 Intel Corporation.
+ *
+ * Author: David Woodhouse <dwmw2@infradead.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ */
+
+#include <config.h>
+
+#include <string.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <inttypes.h>
+#ifdef HAVE_LZ4
+#include <lz4.h>
+#ifndef HAVE_LZ4_COMPRESS_DEFAULT
+#define LZ4_compress_default LZ4_compress_limitedOutput
+#endif
+/* For OC_COMPRESSION_LEVEL_FAST */
+#define LZ4_FAST_ACCELERATION 8
+#endif
+
+#include "openconnect-internal.h"
+#include "lzo.h"
+
+/*
+ * Each compression algorithm is an engine, with its state allocated once
+ * per session by compr_init() rather than on every packet. The transports
+ * just call compress_packet() and decompress_and_queue_packet() with the
+ * negotiated COMPR_xxx type.
+ */
+
+/* Deflate is stateful across packets, and CSTP-only. */
+struct deflate_state {
+	z_stream inflate_strm;
+	uint32_t inflate_adler32;
+	z_stream deflate_strm;
+	uint32_t deflate_adler32;
+};
+
+static int deflate_level(struct openconnect_info *vpninfo)
+{
+	switch (vpninfo->compr_level) {
+	case OC_COMPRESSION_LEVEL_FAST:
+		return Z_BEST_SPEED;
+	case OC_COMPRESSION_LEVEL_MAX:
+		return Z_BEST_COMPRESSION;
+	default:
+		return Z_DEFAULT_COMPRESSION;
+	}
+}
+
+static void deflate_reset(struct compr_ctx *ctx)
+{
+	struct deflate_state *st = ctx->state;
+
+	/* These check strm->state so they are safe to call multiple times */
+	if (st) {
+		inflateEnd(&st->inflate_strm);
+		deflateEnd(&st->deflate_strm);
+	}
+}
+
+static void deflate_free(struct compr_ctx *ctx)
+{
+	deflate_reset(ctx);
+	free(ctx->state);
+	ctx->state = NULL;
+}
+
+static int deflate_init(struct openconnect_info *vpninfo, struct compr_ctx *ctx, int mtu)
+{
+	struct deflate_state *st = ctx->state;
+
+	if (!st) {
+		st = ctx->state = calloc(1, sizeof(*st));
+		if (!st)
+			return -ENOMEM;
+	} else
+		deflate_reset(ctx);
+
+	st->deflate_adler32 = 1;
+	st->inflate_adler32 = 1;
+
+	if (inflateInit2(&st->inflate_strm, -12) ||
+	    deflateInit2(&st->deflate_strm, deflate_level(vpninfo),
+			 Z_DEFLATED, -12, 9, Z_DEFAULT_STRATEGY))
+		return -ENOMEM;
+
+	/* Add four bytes for the adler32 */
+	return deflateBound(&st->deflate_strm, mtu) + 4;
+}
+
+static int deflate_compress(struct openconnect_info *vpninfo, struct compr_ctx *ctx,
+			    unsigned char *dst, int dstlen,
+			    const unsigned char *src, int srclen)
+{
+	struct deflate_state *st = ctx->state;
+	int ret;
+
+	st->deflate_strm.next_in = (void *)src;
+	st->deflate_strm.avail_in = srclen;
+	st->deflate_strm.next_out = dst;
+	st->deflate_strm.avail_out = dstlen - 4;
+	st->deflate_strm.total_out = 0;
+
+	ret = deflate(&st->deflate_strm, Z_SYNC_FLUSH);
+	if (ret) {
+		vpn_progress(vpninfo, PRG_ERR, _("deflate failed %d\n"), ret);
+		/* Things are going to go horribly wrong if we try to do any
+		   more compression. Give up entirely. */
+		vpninfo->cstp_compr = 0;
+		return -EIO;
+	}
+
+	/* Add ongoing adler32 to tail of compressed packet */
+	st->deflate_adler32 = adler32(st->deflate_adler32, src, srclen);
+
+	store_be32(dst + st->deflate_strm.total_out, st->deflate_adler32);
+
+	return st->deflate_strm.total_out + 4;
+}
+
+static int deflate_decompress(struct openconnect_info *vpninfo, struct compr_ctx *ctx,
+			      unsigned char *dst, int dstlen,
+			      const unsigned char *src, int srclen)
+{
+	struct deflate_state *st = ctx->state;
+	uint32_t pkt_sum;
+	int len;
+
+	if (srclen < 4) {
+		vpn_progress(vpninfo, PRG_ERR, _("inflate failed\n"));
+		return -EINVAL;
+	}
+
+	st->inflate_strm.next_in = (void *)src;
+	st->inflate_strm.avail_in = srclen - 4;
+
+	st->inflate_strm.next_out = dst;
+	st->inflate_strm.avail_out = dstlen;
+	st->inflate_strm.total_out = 0;
+
+	if (inflate(&st->inflate_strm, Z_SYNC_FLUSH)) {
+		vpn_progress(vpninfo, PRG_ERR, _("inflate failed\n"));
+		return -EINVAL;
+	}
+
+	len = st->inflate_strm.total_out;
+
+	st->inflate_adler32 = adler32(st->inflate_adler32, dst, len);
+
+	pkt_sum = load_be32(src + srclen - 4);
+
+	if (st->inflate_adler32 != pkt_sum)
+		vpninfo->quit_reason = "Compression (inflate) adler32 failure";
+
+	return len;
+}
+
+static const struct compr_engine deflate_engine = {
+	.name = "deflate",
+	.type = COMPR_DEFLATE,
+	.init = deflate_init,
+	.reset = deflate_reset,
+	.free = deflate_free,
+	.compress = deflate_compress,
+	.decompress = deflate_decompress,
+};
+
+/* The stateless engines only keep scratch space between packets. They
+ * never need to produce more than the original packet; if it doesn't
+ * shrink, we send it uncompressed. */
+static void free_state(struct compr_ctx *ctx)
+{
+	free(ctx->state);
+	ctx->state = NULL;
+}
+
+static int lzs_init(struct openconnect_info *vpninfo, struct compr_ctx *ctx, int mtu)
+{
+	if (!ctx->state) {
+		ctx->state = lzs_alloc_state();
+		if (!ctx->state)
+			return -ENOMEM;
+	}
+	return mtu;
+}
+
+static int lzs_compress_pkt(struct openconnect_info *vpninfo, struct compr_ctx *ctx,
+			    unsigned char *dst, int dstlen,
+			    const unsigned char *src, int srclen)
+{
+	if (srclen < 40)
+		return -EFBIG;
+
+	return lzs_compress(ctx->state, dst, MIN(dstlen, srclen),
+			    src, srclen, vpninfo->compr_level);
+}
+
+static int lzs_decompress_pkt(struct openconnect_info *vpninfo, struct compr_ctx *ctx,
+			      unsigned char *dst, int dstlen,
+			      const unsigned char *src, int srclen)
+{
+	int ret = lzs_decompress(dst, dstlen, src, srclen);
+
+	if (ret <= 0) {
+		if (ret == 0)
+			ret = -EINVAL;
+		vpn_progress(vpninfo, PRG_ERR, _("LZS decompression failed: %s\n"),
+			     strerror(-ret));
+	}
+	return ret;
+}
+
+static const struct compr_engine lzs_engine = {
+	.name = "LZS",
+	.type = COMPR_LZS,
+	.init = lzs_init,
+	.free = free_state,
+	.compress = lzs_compress_pkt,
+	.decompress = lzs_decompress_pkt,
+};
+
+#ifdef HAVE_LZ4
+static int lz4_init(struct openconnect_info *vpninfo, struct compr_ctx *ctx, int mtu)
+{
+#ifdef HAVE_LZ4_COMPRESS_DEFAULT
+	/* Keep the hash table across calls instead of on the stack */
+	if (!ctx->state) {
+		ctx->state = malloc(LZ4_sizeofState());
+		if (!ctx->state)
+			return -ENOMEM;
+	}
+#endif
+	return mtu;
+}
+
+static int lz4_compress_pkt(struct openconnect_info *vpninfo, struct compr_ctx *ctx,
+			    unsigned char *dst, int dstlen,
+			    const unsigned char *src, int srclen)
+{
+	int ret;
+
+	if (srclen < 40)
+		return -EFBIG;
+
+	dstlen = MIN(dstlen, srclen);
+#ifdef HAVE_LZ4_COMPRESS_DEFAULT
+	ret = LZ4_compress_fast_extState(ctx->state, (void *)src, (void *)dst,
+					 srclen, dstlen,
+					 vpninfo->compr_level == OC_COMPRESSION_LEVEL_FAST ?
+					 LZ4_FAST_ACCELERATION : 1);
+#else
+	ret = LZ4_compress_default((void *)src, (void *)dst, srclen, dstlen);
+#endif
+	if (ret == 0)
+		ret = -EFBIG;
+	return ret;
+}
+
+static int lz4_decompress_pkt(struct openconnect_info *vpninfo, struct compr_ctx *ctx,
+			      unsigned char *dst, int dstlen,
+			      const unsigned char *src, int srclen)
+{
+	int ret = LZ4_decompress_safe((void *)src, (void *)dst, srclen, dstlen);
+
+	if (ret <= 0) {
+		if (ret == 0)
+			ret = -EINVAL;
+		vpn_progress(vpninfo, PRG_ERR, _("LZ4 decompression failed\n"));
+	}
+	return ret;
+}
+
+static const struct compr_engine lz4_engine = {
+	.name = "LZ4",
+	.type = COMPR_LZ4,
+	.init = lz4_init,
+	.free = free_state,
+	.compress = lz4_compress_pkt,
+	.decompress = lz4_decompress_pkt,
+};
+#endif
+
+/* LZO is only used for sending ESP packets. On receipt, esp_mainloop()
+ * decodes straight from its receive buffer, which has the padding that
+ * av_lzo1x_decode() needs. */
+static int lzo_init(struct openconnect_info *vpninfo, struct compr_ctx *ctx, int mtu)
+{
+	if (!ctx->state) {
+		ctx->state = lzo_alloc_state();
+		if (!ctx->state)
+			return -ENOMEM;
+	}
+	return mtu;
+}
+
+static int lzo_compress_pkt(struct openconnect_info *vpninfo, struct compr_ctx *ctx,
+			    unsigned char *dst, int dstlen,
+			    const unsigned char *src, int srclen)
+{
+	if (srclen < 40)
+		return -EFBIG;
+
+	return lzo1x_compress(ctx->state, dst, MIN(dstlen, srclen), src, srclen);
+}
+
+static const struct compr_engine lzo_engine = {
+	.name = "LZO",
+	.type = COMPR_LZO,
+	.init = lzo_init,
+	.free = free_state,
+	.compress = lzo_compress_pkt,
+};
+
+/* Indexed by the bit number of the COMPR_xxx type */
+static const struct compr_engine *compr_engines[COMPR_ENGINES] = {
+	[0] = &deflate_engine,
+	[1] = &lzs_engine,
+#ifdef HAVE_LZ4
+	[2] = &lz4_engine,
+#endif
+	[3] = &lzo_engine,
+};
+
+static int compr_index(int compr_type)
+{
+	int i;
+
+	for (i = 0; i < COMPR_ENGINES; i++) {
+		if (compr_type == (1 << i))
+			return i;
+	}
+	return -1;
+}
+
+/* Returns the context for a type that compr_init() has set up, or NULL */
+static struct compr_ctx *find_compr_ctx(struct openconnect_info *vpninfo,
+					int compr_type)
+{
+	int i = compr_index(compr_type);
+
+	if (i < 0 || !vpninfo->compr_ctx[i].engine)
+		return NULL;
+
+	return &vpninfo->compr_ctx[i];
+}
+
+/* Set up every engine in the 'compr_types' mask, for the current MTU.
+ * Returns the size of buffer needed to compress into, or zero if no
+ * compression is enabled. */
+int compr_init(struct openconnect_info *vpninfo, int compr_types)
+{
+	int i, ret, bufsize = 0;
+
+	for (i = 0; i < COMPR_ENGINES; i++) {
+		struct compr_ctx *ctx = &vpninfo->compr_ctx[i];
+		const struct compr_engine *engine = compr_engines[i];
+
+		if (!(compr_types & (1 << i)) || !engine)
+			continue;
+
+		ret = engine->init(vpninfo, ctx, vpninfo->ip_info.mtu);
+		if (ret < 0) {
+			vpn_progress(vpninfo, PRG_ERR,
+				     _("Compression setup failed\n"));
+			return ret;
+		}
+		ctx->engine = engine;
+		if (ret > bufsize)
+			bufsize = ret;
+	}
+	return bufsize;
+}
+
+static void compr_report(struct openconnect_info *vpninfo, struct compr_ctx *ctx)
+{
+	struct compr_stats *s = &ctx->stats;
+
+	if (!s->compr_pkts && !s->uncompr_pkts && !s->decompr_pkts)
+		return;
+
+	vpn_progress(vpninfo, PRG_DEBUG,
+		     _("%s: compressed %" PRIu64 " packets (%" PRIu64 " to %" PRIu64
+		       " bytes), %" PRIu64 " sent uncompressed; decompressed %" PRIu64
+		       " packets (%" PRIu64 " to %" PRIu64 " bytes); %" PRIu64 " errors\n"),
+		     ctx->engine->name, s->compr_pkts, s->compr_in_bytes,
+		     s->compr_out_bytes, s->uncompr_pkts, s->decompr_pkts,
+		     s->decompr_in_bytes, s->decompr_out_bytes, s->errors);
+}
+
+/* On reconnect, stream state can't carry over to the new session. This
+ * is called once the new session is established, not when the old one
+ * dies, so DTLS can keep decompressing in between. The allocations are
+ * kept for compr_init() to reuse. */
+void compr_reset(struct openconnect_info *vpninfo)
+{
+	int i;
+
+	for (i = 0; i < COMPR_ENGINES; i++) {
+		struct compr_ctx *ctx = &vpninfo->compr_ctx[i];
+
+		if (!ctx->engine)
+			continue;
+
+		compr_report(vpninfo, ctx);
+		memset(&ctx->stats, 0, sizeof(ctx->stats));
+		if (ctx->engine->reset)
+			ctx->engine->reset(ctx);
+		ctx->engine = NULL;
+	}
+}
+
+void compr_free(struct openconnect_info *vpninfo)
+{
+	int i;
+
+	for (i = 0; i < COMPR_ENGINES; i++) {
+		struct compr_ctx *ctx = &vpninfo->compr_ctx[i];
+
+		/* The engine may have been reset, leaving the allocation */
+		if (compr_engines[i] && ctx->state)
+			compr_engines[i]->free(ctx);
+		ctx->engine = NULL;
+	}
+}
+
+int decompress_and_queue_packet(struct openconnect_info *vpninfo, int compr_type,
+				unsigned char *buf, int len)
+{
+	struct compr_ctx *ctx = find_compr_ctx(vpninfo, compr_type);
+	struct pkt *new;
+	int ret;
+
+	if (!ctx || !ctx->engine->decompress) {
+		vpn_progress(vpninfo, PRG_ERR,
+			     _("Unknown compression type %d\n"), compr_type);
+		return -EINVAL;
+	}
+
+	new = alloc_pkt(vpninfo, vpninfo->ip_info.mtu);
+	if (!new)
+		return -ENOMEM;
+
+	new->next = NULL;
+
+	ret = ctx->engine->decompress(vpninfo, ctx, new->data,
+				      vpninfo->ip_info.mtu, buf, len);
+	if (ret < 0) {
+		ctx->stats.errors++;
+		free_pkt(vpninfo, new);
+		return ret;
+	}
+	new->len = ret;
+
+	ctx->stats.decompr_pkts++;
+	ctx->stats.decompr_in_bytes += len;
+	ctx->stats.decompr_out_bytes += new->len;
+
+	vpn_progress(vpninfo, PRG_TRACE,
+		     _("Received %s compressed data packet of %d bytes (was %d)\n"),
+		     ctx->engine->name, new->len, len);
+
+	queue_packet(&vpninfo->incoming_queue, new);
+	return 0;
+}
+
+/* Most traffic through the tunnel is already encrypted or compressed and
+ * gains nothing from another pass. For each flow (hashed into one of
+ * COMPR_FLOWS slots) we track whether compression has been paying off;
+ * after COMPR_MAX_FAILS packets in a row that shrank by less than 1/16,
+ * the flow is sent uncompressed for a while. Then it's probed again, with
+ * the bypass period doubling each time the probe also fails. */
+#define COMPR_MAX_FAILS 4
+#define COMPR_BYPASS_PKTS 64
+#define COMPR_BYPASS_MAX_SHIFT 6
+
+static struct compr_flow *compr_flow_lookup(struct openconnect_info *vpninfo,
+					    struct pkt *this)
+{
+	uint32_t hash = pkt_flow_hash(this);
+	struct compr_flow *f = &vpninfo->compr_flows[hash % COMPR_FLOWS];
+
+	if (f->hash != hash) {
+		memset(f, 0, sizeof(*f));
+		f->hash = hash;
+	}
+	return f;
+}
+
+static void compr_flow_result(struct openconnect_info *vpninfo,
+			      struct compr_flow *f, int len, int compr_len)
+{
+	if (compr_len >= 0 && compr_len < len - len / 16) {
+		f->fails = 0;
+		f->backoff = 0;
+		return;
+	}
+
+	if (++f->fails < COMPR_MAX_FAILS)
+		return;
+
+	f->skip = COMPR_BYPASS_PKTS << f->backoff;
+	if (f->backoff < COMPR_BYPASS_MAX_SHIFT)
+		f->backoff++;
+	f->fails = COMPR_MAX_FAILS - 1; /* One failed probe is enough next time */
+
+	vpn_progress(vpninfo, PRG_TRACE,
+		     _("Not compressing the next %d packets of incompressible flow %08x\n"),
+		     f->skip, f->hash);
+}
+
+/* Compress into vpninfo->deflate_pkt. Returns zero on success, -EFBIG if
+ * the packet should just be sent uncompressed, or another error. */
+int compress_packet(struct openconnect_info *vpninfo, int compr_type, struct pkt *this)
+{
+	struct compr_ctx *ctx = find_compr_ctx(vpninfo, compr_type);
+	struct compr_flow *f;
+	int ret;
+
+	if (!ctx)
+		return -EINVAL;
+
+	f = compr_flow_lookup(vpninfo, this);
+	if (f->skip) {
+		f->skip--;
+		ctx->stats.uncompr_pkts++;
+		return -EFBIG;
+	}
+
+	ret = ctx->engine->compress(vpninfo, ctx, vpninfo->deflate_pkt->data,
+				    vpninfo->deflate_pkt_size, this->data, this->len);
+	if (ret >= 0) {
+		vpninfo->deflate_pkt->len = ret;
+		ctx->stats.compr_pkts++;
+		ctx->stats.compr_in_bytes += this->len;
+		ctx->stats.compr_out_bytes += ret;
+	} else if (ret == -EFBIG) {
+		ctx->stats.uncompr_pkts++;
+	} else {
+		/* For other errors, compression isn't going to work for any flow */
+		ctx->stats.errors++;
+		return ret;
+	}
+
+	compr_flow_result(vpninfo, f, this->len, ret);
+	return ret < 0 ? ret : 0;
+}
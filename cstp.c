@@ -28,12 +28,6 @@
 #include <stdio.h>
 #include <sys/types.h>
 #include <stdarg.h>
-#ifdef HAVE_LZ4
-#include <lz4.h>
-#ifndef HAVE_LZ4_COMPRESS_DEFAULT
-#define LZ4_compress_default LZ4_compress_limitedOutput
-#endif
-#endif
 
 #if defined(__linux__)
 /* For TCP_INFO */
@@ -630,6 +624,11 @@ static int start_cstp_connection(struct openconnect_info *vpninfo)
 	vpn_progress(vpninfo, PRG_DEBUG, _("CSTP Ciphersuite: %s\n"),
 		     openconnect_get_cstp_cipher(vpninfo));
 
+	/* CSTP relies on each read returning exactly one record, which
+	 * kernel TLS receive doesn't guarantee. So only offload transmit. */
+	if (vpninfo->ktls)
+		ssl_ktls_offload(vpninfo, 0);
+
 	monitor_fd_new(vpninfo, ssl);
 
 	monitor_read_fd(vpninfo, ssl);
@@ -650,8 +649,7 @@ static int start_cstp_connection(struct openconnect_info *vpninfo)
 int cstp_connect(struct openconnect_info *vpninfo)
 {
 	int ret;
-	int deflate_bufsize = 0;
-	int compr_type;
+	int deflate_bufsize;
 
 	/* This needs to be done before openconnect_setup_dtls() because it's
 	   sent with the CSTP CONNECT handshake. Even if we don't end up doing
@@ -671,32 +669,24 @@ int cstp_connect(struct openconnect_info *vpninfo)
 	if (ret)
 		goto out;
 
-	/* Allow for the theoretical possibility of having *different*
+	/* Requeue the original of a packet that was deflated for the old
+	 * session, since its compressed form means nothing to the new one */
+	if (vpninfo->current_ssl_pkt == vpninfo->deflate_pkt &&
+	    vpninfo->pending_deflated_pkt) {
+		vpninfo->current_ssl_pkt = NULL;
+		queue_outgoing(vpninfo, vpninfo->pending_deflated_pkt);
+		vpninfo->pending_deflated_pkt = NULL;
+	}
+
+	/* Only now drop the old session's compression state; see compr_reset().
+	 * Allow for the theoretical possibility of having *different*
 	 * compression type for CSTP and DTLS. Although all we've seen
 	 * in practice is that one is enabled and the other isn't. */
-	compr_type = vpninfo->cstp_compr | vpninfo->dtls_compr;
-
-	/* This will definitely be smaller than zlib's */
-	if (compr_type & (COMPR_LZS|COMPR_LZ4))
-		deflate_bufsize = vpninfo->ip_info.mtu;
-
-	/* If deflate compression is enabled (which is CSTP-only), it needs its
-	 * context to be allocated. */
-	if (compr_type & COMPR_DEFLATE) {
-		vpninfo->deflate_adler32 = 1;
-		vpninfo->inflate_adler32 = 1;
-
-		if (inflateInit2(&vpninfo->inflate_strm, -12) ||
-		    deflateInit2(&vpninfo->deflate_strm, Z_DEFAULT_COMPRESSION,
-				 Z_DEFLATED, -12, 9, Z_DEFAULT_STRATEGY)) {
-			vpn_progress(vpninfo, PRG_ERR, _("Compression setup failed\n"));
-			ret = -ENOMEM;
-			goto out;
-		}
-
-		/* Add four bytes for the adler32 */
-		deflate_bufsize = deflateBound(&vpninfo->deflate_strm,
-					       vpninfo->ip_info.mtu) + 4;
+	compr_reset(vpninfo);
+	deflate_bufsize = compr_init(vpninfo, vpninfo->cstp_compr | vpninfo->dtls_compr);
+	if (deflate_bufsize < 0) {
+		ret = deflate_bufsize;
+		goto out;
 	}
 
 	/* If *any* compression is enabled, we'll need a deflate_pkt to compress into */
@@ -724,169 +714,13 @@ int cstp_connect(struct openconnect_info *vpninfo)
 	return ret;
 }
 
-static int cstp_reconnect(struct openconnect_info *vpninfo)
-{
-	if (vpninfo->cstp_compr == COMPR_DEFLATE) {
-		/* Requeue the original packet that was deflated */
-		if (vpninfo->current_ssl_pkt == vpninfo->deflate_pkt) {
-			vpninfo->current_ssl_pkt = NULL;
-			queue_packet(&vpninfo->outgoing_queue, vpninfo->pending_deflated_pkt);
-			vpninfo->pending_deflated_pkt = NULL;
-		}
-		inflateEnd(&vpninfo->inflate_strm);
-		deflateEnd(&vpninfo->deflate_strm);
-	}
-
-	return ssl_reconnect(vpninfo);
-}
-
-int decompress_and_queue_packet(struct openconnect_info *vpninfo, int compr_type,
-				unsigned char *buf, int len)
-{
-	struct pkt *new = malloc(sizeof(struct pkt) + vpninfo->ip_info.mtu);
-	const char *comprname = "";
-
-	if (!new)
-		return -ENOMEM;
-
-	new->next = NULL;
-
-	if (compr_type == COMPR_DEFLATE) {
-		uint32_t pkt_sum;
-
-		comprname = "deflate";
-
-		vpninfo->inflate_strm.next_in = buf;
-		vpninfo->inflate_strm.avail_in = len - 4;
-
-		vpninfo->inflate_strm.next_out = new->data;
-		vpninfo->inflate_strm.avail_out = vpninfo->ip_info.mtu;
-		vpninfo->inflate_strm.total_out = 0;
-
-		if (inflate(&vpninfo->inflate_strm, Z_SYNC_FLUSH)) {
-			vpn_progress(vpninfo, PRG_ERR, _("inflate failed\n"));
-			free(new);
-			return -EINVAL;
-		}
-
-		new->len = vpninfo->inflate_strm.total_out;
-
-		vpninfo->inflate_adler32 = adler32(vpninfo->inflate_adler32,
-						   new->data, new->len);
-
-		pkt_sum = load_be32(buf + len - 4);
-
-		if (vpninfo->inflate_adler32 != pkt_sum)
-			vpninfo->quit_reason = "Compression (inflate) adler32 failure";
-
-	} else if (compr_type == COMPR_LZS) {
-		comprname = "LZS";
-
-		new->len = lzs_decompress(new->data, vpninfo->ip_info.mtu, buf, len);
-		if (new->len < 0) {
-			len = new->len;
-			if (len == 0)
-				len = -EINVAL;
-			vpn_progress(vpninfo, PRG_ERR, _("LZS decompression failed: %s\n"),
-				     strerror(-len));
-			free(new);
-			return len;
-		}
-#ifdef HAVE_LZ4
-	} else if (compr_type == COMPR_LZ4) {
-		comprname = "LZ4";
-		new->len = LZ4_decompress_safe((void *)buf, (void *)new->data, len, vpninfo->ip_info.mtu);
-		if (new->len <= 0) {
-			len = new->len;
-			if (len == 0)
-				len = -EINVAL;
-			vpn_progress(vpninfo, PRG_ERR, _("LZ4 decompression failed\n"));
-			free(new);
-			return len;
-		}
-#endif
-	} else {
-		vpn_progress(vpninfo, PRG_ERR,
-			     _("Unknown compression type %d\n"), compr_type);
-		free(new);
-		return -EINVAL;
-	}
-	vpn_progress(vpninfo, PRG_TRACE,
-		     _("Received %s compressed data packet of %d bytes (was %d)\n"),
-		     comprname, new->len, len);
-
-	queue_packet(&vpninfo->incoming_queue, new);
-	return 0;
-}
-
-int compress_packet(struct openconnect_info *vpninfo, int compr_type, struct pkt *this)
-{
-	int ret;
-
-	if (compr_type == COMPR_DEFLATE) {
-		vpninfo->deflate_strm.next_in = this->data;
-		vpninfo->deflate_strm.avail_in = this->len;
-		vpninfo->deflate_strm.next_out = (void *)vpninfo->deflate_pkt->data;
-		vpninfo->deflate_strm.avail_out = vpninfo->deflate_pkt_size - 4;
-		vpninfo->deflate_strm.total_out = 0;
-
-		ret = deflate(&vpninfo->deflate_strm, Z_SYNC_FLUSH);
-		if (ret) {
-			vpn_progress(vpninfo, PRG_ERR, _("deflate failed %d\n"), ret);
-			/* Things are going to go horribly wrong if we try to do any
-			   more compression. Give up entirely. */
-			vpninfo->cstp_compr = 0;
-			return -EIO;
-		}
-
-		/* Add ongoing adler32 to tail of compressed packet */
-		vpninfo->deflate_adler32 = adler32(vpninfo->deflate_adler32,
-						   this->data, this->len);
-
-		store_be32(&vpninfo->deflate_pkt->data[vpninfo->deflate_strm.total_out],
-			   vpninfo->deflate_adler32);
-
-		vpninfo->deflate_pkt->len = vpninfo->deflate_strm.total_out + 4;
-		return 0;
-	} else if (compr_type == COMPR_LZS) {
-		if (this->len < 40)
-			return -EFBIG;
-
-		ret = lzs_compress(vpninfo->deflate_pkt->data, this->len,
-				   this->data, this->len);
-		if (ret < 0)
-			return ret;
-
-		vpninfo->deflate_pkt->len = ret;
-		return 0;
-#ifdef HAVE_LZ4
-	} else if (compr_type == COMPR_LZ4) {
-		if (this->len < 40)
-			return -EFBIG;
-
-		ret = LZ4_compress_default((void*)this->data, (void*)vpninfo->deflate_pkt->data,
-					   this->len, this->len);
-		if (ret <= 0) {
-			if (ret == 0)
-				ret = -EFBIG;
-			return ret;
-		}
-
-		vpninfo->deflate_pkt->len = ret;
-		return 0;
-#endif
-	} else
-		return -EINVAL;
-
-	return 0;
-}
-
 int cstp_mainloop(struct openconnect_info *vpninfo, int *timeout)
 {
 	int ret;
 	int work_done = 0;
 
-	if (vpninfo->ssl_fd == -1)
+	/* Also while the old connection idles until a new one is made */
+	if (vpninfo->ssl_fd == -1 || vpninfo->ssl_reconnect_due)
 		goto do_reconnect;
 
 	/* FIXME: The poll() handling here is fairly simplistic. Actually,
@@ -900,7 +734,7 @@ int cstp_mainloop(struct openconnect_info *vpninfo, int *timeout)
 		int payload_len;
 
 		if (!vpninfo->cstp_pkt) {
-			vpninfo->cstp_pkt = malloc(sizeof(struct pkt) + len);
+			vpninfo->cstp_pkt = alloc_pkt(vpninfo, len);
 			if (!vpninfo->cstp_pkt) {
 				vpn_progress(vpninfo, PRG_ERR, _("Allocation failed\n"));
 				break;
@@ -1091,7 +925,9 @@ int cstp_mainloop(struct openconnect_info *vpninfo, int *timeout)
 		vpn_progress(vpninfo, PRG_ERR,
 			     _("CSTP Dead Peer Detection detected dead peer!\n"));
 	do_reconnect:
-		ret = cstp_reconnect(vpninfo);
+		ret = ssl_reconnect(vpninfo, timeout);
+		if (ret == -EAGAIN)
+			return work_done;
 		if (ret) {
 			vpn_progress(vpninfo, PRG_ERR, _("Reconnect failed\n"));
 			vpninfo->quit_reason = "CSTP reconnect failed";
@@ -1110,6 +946,7 @@ int cstp_mainloop(struct openconnect_info *vpninfo, int *timeout)
 
 	case KA_DPD:
 		vpn_progress(vpninfo, PRG_DEBUG, _("Send CSTP DPD\n"));
+		prefetch_https_address(vpninfo);
 
 		vpninfo->current_ssl_pkt = (struct pkt *)&dpd_pkt;
 		goto handle_outgoing;
@@ -1118,7 +955,7 @@ int cstp_mainloop(struct openconnect_info *vpninfo, int *timeout)
 		/* No need to send an explicit keepalive
 		   if we have real data to send */
 		if (vpninfo->dtls_state != DTLS_CONNECTED &&
-		    vpninfo->outgoing_queue.head)
+		    vpninfo->outgoing_queue.count)
 			break;
 
 		vpn_progress(vpninfo, PRG_DEBUG, _("Send CSTP Keepalive\n"));
@@ -1132,7 +969,7 @@ int cstp_mainloop(struct openconnect_info *vpninfo, int *timeout)
 
 	/* Service outgoing packet queue, if no DTLS */
 	while (vpninfo->dtls_state != DTLS_CONNECTED &&
-	       (vpninfo->current_ssl_pkt = dequeue_packet(&vpninfo->outgoing_queue))) {
+	       (vpninfo->current_ssl_pkt = dequeue_outgoing(vpninfo))) {
 		struct pkt *this = vpninfo->current_ssl_pkt;
 
 		if (vpninfo->cstp_compr) {
@@ -246,6 +246,7 @@ int dtls_setup(struct openconnect_info *vpninfo, int dtls_attempt_period)
 
 int dtls_mainloop(struct openconnect_info *vpninfo, int *timeout)
 {
+	struct pkt *this;
 	int work_done = 0;
 	char magic_pkt;
 
@@ -277,7 +278,7 @@ int dtls_mainloop(struct openconnect_info *vpninfo, int *timeout)
 		unsigned char *buf;
 
 		if (!vpninfo->dtls_pkt) {
-			vpninfo->dtls_pkt = malloc(sizeof(struct pkt) + len);
+			vpninfo->dtls_pkt = alloc_pkt(vpninfo, len);
 			if (!vpninfo->dtls_pkt) {
 				vpn_progress(vpninfo, PRG_ERR, _("Allocation failed\n"));
 				break;
@@ -315,6 +316,7 @@ int dtls_mainloop(struct openconnect_info *vpninfo, int *timeout)
 
 		case AC_PKT_DPD_RESP:
 			vpn_progress(vpninfo, PRG_DEBUG, _("Got DTLS DPD response\n"));
+			udp_rtt_sample(vpninfo);
 			break;
 
 		case AC_PKT_KEEPALIVE:
@@ -382,6 +384,8 @@ int dtls_mainloop(struct openconnect_info *vpninfo, int *timeout)
 		if (DTLS_SEND(vpninfo->dtls_ssl, &magic_pkt, 1) != 1)
 			vpn_progress(vpninfo, PRG_ERR,
 				     _("Failed to send DPD request. Expect disconnect\n"));
+		else
+			udp_rtt_start(vpninfo);
 
 		/* last_dpd will just have been set */
 		vpninfo->dtls_times.last_tx = vpninfo->dtls_times.last_dpd;
@@ -391,7 +395,7 @@ int dtls_mainloop(struct openconnect_info *vpninfo, int *timeout)
 	case KA_KEEPALIVE:
 		/* No need to send an explicit keepalive
 		   if we have real data to send */
-		if (vpninfo->outgoing_queue.head)
+		if (vpninfo->outgoing_queue.count)
 			break;
 
 		vpn_progress(vpninfo, PRG_DEBUG, _("Send DTLS Keepalive\n"));
@@ -410,33 +414,22 @@ int dtls_mainloop(struct openconnect_info *vpninfo, int *timeout)
 
 	/* Service outgoing packet queue */
 	unmonitor_write_fd(vpninfo, dtls);
-	while (vpninfo->outgoing_queue.head) {
-		struct pkt *this = dequeue_packet(&vpninfo->outgoing_queue);
+	while ((this = dequeue_outgoing(vpninfo))) {
 		struct pkt *send_pkt = this;
 		int ret;
 
 		/* If TOS optname is set, we want to copy the TOS/TCLASS header
 		   to the outer UDP packet */
 		if (vpninfo->dtls_tos_optname) {
-			int valid=1;
-			int tos;
-
-			switch(this->data[0] >> 4) {
-				case 4:
-					tos = this->data[1];
-					break;
-				case 6:
-					tos = (load_be16(this->data) >> 4) & 0xff;
-					break;
-				default:
-					vpn_progress(vpninfo, PRG_ERR,
-						     _("Unknown packet (len %d) received: %02x %02x %02x %02x...\n"),
-						     this->len, this->data[0], this->data[1], this->data[2], this->data[3]);
-					valid = 0;
-			}
+			int tos = pkt_get_tos(this);
+
+			if (tos < 0)
+				vpn_progress(vpninfo, PRG_ERR,
+					     _("Unknown packet (len %d) received: %02x %02x %02x %02x...\n"),
+					     this->len, this->data[0], this->data[1], this->data[2], this->data[3]);
 
 			/* set the actual value */
-			if (valid && tos != vpninfo->dtls_tos_current) {
+			if (tos >= 0 && tos != vpninfo->dtls_tos_current) {
 				vpn_progress(vpninfo, PRG_DEBUG, _("TOS this: %d, TOS last: %d\n"),
 					     tos, vpninfo->dtls_tos_current);
 				if (setsockopt(vpninfo->dtls_fd, vpninfo->dtls_tos_proto,
@@ -467,7 +460,7 @@ int dtls_mainloop(struct openconnect_info *vpninfo, int *timeout)
 
 			if (ret == SSL_ERROR_WANT_WRITE) {
 				monitor_write_fd(vpninfo, dtls);
-				requeue_packet(&vpninfo->outgoing_queue, this);
+				requeue_outgoing(vpninfo, this);
 			} else if (ret != SSL_ERROR_WANT_READ) {
 				/* If it's a real error, kill the DTLS connection and
 				   requeue the packet to be sent over SSL */
@@ -476,7 +469,7 @@ int dtls_mainloop(struct openconnect_info *vpninfo, int *timeout)
 					     ret);
 				openconnect_report_ssl_errors(vpninfo);
 				dtls_reconnect(vpninfo);
-				requeue_packet(&vpninfo->outgoing_queue, this);
+				requeue_outgoing(vpninfo, this);
 				work_done = 1;
 			}
 			return work_done;
@@ -495,7 +488,7 @@ int dtls_mainloop(struct openconnect_info *vpninfo, int *timeout)
 				monitor_write_fd(vpninfo, dtls);
 			}
 
-			requeue_packet(&vpninfo->outgoing_queue, this);
+			requeue_outgoing(vpninfo, this);
 			return work_done;
 		}
 #endif
@@ -108,13 +108,13 @@ int esp_send_probes(struct openconnect_info *vpninfo)
 
 	pkt->len = 1;
 	pkt->data[0] = 0;
-	pktlen = encrypt_esp_packet(vpninfo, pkt);
+	pktlen = encrypt_esp_packet(vpninfo, pkt, 0x04);
 	if (pktlen >= 0)
 		send(vpninfo->dtls_fd, (void *)&pkt->esp, pktlen, 0);
 
 	pkt->len = 1;
 	pkt->data[0] = 0;
-	pktlen = encrypt_esp_packet(vpninfo, pkt);
+	pktlen = encrypt_esp_packet(vpninfo, pkt, 0x04);
 	if (pktlen >= 0)
 		send(vpninfo->dtls_fd, (void *)&pkt->esp, pktlen, 0);
 
@@ -125,6 +125,26 @@ int esp_send_probes(struct openconnect_info *vpninfo)
 	return 0;
 };
 
+/* The same probe padded with zeroes, which the server echoes back */
+int esp_send_mtu_probe(struct openconnect_info *vpninfo, int size)
+{
+	struct pkt *pkt = alloc_pkt(vpninfo, size + vpninfo->pkt_trailer);
+	int pktlen, ret = -EIO;
+
+	if (!pkt)
+		return -ENOMEM;
+
+	/* All zeroes, which esp_catch_probe() recognises */
+	memset(pkt->data, 0, size);
+	pkt->len = size;
+	pktlen = encrypt_esp_packet(vpninfo, pkt, 0x04);
+	if (pktlen >= 0)
+		ret = send(vpninfo->dtls_fd, (void *)&pkt->esp, pktlen, 0);
+	free_pkt(vpninfo, pkt);
+
+	return ret < 0 ? -EIO : 0;
+}
+
 static uint16_t csum(uint16_t *buf, int nwords)
 {
 	uint32_t sum = 0;
@@ -135,6 +155,56 @@ static uint16_t csum(uint16_t *buf, int nwords)
 	return htons((uint16_t)(~sum));
 }
 
+/* Sends one of the GlobalProtect magic pings, padded to 'len' bytes
+ * if that is more than the minimum */
+static int send_gp_ping(struct openconnect_info *vpninfo, int len, int seq)
+{
+	static char magic[16] = "monitor\x00\x00pan ha ";
+	struct pkt *pkt;
+	struct ip *iph;
+	struct icmp *icmph;
+	int pktlen, ret = -EIO;
+
+	len = MAX(len, (int)(sizeof(*iph) + ICMP_MINLEN + sizeof(magic)));
+
+	/* One spare byte for the ICMP checksum of an odd length */
+	pkt = malloc(sizeof(*pkt) + len + 1 + vpninfo->pkt_trailer);
+	if (!pkt)
+		return -ENOMEM;
+
+	memset(pkt, 0, sizeof(*pkt) + len + 1);
+	pkt->len = len;
+	iph = (void *)pkt->data;
+	icmph = (void *)(pkt->data + sizeof(*iph));
+
+	/* IP Header */
+	iph->ip_hl = 5;
+	iph->ip_v = 4;
+	iph->ip_len = htons(len);
+	iph->ip_id = htons(0x4747); /* what the Windows client uses */
+	iph->ip_off = htons(IP_DF); /* don't fragment, frag offset = 0 */
+	iph->ip_ttl = 64; /* hops */
+	iph->ip_p = 1; /* ICMP */
+	iph->ip_src.s_addr = inet_addr(vpninfo->ip_info.addr);
+	iph->ip_dst.s_addr = vpninfo->esp_magic;
+	iph->ip_sum = csum((uint16_t *)iph, sizeof(*iph)/2);
+
+	/* ICMP echo request */
+	icmph->icmp_type = ICMP_ECHO;
+	icmph->icmp_hun.ih_idseq.icd_id = htons(0x4747);
+	icmph->icmp_hun.ih_idseq.icd_seq = htons(seq);
+	/* required to get gateway to respond */
+	memcpy(pkt->data + sizeof(*iph) + ICMP_MINLEN, magic, sizeof(magic));
+	icmph->icmp_cksum = csum((uint16_t *)icmph, (len - sizeof(*iph) + 1)/2);
+
+	pktlen = encrypt_esp_packet(vpninfo, pkt, 0x04);
+	if (pktlen >= 0)
+		ret = send(vpninfo->dtls_fd, (void *)&pkt->esp, pktlen, 0);
+	free(pkt);
+
+	return ret < 0 ? -EIO : 0;
+}
+
 int esp_send_probes_gp(struct openconnect_info *vpninfo)
 {
 	/* The GlobalProtect VPN initiates and maintains the ESP connection
@@ -155,15 +225,7 @@ int esp_send_probes_gp(struct openconnect_info *vpninfo)
 	 *
 	 *    Don't blame me. I didn't design this.
 	 */
-	static char magic[16] = "monitor\x00\x00pan ha ";
-
-	int pktlen, seq;
-	struct pkt *pkt = malloc(sizeof(*pkt) + sizeof(struct ip) + ICMP_MINLEN + sizeof(magic) + vpninfo->pkt_trailer);
-	struct ip *iph = (void *)pkt->data;
-	struct icmp *icmph = (void *)(pkt->data + sizeof(*iph));
-	char *pmagic = (void *)(pkt->data + sizeof(*iph) + ICMP_MINLEN);
-	if (!pkt)
-		return -ENOMEM;
+	int seq;
 
 	if (vpninfo->dtls_fd == -1) {
 		int fd = udp_connect(vpninfo);
@@ -179,43 +241,25 @@ int esp_send_probes_gp(struct openconnect_info *vpninfo)
 	}
 
 	for (seq=1; seq <= (vpninfo->dtls_state==DTLS_CONNECTED ? 1 : 3); seq++) {
-		memset(pkt, 0, sizeof(*pkt) + sizeof(*iph) + ICMP_MINLEN + sizeof(magic));
-		pkt->len = sizeof(struct ip) + ICMP_MINLEN + sizeof(magic);
-
-		/* IP Header */
-		iph->ip_hl = 5;
-		iph->ip_v = 4;
-		iph->ip_len = htons(sizeof(*iph) + ICMP_MINLEN + sizeof(magic));
-		iph->ip_id = htons(0x4747); /* what the Windows client uses */
-		iph->ip_off = htons(IP_DF); /* don't fragment, frag offset = 0 */
-		iph->ip_ttl = 64; /* hops */
-		iph->ip_p = 1; /* ICMP */
-		iph->ip_src.s_addr = inet_addr(vpninfo->ip_info.addr);
-		iph->ip_dst.s_addr = vpninfo->esp_magic;
-		iph->ip_sum = csum((uint16_t *)iph, sizeof(*iph)/2);
-
-		/* ICMP echo request */
-		icmph->icmp_type = ICMP_ECHO;
-		icmph->icmp_hun.ih_idseq.icd_id = htons(0x4747);
-		icmph->icmp_hun.ih_idseq.icd_seq = htons(seq);
-		memcpy(pmagic, magic, sizeof(magic)); /* required to get gateway to respond */
-		icmph->icmp_cksum = csum((uint16_t *)icmph, (ICMP_MINLEN+sizeof(magic))/2);
-
-		pktlen = encrypt_esp_packet(vpninfo, pkt);
-		if (pktlen >= 0)
-			send(vpninfo->dtls_fd, (void *)&pkt->esp, pktlen, 0);
+		if (send_gp_ping(vpninfo, 0, seq) == -ENOMEM)
+			return -ENOMEM;
 	}
 
-	free(pkt);
-
 	vpninfo->dtls_times.last_tx = time(&vpninfo->new_dtls_started);
 
 	return 0;
 }
 
+/* The gateway echoes the whole ping back, padding and all */
+int esp_send_mtu_probe_gp(struct openconnect_info *vpninfo, int size)
+{
+	return send_gp_ping(vpninfo, size, 0);
+}
+
 int esp_catch_probe(struct openconnect_info *vpninfo, struct pkt *pkt)
 {
-	return (pkt->len == 1 && pkt->data[0] == 0);
+	/* No IP packet starts with a zero byte */
+	return (pkt->len >= 1 && pkt->data[0] == 0);
 }
 
 int esp_catch_probe_gp(struct openconnect_info *vpninfo, struct pkt *pkt)
@@ -241,6 +285,26 @@ int esp_setup(struct openconnect_info *vpninfo, int dtls_attempt_period)
 
 	vpninfo->dtls_attempt_period = dtls_attempt_period;
 
+	/* The MTU may have been renegotiated */
+	memset(&vpninfo->esp_pmtud, 0, sizeof(vpninfo->esp_pmtud));
+
+	/* If the server accepts LZO, we compress outgoing packets when it
+	 * helps, into the same deflate_pkt that CSTP would use. */
+	if (vpninfo->esp_compr) {
+		int bufsize = compr_init(vpninfo, COMPR_LZO);
+
+		if (bufsize > vpninfo->deflate_pkt_size) {
+			free(vpninfo->deflate_pkt);
+			vpninfo->deflate_pkt = calloc(1, sizeof(struct pkt) + bufsize);
+			vpninfo->deflate_pkt_size = vpninfo->deflate_pkt ? bufsize : 0;
+		}
+		if (bufsize <= 0 || !vpninfo->deflate_pkt) {
+			vpn_progress(vpninfo, PRG_ERR,
+				     _("Sending ESP packets uncompressed\n"));
+			vpninfo->esp_compr = 0;
+		}
+	}
+
 	print_esp_keys(vpninfo, _("incoming"), &vpninfo->esp_in[vpninfo->current_esp_in]);
 	print_esp_keys(vpninfo, _("outgoing"), &vpninfo->esp_out);
 
@@ -251,6 +315,188 @@ int esp_setup(struct openconnect_info *vpninfo, int dtls_attempt_period)
 	return 0;
 }
 
+/* Returns -EAGAIN if the socket has no room for the packet, which should
+ * then be kept and retried when it becomes writable. Any other failure
+ * is logged and the packet is lost, as it would be on the wire. */
+static int send_esp_packet(struct openconnect_info *vpninfo, struct pkt *pkt, int len)
+{
+	int ret = send(vpninfo->dtls_fd, (void *)&pkt->esp, len, 0);
+
+	if (ret < 0) {
+		if (errno == ENOBUFS || errno == EAGAIN || errno == EWOULDBLOCK)
+			return -EAGAIN;
+
+		/* A real error in sending. Fall back to TCP? */
+		vpn_progress(vpninfo, PRG_ERR,
+			     _("Failed to send ESP packet: %s\n"),
+			     strerror(errno));
+		return -EIO;
+	}
+
+	vpninfo->dtls_times.last_tx = time(NULL);
+	vpn_progress(vpninfo, PRG_TRACE, _("Sent ESP packet of %d bytes\n"), len);
+	return 0;
+}
+
+/*
+ * Packetization-layer path MTU discovery (RFC8899). The MTU we start
+ * with is just calculated from what the server or the TCP connection
+ * told us, which can be too big for PPPoE or nested tunnels, and then
+ * full-sized packets are fragmented or silently dropped. So once ESP is
+ * up, we send probes padded to the MTU, and the matching reply tells us
+ * that size got through. If it doesn't, we binary search downwards, and
+ * set the MTU to the largest size that was confirmed. The search is
+ * repeated every PMTUD_RAISE_TIMER seconds in case the path changes.
+ */
+#define PMTUD_MIN_MTU 576
+#define PMTUD_MAX_PROBES 3
+#define PMTUD_PROBE_TIMEOUT 3
+#define PMTUD_RAISE_TIMER 600
+/* Near enough, since ESP pads to the cipher block size anyway */
+#define PMTUD_STEP 16
+
+/* The next size to probe, or zero when the search is finished */
+static int esp_pmtud_next(struct esp_pmtud *p)
+{
+	int lo = MAX(p->lo, PMTUD_MIN_MTU);
+
+	if (p->lo == p->max)
+		return 0;
+	if (p->hi > p->max)
+		return p->max;
+	if (p->hi - lo <= PMTUD_STEP)
+		return 0;
+	return (lo + p->hi) / 2;
+}
+
+static void esp_pmtud_done(struct openconnect_info *vpninfo, time_t now)
+{
+	struct esp_pmtud *p = &vpninfo->esp_pmtud;
+
+	p->hi = 0;
+	p->due = now + PMTUD_RAISE_TIMER;
+
+	if (!p->lo) {
+		vpn_progress(vpninfo, PRG_DEBUG,
+			     _("No ESP MTU probes were answered; keeping MTU %d\n"),
+			     vpninfo->ip_info.mtu);
+		return;
+	}
+	if (p->lo == vpninfo->ip_info.mtu) {
+		vpn_progress(vpninfo, PRG_DEBUG,
+			     _("No change in ESP MTU after detection (was %d)\n"),
+			     p->lo);
+		return;
+	}
+
+	vpn_progress(vpninfo, PRG_INFO,
+		     _("Detected ESP path MTU of %d bytes (was %d)\n"),
+		     p->lo, vpninfo->ip_info.mtu);
+	vpninfo->ip_info.mtu = p->lo;
+	/* Only if we configured the device ourselves; with a tun fd or
+	 * packet callbacks from the application, there's no name for it */
+	if (tun_is_up(vpninfo) && !vpninfo->script_tun && vpninfo->ifname)
+		os_set_tun_mtu(vpninfo);
+}
+
+/* The probes mustn't be fragmented locally, or they would get through
+ * whatever the path MTU. On Linux we can ask for that just for them. */
+static int send_mtu_probe(struct openconnect_info *vpninfo, int size)
+{
+#if defined(IP_MTU_DISCOVER) && defined(IP_PMTUDISC_PROBE)
+	int level = IPPROTO_IP, opt = IP_MTU_DISCOVER, val = IP_PMTUDISC_PROBE;
+	int old, restore, ret;
+	socklen_t oldlen = sizeof(old);
+
+#if defined(IPV6_MTU_DISCOVER) && defined(IPV6_PMTUDISC_PROBE)
+	if (vpninfo->dtls_addr && vpninfo->dtls_addr->sa_family == AF_INET6) {
+		level = IPPROTO_IPV6;
+		opt = IPV6_MTU_DISCOVER;
+		val = IPV6_PMTUDISC_PROBE;
+	}
+#endif
+	restore = !getsockopt(vpninfo->dtls_fd, level, opt, &old, &oldlen) &&
+		!setsockopt(vpninfo->dtls_fd, level, opt, &val, sizeof(val));
+
+	ret = vpninfo->proto->udp_send_mtu_probe(vpninfo, size);
+
+	if (restore)
+		setsockopt(vpninfo->dtls_fd, level, opt, &old, sizeof(old));
+	return ret;
+#else
+	return vpninfo->proto->udp_send_mtu_probe(vpninfo, size);
+#endif
+}
+
+static void esp_pmtud(struct openconnect_info *vpninfo, int *timeout)
+{
+	struct esp_pmtud *p = &vpninfo->esp_pmtud;
+	time_t now = time(NULL);
+
+	if (!vpninfo->proto->udp_send_mtu_probe)
+		return;
+
+	if (!p->max) {
+		p->max = vpninfo->ip_info.mtu;
+		p->due = now;
+	}
+	if (!ka_check_deadline(timeout, now, p->due))
+		return;
+
+	if (!p->hi) {
+		/* Start (again) from the top */
+		p->lo = 0;
+		p->hi = p->max + 1;
+		p->probe = 0;
+	} else if (p->probe && ++p->tries < PMTUD_MAX_PROBES) {
+		/* It may just have been lost; send it again */
+		vpn_progress(vpninfo, PRG_TRACE,
+			     _("No reply to ESP MTU probe of %d bytes\n"),
+			     p->probe);
+	} else if (p->probe) {
+		p->hi = p->probe;
+		p->probe = 0;
+	}
+
+	while (1) {
+		if (!p->probe) {
+			p->probe = esp_pmtud_next(p);
+			if (!p->probe)
+				break;
+			p->tries = 0;
+		}
+		vpn_progress(vpninfo, PRG_TRACE,
+			     _("Sending ESP MTU probe of %d bytes\n"), p->probe);
+		if (!send_mtu_probe(vpninfo, p->probe)) {
+			p->due = now + PMTUD_PROBE_TIMEOUT;
+			ka_check_deadline(timeout, now, p->due);
+			return;
+		}
+		/* Most likely EMSGSIZE, which is as good as an answer */
+		p->hi = p->probe;
+		p->probe = 0;
+	}
+
+	esp_pmtud_done(vpninfo, now);
+	ka_check_deadline(timeout, now, p->due);
+}
+
+/* A probe reply of the size in flight confirms that size */
+static int esp_pmtud_catch(struct openconnect_info *vpninfo, struct pkt *pkt)
+{
+	struct esp_pmtud *p = &vpninfo->esp_pmtud;
+
+	if (!p->probe || pkt->len != p->probe)
+		return 0;
+
+	vpn_progress(vpninfo, PRG_TRACE,
+		     _("Received reply to ESP MTU probe of %d bytes\n"), p->probe);
+	p->lo = p->probe;
+	p->probe = 0;
+	p->due = time(NULL);
+	return 1;
+}
+
 int esp_mainloop(struct openconnect_info *vpninfo, int *timeout)
 {
 	struct esp *esp = &vpninfo->esp_in[vpninfo->current_esp_in];
@@ -277,7 +523,7 @@ int esp_mainloop(struct openconnect_info *vpninfo, int *timeout)
 		struct pkt *pkt;
 
 		if (!vpninfo->dtls_pkt) {
-			vpninfo->dtls_pkt = malloc(sizeof(struct pkt) + len);
+			vpninfo->dtls_pkt = alloc_pkt(vpninfo, len);
 			if (!vpninfo->dtls_pkt) {
 				vpn_progress(vpninfo, PRG_ERR, _("Allocation failed\n"));
 				break;
@@ -344,6 +590,9 @@ int esp_mainloop(struct openconnect_info *vpninfo, int *timeout)
 
 		if (vpninfo->proto->udp_catch_probe) {
 			if (vpninfo->proto->udp_catch_probe(vpninfo, pkt)) {
+				if (esp_pmtud_catch(vpninfo, pkt))
+					continue;
+				udp_rtt_sample(vpninfo);
 				if (vpninfo->dtls_state == DTLS_SLEEPING) {
 					vpn_progress(vpninfo, PRG_INFO,
 						     _("ESP session established with server\n"));
@@ -354,7 +603,10 @@ int esp_mainloop(struct openconnect_info *vpninfo, int *timeout)
 			}
 		}
 		if (pkt->data[len - 1] == 0x05) {
-			struct pkt *newpkt = malloc(sizeof(*pkt) + receive_mtu + vpninfo->pkt_trailer);
+			/* The trailer leaves room for AV_LZO_OUTPUT_PADDING, and
+			 * keeps this the same size as the receive packets so
+			 * they can share the pool. */
+			struct pkt *newpkt = alloc_pkt(vpninfo, receive_mtu + vpninfo->pkt_trailer);
 			int newlen = receive_mtu;
 			if (!newpkt) {
 				vpn_progress(vpninfo, PRG_ERR,
@@ -365,7 +617,7 @@ int esp_mainloop(struct openconnect_info *vpninfo, int *timeout)
 					    pkt->data, &pkt->len) || pkt->len) {
 				vpn_progress(vpninfo, PRG_ERR,
 					     _("LZO decompression of ESP packet failed\n"));
-				free(newpkt);
+				free_pkt(vpninfo, newpkt);
 				continue;
 			}
 			newpkt->len = receive_mtu - newlen;
@@ -382,6 +634,8 @@ int esp_mainloop(struct openconnect_info *vpninfo, int *timeout)
 	if (vpninfo->dtls_state != DTLS_CONNECTED)
 		return 0;
 
+	esp_pmtud(vpninfo, timeout);
+
 	switch (keepalive_action(&vpninfo->dtls_times, timeout)) {
 	case KA_REKEY:
 		vpn_progress(vpninfo, PRG_ERR, _("Rekey not implemented for ESP\n"));
@@ -397,8 +651,10 @@ int esp_mainloop(struct openconnect_info *vpninfo, int *timeout)
 
 	case KA_DPD:
 		vpn_progress(vpninfo, PRG_DEBUG, _("Send ESP probes for DPD\n"));
-		if (vpninfo->proto->udp_send_probes)
+		if (vpninfo->proto->udp_send_probes) {
+			udp_rtt_start(vpninfo);
 			vpninfo->proto->udp_send_probes(vpninfo);
+		}
 		work_done = 1;
 		break;
 
@@ -410,43 +666,66 @@ int esp_mainloop(struct openconnect_info *vpninfo, int *timeout)
 		break;
 	}
 	unmonitor_write_fd(vpninfo, dtls);
-	while ((this = dequeue_packet(&vpninfo->outgoing_queue))) {
-		int len;
-
-		len = encrypt_esp_packet(vpninfo, this);
-		if (len > 0) {
-			ret = send(vpninfo->dtls_fd, (void *)&this->esp, len, 0);
-			if (ret < 0) {
-				/* Not that this is likely to happen with UDP, but... */
-				if (errno == ENOBUFS || errno == EAGAIN || errno == EWOULDBLOCK) {
-					monitor_write_fd(vpninfo, dtls);
-					/* XXX: Keep the packet somewhere? */
-					free(this);
-					return work_done;
-				} else {
-					/* A real error in sending. Fall back to TCP? */
-					vpn_progress(vpninfo, PRG_ERR,
-						     _("Failed to send ESP packet: %s\n"),
-						     strerror(errno));
-				}
-			} else {
-				vpninfo->dtls_times.last_tx = time(NULL);
 
-				vpn_progress(vpninfo, PRG_TRACE, _("Sent ESP packet of %d bytes\n"),
-					     len);
-			}
-		} else {
-			/* XXX: Fall back to TCP transport? */
+	/* Anything left over from last time goes first, so that the
+	 * sequence numbers still arrive in order. */
+	while ((this = vpninfo->esp_backlog.head)) {
+		ret = send_esp_packet(vpninfo, this, this->len);
+		if (ret == -EAGAIN) {
+			monitor_write_fd(vpninfo, dtls);
+			break;
 		}
+		dequeue_packet(&vpninfo->esp_backlog);
 		free(this);
 		work_done = 1;
 	}
 
+	/* Once the socket is blocked, we carry on encrypting into the
+	 * backlog until that is full too. Only then will the outgoing
+	 * queue fill up and make tun_mainloop() stop reading. */
+	while (vpninfo->esp_backlog.count < vpninfo->max_qlen &&
+	       (this = dequeue_outgoing(vpninfo))) {
+		int len, next_hdr = 0x04; /* Legacy IP */
+
+		work_done = 1;
+		if (vpninfo->esp_compr &&
+		    !compress_packet(vpninfo, COMPR_LZO, this)) {
+			vpn_progress(vpninfo, PRG_TRACE,
+				     _("LZO compressed %d bytes into %d\n"),
+				     this->len, vpninfo->deflate_pkt->len);
+			this->len = vpninfo->deflate_pkt->len;
+			memcpy(this->data, vpninfo->deflate_pkt->data, this->len);
+			next_hdr = 0x05;
+		}
+		len = encrypt_esp_packet(vpninfo, this, next_hdr);
+		if (len <= 0) {
+			/* XXX: Fall back to TCP transport? */
+			free(this);
+			continue;
+		}
+
+		if (!vpninfo->esp_backlog.head) {
+			ret = send_esp_packet(vpninfo, this, len);
+			if (ret != -EAGAIN) {
+				free(this);
+				continue;
+			}
+			monitor_write_fd(vpninfo, dtls);
+		}
+		this->len = len;
+		queue_packet(&vpninfo->esp_backlog, this);
+	}
+
 	return work_done;
 }
 
 void esp_close(struct openconnect_info *vpninfo)
 {
+	struct pkt *this;
+
+	while ((this = dequeue_packet(&vpninfo->esp_backlog)))
+		free(this);
+
 	/* We close and reopen the socket in case we roamed and our
 	   local IP address has changed. */
 	if (vpninfo->dtls_fd != -1) {
@@ -458,6 +737,10 @@ void esp_close(struct openconnect_info *vpninfo)
 	}
 	if (vpninfo->dtls_state > DTLS_DISABLED)
 		vpninfo->dtls_state = DTLS_SLEEPING;
+
+	/* Search for the MTU again once we're reconnected */
+	vpninfo->esp_pmtud.hi = vpninfo->esp_pmtud.probe = 0;
+	vpninfo->esp_pmtud.due = 0;
 }
 
 void esp_close_secret(struct openconnect_info *vpninfo)
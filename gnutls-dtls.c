@@ -104,6 +104,16 @@ void append_dtls_ciphers(struct openconnect_info *vpninfo, struct oc_text_buf *b
 	gnutls_mac_algorithm_t mac;
 	gnutls_priority_t cache;
 	uint32_t used = 0;
+	struct oc_session_group *group = vpninfo->session_group;
+	int start = buf->pos;
+
+	/* It's the same for every session in the group with the same
+	 * priority string, so only work it out once */
+	if (group && group->dtls_ciphers_prio &&
+	    !strcmp(group->dtls_ciphers_prio, vpninfo->gnutls_prio)) {
+		buf_append(buf, "%s", group->dtls_ciphers);
+		return;
+	}
 
 	buf_append(buf, "PSK-NEGOTIATE");
 	first = 0;
@@ -137,6 +147,18 @@ void append_dtls_ciphers(struct openconnect_info *vpninfo, struct oc_text_buf *b
 	}
 
 	gnutls_priority_deinit(cache);
+
+	if (group && !buf_error(buf)) {
+		free(group->dtls_ciphers_prio);
+		free(group->dtls_ciphers);
+		group->dtls_ciphers_prio = strdup(vpninfo->gnutls_prio);
+		group->dtls_ciphers = strdup(buf->data + start);
+		if (!group->dtls_ciphers_prio || !group->dtls_ciphers) {
+			free(group->dtls_ciphers_prio);
+			free(group->dtls_ciphers);
+			group->dtls_ciphers_prio = group->dtls_ciphers = NULL;
+		}
+	}
 }
 #endif
 
@@ -235,6 +257,12 @@ static int start_dtls_psk_handshake(struct openconnect_info *vpninfo, int dtls_f
 		goto fail;
 	}
 
+	/* The PSK is derived from the CSTP session, so a cached DTLS session
+	 * is only kept for as long as that CSTP connection lasts. */
+	if (vpninfo->dtls_session.size)
+		gnutls_session_set_data(dtls_ssl, vpninfo->dtls_session.data,
+					vpninfo->dtls_session.size);
+
 	buf_free(prio);
 	vpninfo->dtls_ssl = dtls_ssl;
 	return 0;
@@ -310,6 +338,17 @@ int start_dtls_handshake(struct openconnect_info *vpninfo, int dtls_fd)
 	return 0;
 }
 
+static void save_dtls_session(struct openconnect_info *vpninfo)
+{
+	gnutls_datum_t data;
+
+	if (gnutls_session_get_data2(vpninfo->dtls_ssl, &data))
+		return;
+
+	gnutls_free(vpninfo->dtls_session.data);
+	vpninfo->dtls_session = data;
+}
+
 int dtls_try_handshake(struct openconnect_info *vpninfo)
 {
 	int err = gnutls_handshake(vpninfo->dtls_ssl);
@@ -340,6 +379,12 @@ int dtls_try_handshake(struct openconnect_info *vpninfo)
 					     data_mtu);
 				vpninfo->ip_info.mtu = data_mtu;
 			}
+
+			if (gnutls_session_is_resumed(vpninfo->dtls_ssl))
+				vpn_progress(vpninfo, PRG_DEBUG,
+					     _("Resumed previous DTLS session\n"));
+			else
+				save_dtls_session(vpninfo);
 		} else {
 			if (!gnutls_session_is_resumed(vpninfo->dtls_ssl)) {
 				/* Someone attempting to hijack the DTLS session?
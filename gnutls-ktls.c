@@ -0,0 +1,351 @@
+/*
+ * OpenConnect (SSL + DTLS) VPN client
+ *
+ * Copyright © 2008-2015 Intel Corporation.
+ *
+ * Author: David Woodhouse <dwmw2@infradead.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ */
+
+#include <config.h>
+
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+
+#include "gnutls.h"
+
+#ifdef HAVE_KTLS
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <linux/tls.h>
+#ifndef SOL_TLS
+#define SOL_TLS 282
+#endif
+#ifndef TCP_ULP
+#define TCP_ULP 31
+#endif
+#define TLS_RECORD_APPLICATION_DATA 23
+
+/* Once a direction has been handed to the kernel with TCP_ULP "tls", the
+ * GnuTLS session state for it is stale and plain socket calls must be used.
+ * The kernel emits and consumes whole records; a non-application record
+ * arriving on the receive side (alert, renegotiation) is reported through
+ * the TLS_GET_RECORD_TYPE cmsg and we just treat it as a fatal error. */
+int ktls_nonblock_recv(struct openconnect_info *vpninfo, void *buf, int maxlen)
+{
+	char cbuf[CMSG_SPACE(sizeof(unsigned char))];
+	struct iovec iov = { buf, maxlen };
+	struct msghdr msg;
+	struct cmsghdr *cmsg;
+	int ret;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = cbuf;
+	msg.msg_controllen = sizeof(cbuf);
+
+	ret = recvmsg(vpninfo->ssl_fd, &msg, MSG_DONTWAIT);
+	if (ret < 0) {
+		if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+			return 0;
+		vpn_progress(vpninfo, PRG_ERR,
+			     _("kTLS read error: %s; reconnecting.\n"),
+			     strerror(errno));
+		return -EIO;
+	}
+	if (!ret) {
+		vpn_progress(vpninfo, PRG_ERR,
+			     _("kTLS socket closed by peer; reconnecting.\n"));
+		return -EIO;
+	}
+
+	cmsg = CMSG_FIRSTHDR(&msg);
+	if (cmsg && cmsg->cmsg_level == SOL_TLS &&
+	    cmsg->cmsg_type == TLS_GET_RECORD_TYPE &&
+	    *(unsigned char *)CMSG_DATA(cmsg) != TLS_RECORD_APPLICATION_DATA) {
+		vpn_progress(vpninfo, PRG_ERR,
+			     _("kTLS received unexpected record type %d; reconnecting.\n"),
+			     *(unsigned char *)CMSG_DATA(cmsg));
+		return -EIO;
+	}
+	return ret;
+}
+
+/* Returns 1 once nothing is left over from a short write, 0 if the
+ * socket is still full, or -1 on error. */
+int ktls_flush_tail(struct openconnect_info *vpninfo)
+{
+	while (vpninfo->ssl_ktls_tail_len) {
+		int ret = send(vpninfo->ssl_fd, vpninfo->ssl_ktls_tail,
+			       vpninfo->ssl_ktls_tail_len, MSG_DONTWAIT | MSG_NOSIGNAL);
+
+		if (ret < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+				monitor_write_fd(vpninfo, ssl);
+				return 0;
+			}
+			vpn_progress(vpninfo, PRG_ERR, _("kTLS send failed: %s\n"),
+				     strerror(errno));
+			return -1;
+		}
+		vpninfo->ssl_ktls_tail_len -= ret;
+		memmove(vpninfo->ssl_ktls_tail, vpninfo->ssl_ktls_tail + ret,
+			vpninfo->ssl_ktls_tail_len);
+	}
+	return 1;
+}
+
+int ktls_nonblock_send(struct openconnect_info *vpninfo, void *buf, int buflen)
+{
+	int ret = ktls_flush_tail(vpninfo);
+
+	if (ret <= 0)
+		return ret;
+
+	ret = send(vpninfo->ssl_fd, buf, buflen, MSG_DONTWAIT | MSG_NOSIGNAL);
+	if (ret < 0) {
+		if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+			monitor_write_fd(vpninfo, ssl);
+			return 0;
+		}
+		vpn_progress(vpninfo, PRG_ERR, _("kTLS send failed: %s\n"),
+			     strerror(errno));
+		return -1;
+	}
+
+	/* The callers expect all-or-nothing semantics, as with a TLS record,
+	 * so take the whole thing and send the rest when there's room. It
+	 * goes out before anything else is accepted. */
+	if (ret < buflen) {
+		char *tail = realloc(vpninfo->ssl_ktls_tail, buflen - ret);
+
+		if (!tail) {
+			vpn_progress(vpninfo, PRG_ERR,
+				     _("Failed to allocate kTLS send buffer\n"));
+			return -1;
+		}
+		memcpy(tail, (char *)buf + ret, buflen - ret);
+		vpninfo->ssl_ktls_tail = tail;
+		vpninfo->ssl_ktls_tail_len = buflen - ret;
+		monitor_write_fd(vpninfo, ssl);
+	}
+	return buflen;
+}
+
+static int ktls_wait_writable(struct openconnect_info *vpninfo)
+{
+	fd_set rd_set, wr_set;
+	int maxfd = vpninfo->ssl_fd;
+
+	FD_ZERO(&rd_set);
+	FD_ZERO(&wr_set);
+	FD_SET(vpninfo->ssl_fd, &wr_set);
+	cmd_fd_set(vpninfo, &rd_set, &maxfd);
+	select(maxfd + 1, &rd_set, &wr_set, NULL, NULL);
+	if (is_cancel_pending(vpninfo, &rd_set)) {
+		vpn_progress(vpninfo, PRG_ERR, _("SSL write cancelled\n"));
+		return -EINTR;
+	}
+	return 0;
+}
+
+static int openconnect_ktls_write(struct openconnect_info *vpninfo, char *buf, size_t len)
+{
+	size_t done = 0;
+	int ret;
+
+	while (done < len) {
+		ret = ktls_nonblock_send(vpninfo, buf + done, len - done);
+		if (ret < 0)
+			return -EIO;
+		if (!ret && (ret = ktls_wait_writable(vpninfo)))
+			return ret;
+		done += ret;
+	}
+
+	/* A request has to be on the wire before we wait for its answer */
+	while ((ret = ktls_flush_tail(vpninfo)) <= 0) {
+		if (ret < 0)
+			return -EIO;
+		if ((ret = ktls_wait_writable(vpninfo)))
+			return ret;
+	}
+	return len;
+}
+
+static int openconnect_ktls_raw_read(struct openconnect_info *vpninfo, char *buf, size_t len)
+{
+	while (1) {
+		fd_set rd_set;
+		int maxfd = vpninfo->ssl_fd;
+		int ret = ktls_nonblock_recv(vpninfo, buf, len);
+
+		if (ret)
+			return ret;
+
+		FD_ZERO(&rd_set);
+		FD_SET(vpninfo->ssl_fd, &rd_set);
+		cmd_fd_set(vpninfo, &rd_set, &maxfd);
+		select(maxfd + 1, &rd_set, NULL, NULL, NULL);
+		if (is_cancel_pending(vpninfo, &rd_set)) {
+			vpn_progress(vpninfo, PRG_ERR, _("SSL read cancelled\n"));
+			return -EINTR;
+		}
+	}
+}
+
+static int openconnect_ktls_read(struct openconnect_info *vpninfo, char *buf, size_t len)
+{
+	return ssl_buffered_read(vpninfo, buf, len, openconnect_ktls_raw_read);
+}
+
+static int openconnect_ktls_gets(struct openconnect_info *vpninfo, char *buf, size_t len)
+{
+	return ssl_buffered_gets(vpninfo, buf, len, openconnect_ktls_raw_read);
+}
+
+static int ktls_set_crypto_info(struct openconnect_info *vpninfo, int optname)
+{
+	gnutls_cipher_algorithm_t cipher = gnutls_cipher_get(vpninfo->https_sess);
+	gnutls_datum_t mac, iv, key;
+	unsigned char seq[8];
+	union {
+		struct tls12_crypto_info_aes_gcm_128 gcm128;
+		struct tls12_crypto_info_aes_gcm_256 gcm256;
+#ifdef TLS_CIPHER_CHACHA20_POLY1305
+		struct tls12_crypto_info_chacha20_poly1305 chacha;
+#endif
+	} ci;
+	socklen_t ci_len;
+	int ret;
+
+	ret = gnutls_record_get_state(vpninfo->https_sess, optname == TLS_RX,
+				      &mac, &iv, &key, seq);
+	if (ret)
+		return -EINVAL;
+
+	memset(&ci, 0, sizeof(ci));
+	switch (cipher) {
+	case GNUTLS_CIPHER_AES_128_GCM:
+		if (key.size != TLS_CIPHER_AES_GCM_128_KEY_SIZE || iv.size < TLS_CIPHER_AES_GCM_128_SALT_SIZE)
+			return -EINVAL;
+		ci.gcm128.info.version = TLS_1_2_VERSION;
+		ci.gcm128.info.cipher_type = TLS_CIPHER_AES_GCM_128;
+		memcpy(ci.gcm128.key, key.data, key.size);
+		memcpy(ci.gcm128.salt, iv.data, TLS_CIPHER_AES_GCM_128_SALT_SIZE);
+		memcpy(ci.gcm128.iv, seq, sizeof(seq));
+		memcpy(ci.gcm128.rec_seq, seq, sizeof(seq));
+		ci_len = sizeof(ci.gcm128);
+		break;
+
+	case GNUTLS_CIPHER_AES_256_GCM:
+		if (key.size != TLS_CIPHER_AES_GCM_256_KEY_SIZE || iv.size < TLS_CIPHER_AES_GCM_256_SALT_SIZE)
+			return -EINVAL;
+		ci.gcm256.info.version = TLS_1_2_VERSION;
+		ci.gcm256.info.cipher_type = TLS_CIPHER_AES_GCM_256;
+		memcpy(ci.gcm256.key, key.data, key.size);
+		memcpy(ci.gcm256.salt, iv.data, TLS_CIPHER_AES_GCM_256_SALT_SIZE);
+		memcpy(ci.gcm256.iv, seq, sizeof(seq));
+		memcpy(ci.gcm256.rec_seq, seq, sizeof(seq));
+		ci_len = sizeof(ci.gcm256);
+		break;
+
+#ifdef TLS_CIPHER_CHACHA20_POLY1305
+	case GNUTLS_CIPHER_CHACHA20_POLY1305:
+		if (key.size != TLS_CIPHER_CHACHA20_POLY1305_KEY_SIZE ||
+		    iv.size != TLS_CIPHER_CHACHA20_POLY1305_IV_SIZE)
+			return -EINVAL;
+		ci.chacha.info.version = TLS_1_2_VERSION;
+		ci.chacha.info.cipher_type = TLS_CIPHER_CHACHA20_POLY1305;
+		memcpy(ci.chacha.key, key.data, key.size);
+		memcpy(ci.chacha.iv, iv.data, iv.size);
+		memcpy(ci.chacha.rec_seq, seq, sizeof(seq));
+		ci_len = sizeof(ci.chacha);
+		break;
+#endif
+	default:
+		return -EOPNOTSUPP;
+	}
+
+	ret = setsockopt(vpninfo->ssl_fd, SOL_TLS, optname, &ci, ci_len);
+	memset(&ci, 0, sizeof(ci));
+	if (ret)
+		return -errno;
+
+	return 0;
+}
+#endif /* HAVE_KTLS */
+
+/* Hand the record layer of the established HTTPS connection over to
+ * the kernel. Transmit is always offloaded if possible; receive only
+ * when 'rx' is set, since the kernel may coalesce several records
+ * into one read and so is only safe for the stream-framed protocols.
+ * Failure is never fatal; we just carry on doing it in userspace. */
+int ssl_ktls_offload(struct openconnect_info *vpninfo, int rx)
+{
+#ifdef HAVE_KTLS
+	int ret;
+
+	if (vpninfo->ssl_ktls || !vpninfo->https_sess)
+		return 0;
+
+	if (gnutls_protocol_get_version(vpninfo->https_sess) != GNUTLS_TLS1_2) {
+		vpn_progress(vpninfo, PRG_DEBUG,
+			     _("kTLS offload is only supported for TLS 1.2\n"));
+		return -EOPNOTSUPP;
+	}
+
+	if (setsockopt(vpninfo->ssl_fd, IPPROTO_TCP, TCP_ULP, "tls", sizeof("tls"))) {
+		vpn_progress(vpninfo, PRG_DEBUG,
+			     _("Kernel TLS not available: %s\n"), strerror(errno));
+		return -EOPNOTSUPP;
+	}
+
+	ret = ktls_set_crypto_info(vpninfo, TLS_TX);
+	if (ret) {
+		/* The ULP cannot be removed again, but with no keys installed
+		 * the socket simply passes data through unmodified. */
+		vpn_progress(vpninfo, PRG_DEBUG,
+			     _("kTLS transmit offload not possible for %s: %s\n"),
+			     vpninfo->cstp_cipher, strerror(-ret));
+		return ret;
+	}
+	vpninfo->ssl_ktls = KTLS_TX;
+	vpninfo->ssl_write = openconnect_ktls_write;
+
+	if (rx) {
+		if (gnutls_record_check_pending(vpninfo->https_sess))
+			vpn_progress(vpninfo, PRG_DEBUG,
+				     _("Pending TLS data; not offloading receive to kernel\n"));
+		else if ((ret = ktls_set_crypto_info(vpninfo, TLS_RX)))
+			vpn_progress(vpninfo, PRG_DEBUG,
+				     _("kTLS receive offload not possible: %s\n"),
+				     strerror(-ret));
+		else {
+			vpninfo->ssl_ktls |= KTLS_RX;
+			vpninfo->ssl_read = openconnect_ktls_read;
+			vpninfo->ssl_gets = openconnect_ktls_gets;
+		}
+	}
+
+	vpn_progress(vpninfo, PRG_INFO, _("Using kernel TLS offload for %s (%s)\n"),
+		     vpninfo->cstp_cipher,
+		     (vpninfo->ssl_ktls & KTLS_RX) ? "TX+RX" : "TX");
+	return 0;
+#else
+	vpn_progress(vpninfo, PRG_DEBUG,
+		     _("Kernel TLS offload not supported by this build\n"));
+	return -EOPNOTSUPP;
+#endif
+}
@@ -188,11 +188,16 @@ static int _openconnect_gnutls_read(gnutls_session_t ses, int fd, struct opencon
 
 }
 
-static int openconnect_gnutls_read(struct openconnect_info *vpninfo, char *buf, size_t len)
+static int openconnect_gnutls_raw_read(struct openconnect_info *vpninfo, char *buf, size_t len)
 {
 	return _openconnect_gnutls_read(vpninfo->https_sess, vpninfo->ssl_fd, vpninfo, buf, len, 0);
 }
 
+static int openconnect_gnutls_read(struct openconnect_info *vpninfo, char *buf, size_t len)
+{
+	return ssl_buffered_read(vpninfo, buf, len, openconnect_gnutls_raw_read);
+}
+
 int openconnect_dtls_read(struct openconnect_info *vpninfo, void *buf, size_t len, unsigned ms)
 {
 	return _openconnect_gnutls_read(vpninfo->dtls_ssl, vpninfo->dtls_fd, vpninfo, buf, len, ms);
@@ -200,68 +205,28 @@ int openconnect_dtls_read(struct openconnect_info *vpninfo, void *buf, size_t le
 
 static int openconnect_gnutls_gets(struct openconnect_info *vpninfo, char *buf, size_t len)
 {
-	int i = 0;
-	int ret;
-
-	if (len < 2)
-		return -EINVAL;
-
-	while (1) {
-		ret = gnutls_record_recv(vpninfo->https_sess, buf + i, 1);
-		if (ret == 1) {
-			if (buf[i] == '\n') {
-				buf[i] = 0;
-				if (i && buf[i-1] == '\r') {
-					buf[i-1] = 0;
-					i--;
-				}
-				return i;
-			}
-			i++;
-
-			if (i >= len - 1) {
-				buf[i] = 0;
-				return i;
-			}
-		} else if (ret == GNUTLS_E_AGAIN || ret == GNUTLS_E_INTERRUPTED) {
-			/* Wait for something to happen on the socket, or on cmd_fd */
-			fd_set rd_set, wr_set;
-			int maxfd = vpninfo->ssl_fd;
-
-			FD_ZERO(&rd_set);
-			FD_ZERO(&wr_set);
-
-			if (gnutls_record_get_direction(vpninfo->https_sess))
-				FD_SET(vpninfo->ssl_fd, &wr_set);
-			else
-				FD_SET(vpninfo->ssl_fd, &rd_set);
-
-			cmd_fd_set(vpninfo, &rd_set, &maxfd);
-			select(maxfd + 1, &rd_set, &wr_set, NULL, NULL);
-			if (is_cancel_pending(vpninfo, &rd_set)) {
-				vpn_progress(vpninfo, PRG_ERR, _("SSL read cancelled\n"));
-				ret = -EINTR;
-				break;
-			}
-		} else if (ret == GNUTLS_E_REHANDSHAKE) {
-			ret = cstp_handshake(vpninfo, 0);
-			if (ret)
-				return ret;
-		} else {
-			vpn_progress(vpninfo, PRG_ERR, _("Failed to read from SSL socket: %s\n"),
-				     gnutls_strerror(ret));
-			ret = -EIO;
-			break;
-		}
-	}
-	buf[i] = 0;
-	return i ?: ret;
+	return ssl_buffered_gets(vpninfo, buf, len, openconnect_gnutls_raw_read);
 }
 
 int ssl_nonblock_read(struct openconnect_info *vpninfo, void *buf, int maxlen)
 {
 	int ret;
 
+#ifdef HAVE_KTLS
+	/* Every mainloop reads first on each pass, so this is where the end
+	 * of a short kTLS write goes out if nothing else is queued behind it */
+	if (vpninfo->ssl_ktls_tail_len && ktls_flush_tail(vpninfo) < 0)
+		return -EIO;
+#endif
+	/* Anything left over from the HTTP exchange comes first */
+	ret = ssl_rbuf_take(vpninfo, buf, maxlen);
+	if (ret)
+		return ret;
+
+#ifdef HAVE_KTLS
+	if (vpninfo->ssl_ktls & KTLS_RX)
+		return ktls_nonblock_recv(vpninfo, buf, maxlen);
+#endif
 	ret = gnutls_record_recv(vpninfo->https_sess, buf, maxlen);
 	if (ret > 0)
 		return ret;
@@ -279,6 +244,10 @@ int ssl_nonblock_write(struct openconnect_info *vpninfo, void *buf, int buflen)
 {
 	int ret;
 
+#ifdef HAVE_KTLS
+	if (vpninfo->ssl_ktls & KTLS_TX)
+		return ktls_nonblock_send(vpninfo, buf, buflen);
+#endif
 	ret = gnutls_record_send(vpninfo->https_sess, buf, buflen);
 	if (ret > 0)
 		return ret;
@@ -1894,6 +1863,49 @@ void openconnect_free_peer_cert_chain(struct openconnect_info *vpninfo,
 	free(chain);
 }
 
+static int import_resumed_peer_cert(struct openconnect_info *vpninfo)
+{
+	const gnutls_datum_t *cert_list;
+	gnutls_x509_crt_t cert;
+	unsigned int cert_list_size;
+
+	if (vpninfo->peer_cert)
+		return 0;
+
+	cert_list = gnutls_certificate_get_peers(vpninfo->https_sess, &cert_list_size);
+	if (!cert_list || gnutls_x509_crt_init(&cert))
+		goto err;
+
+	if (gnutls_x509_crt_import(cert, &cert_list[0], GNUTLS_X509_FMT_DER)) {
+		gnutls_x509_crt_deinit(cert);
+		goto err;
+	}
+
+	vpninfo->peer_cert = cert;
+	set_peer_cert_hash(vpninfo);
+	return 0;
+ err:
+	vpn_progress(vpninfo, PRG_ERR,
+		     _("Resumed TLS session has no usable server certificate\n"));
+	return -EIO;
+}
+
+/* Keep the session data so the next connection to the same server can
+ * resume it. With TLS 1.3 the ticket arrives after the handshake, so
+ * we do this again when the connection is closed. */
+static void save_https_session(struct openconnect_info *vpninfo)
+{
+	gnutls_datum_t data;
+
+	if (!vpninfo->https_sess ||
+	    gnutls_session_get_data2(vpninfo->https_sess, &data))
+		return;
+
+	gnutls_free(vpninfo->https_session.data);
+	vpninfo->https_session = data;
+	ssl_session_cache_set_host(vpninfo);
+}
+
 static int verify_peer(gnutls_session_t session)
 {
 	struct openconnect_info *vpninfo = gnutls_session_get_ptr(session);
@@ -2038,6 +2050,149 @@ static int verify_peer(gnutls_session_t session)
 	return err;
 }
 
+void free_shared_trust(void *handle)
+{
+	gnutls_certificate_free_credentials(handle);
+}
+
+static const struct {
+	gnutls_cipher_algorithm_t alg;
+	int aead;
+} bench_ciphers[OC_BENCH_MAX] = {
+	[OC_BENCH_AES_128_GCM] = { GNUTLS_CIPHER_AES_128_GCM, 1 },
+	[OC_BENCH_AES_256_GCM] = { GNUTLS_CIPHER_AES_256_GCM, 1 },
+#if GNUTLS_VERSION_NUMBER >= 0x030400
+	[OC_BENCH_CHACHA20_POLY1305] = { GNUTLS_CIPHER_CHACHA20_POLY1305, 1 },
+#endif
+	[OC_BENCH_AES_128_CBC] = { GNUTLS_CIPHER_AES_128_CBC, 0 },
+	[OC_BENCH_AES_256_CBC] = { GNUTLS_CIPHER_AES_256_CBC, 0 },
+};
+
+int bench_cipher(int cipher, unsigned char *buf, int len, int count)
+{
+	gnutls_cipher_algorithm_t alg = bench_ciphers[cipher].alg;
+	unsigned char key[32] = { 0 }, iv[16] = { 0 }, tag[20];
+	gnutls_datum_t key_d, iv_d;
+	gnutls_cipher_hd_t h;
+
+	if (alg == GNUTLS_CIPHER_UNKNOWN)
+		return -EOPNOTSUPP;
+
+	key_d.data = key;
+	key_d.size = gnutls_cipher_get_key_size(alg);
+	iv_d.data = iv;
+	iv_d.size = gnutls_cipher_get_iv_size(alg);
+	if (gnutls_cipher_init(&h, alg, &key_d, &iv_d))
+		return -EOPNOTSUPP;
+
+	while (count--) {
+		if (bench_ciphers[cipher].aead) {
+			/* A fresh nonce and the record header, as TLS would */
+			gnutls_cipher_set_iv(h, iv, iv_d.size);
+			if (gnutls_cipher_add_auth(h, key, 13) ||
+			    gnutls_cipher_encrypt2(h, buf, len, buf, len) ||
+			    gnutls_cipher_tag(h, tag, 16))
+				goto fail;
+		} else {
+			if (gnutls_hmac_fast(GNUTLS_MAC_SHA1, key, 20, buf, len, tag) ||
+			    gnutls_cipher_encrypt2(h, buf, len, buf, len))
+				goto fail;
+		}
+	}
+	gnutls_cipher_deinit(h);
+	return 0;
+
+ fail:
+	gnutls_cipher_deinit(h);
+	return -EIO;
+}
+
+static int bench_speed(struct openconnect_info *vpninfo,
+		       gnutls_cipher_algorithm_t alg, int *aead)
+{
+	const struct oc_cipher_speed *speeds = openconnect_get_cipher_speeds(vpninfo);
+	int i;
+
+	for (i = 0; speeds && i < OC_BENCH_MAX; i++) {
+		if (bench_ciphers[i].alg == alg) {
+			*aead = bench_ciphers[i].aead;
+			return speeds[i].mbps;
+		}
+	}
+	return 0;
+}
+
+/* Once openconnect_benchmark_ciphers() has been run, move the fastest
+ * ciphers up in vpninfo->gnutls_prio. Only measured ciphers trade
+ * places, and only with others of the same kind, so AEAD stays ahead
+ * of CBC. A cipher is never moved ahead of one with a longer key;
+ * AES-128-GCM is always faster than AES-256-GCM, but that isn't what
+ * this is for. The DTLS cipher list follows the same order. */
+static void sort_prio_by_speed(struct openconnect_info *vpninfo)
+{
+	gnutls_cipher_algorithm_t algs[32];
+	gnutls_priority_t cache;
+	const unsigned int *list;
+	struct oc_text_buf *buf;
+	int i, j, nr, changed = 0;
+
+	if (!openconnect_get_cipher_speeds(vpninfo) ||
+	    gnutls_priority_init(&cache, vpninfo->gnutls_prio, NULL))
+		return;
+
+	nr = gnutls_priority_cipher_list(cache, &list);
+	if (nr > 0 && nr <= (int)(sizeof(algs) / sizeof(algs[0]))) {
+		for (i = 0; i < nr; i++)
+			algs[i] = list[i];
+	} else
+		nr = 0;
+	gnutls_priority_deinit(cache);
+
+	for (i = 0; i < nr; i++) {
+		int aead_i = 0, aead_j = 0, best = i;
+		int best_speed = bench_speed(vpninfo, algs[i], &aead_i);
+
+		if (!best_speed)
+			continue;
+
+		for (j = i + 1; j < nr; j++) {
+			int speed = bench_speed(vpninfo, algs[j], &aead_j);
+
+			if (speed > best_speed && aead_j == aead_i &&
+			    gnutls_cipher_get_key_size(algs[j]) >=
+			    gnutls_cipher_get_key_size(algs[i])) {
+				best = j;
+				best_speed = speed;
+			}
+		}
+		if (best != i) {
+			gnutls_cipher_algorithm_t tmp = algs[i];
+
+			algs[i] = algs[best];
+			algs[best] = tmp;
+			changed = 1;
+		}
+	}
+	if (!changed)
+		return;
+
+	buf = buf_alloc();
+	buf_append(buf, "%s:-CIPHER-ALL", vpninfo->gnutls_prio);
+	for (i = 0; i < nr; i++)
+		buf_append(buf, ":+%s", gnutls_cipher_get_name(algs[i]));
+
+	/* Leave it alone if it doesn't fit, or if GnuTLS doesn't like it */
+	if (!buf_error(buf) && buf->pos < (int)sizeof(vpninfo->gnutls_prio) &&
+	    !gnutls_priority_init(&cache, buf->data, NULL)) {
+		gnutls_priority_deinit(cache);
+		strcpy(vpninfo->gnutls_prio, buf->data);
+		vpn_progress(vpninfo, PRG_DEBUG,
+			     _("Ciphers ordered by measured speed: %s\n"),
+			     vpninfo->gnutls_prio);
+	}
+	buf_free(buf);
+}
+
 int openconnect_open_https(struct openconnect_info *vpninfo)
 {
 	const char *default_prio;
@@ -2061,6 +2216,11 @@ int openconnect_open_https(struct openconnect_info *vpninfo)
 	if (ssl_sock < 0)
 		return ssl_sock;
 
+	if (!vpninfo->https_cred) {
+		vpninfo->https_cred = session_group_trust(vpninfo);
+		vpninfo->https_cred_shared = !!vpninfo->https_cred;
+	}
+
 	if (!vpninfo->https_cred) {
 		gnutls_certificate_allocate_credentials(&vpninfo->https_cred);
 		if (!vpninfo->no_system_trust)
@@ -2147,9 +2307,16 @@ int openconnect_open_https(struct openconnect_info *vpninfo)
 				return err;
 			}
 		}
+
+		if (!session_group_share_trust(vpninfo, vpninfo->https_cred))
+			vpninfo->https_cred_shared = 1;
 	}
 	gnutls_init(&vpninfo->https_sess, GNUTLS_CLIENT);
 	gnutls_session_set_ptr(vpninfo->https_sess, (void *) vpninfo);
+
+	if (vpninfo->https_session.size && ssl_session_cache_valid(vpninfo))
+		gnutls_session_set_data(vpninfo->https_sess, vpninfo->https_session.data,
+					vpninfo->https_session.size);
 	/*
 	 * For versions of GnuTLS older than 3.2.9, we try to avoid long
 	 * packets by silently disabling extensions such as SNI.
@@ -2202,6 +2369,7 @@ int openconnect_open_https(struct openconnect_info *vpninfo)
 
 	snprintf(vpninfo->gnutls_prio, sizeof(vpninfo->gnutls_prio), "%s%s",
 		 default_prio, vpninfo->pfs?":-RSA":"");
+	sort_prio_by_speed(vpninfo);
 
 	err = gnutls_priority_set_direct(vpninfo->https_sess,
 					 vpninfo->gnutls_prio, NULL);
@@ -2231,6 +2399,20 @@ int openconnect_open_https(struct openconnect_info *vpninfo)
 	if (err)
 		return err;
 
+	if (gnutls_session_is_resumed(vpninfo->https_sess)) {
+		/* verify_peer() isn't called for a resumed session, but
+		 * the certificate is still available from the session. */
+		err = import_resumed_peer_cert(vpninfo);
+		if (err) {
+			gnutls_deinit(vpninfo->https_sess);
+			vpninfo->https_sess = NULL;
+			closesocket(ssl_sock);
+			return err;
+		}
+		vpn_progress(vpninfo, PRG_DEBUG, _("Resumed previous TLS session\n"));
+	}
+	save_https_session(vpninfo);
+
 	gnutls_free(vpninfo->cstp_cipher);
 	vpninfo->cstp_cipher = get_gnutls_cipher(vpninfo->https_sess);
 
@@ -2248,6 +2430,11 @@ int cstp_handshake(struct openconnect_info *vpninfo, unsigned init)
 	int err;
 	int ssl_sock = -1;
 
+	/* Once the kernel owns the record layer we cannot renegotiate. The
+	 * callers treat failure as a reason to reconnect instead. */
+	if (vpninfo->ssl_ktls)
+		return -EOPNOTSUPP;
+
 	ssl_sock = (intptr_t)gnutls_transport_get_ptr(vpninfo->https_sess);
 
 	while ((err = gnutls_handshake(vpninfo->https_sess))) {
@@ -2300,10 +2487,28 @@ int cstp_handshake(struct openconnect_info *vpninfo, unsigned init)
 
 void openconnect_close_https(struct openconnect_info *vpninfo, int final)
 {
+	vpninfo->ssl_ktls = 0;
+	free(vpninfo->ssl_ktls_tail);
+	vpninfo->ssl_ktls_tail = NULL;
+	vpninfo->ssl_ktls_tail_len = 0;
+	vpninfo->ssl_rbuf_pos = vpninfo->ssl_rbuf_len = 0;
 	if (vpninfo->https_sess) {
+		if (!final)
+			save_https_session(vpninfo);
 		gnutls_deinit(vpninfo->https_sess);
 		vpninfo->https_sess = NULL;
 	}
+	if (final && vpninfo->https_session.data) {
+		gnutls_free(vpninfo->https_session.data);
+		vpninfo->https_session.data = NULL;
+		vpninfo->https_session.size = 0;
+	}
+	/* A new CSTP connection means a new DTLS PSK */
+	if (vpninfo->dtls_session.data) {
+		gnutls_free(vpninfo->dtls_session.data);
+		vpninfo->dtls_session.data = NULL;
+		vpninfo->dtls_session.size = 0;
+	}
 	if (vpninfo->ssl_fd != -1) {
 		closesocket(vpninfo->ssl_fd);
 		unmonitor_read_fd(vpninfo, ssl);
@@ -2312,8 +2517,10 @@ void openconnect_close_https(struct openconnect_info *vpninfo, int final)
 		vpninfo->ssl_fd = -1;
 	}
 	if (final && vpninfo->https_cred) {
-		gnutls_certificate_free_credentials(vpninfo->https_cred);
+		if (!vpninfo->https_cred_shared)
+			gnutls_certificate_free_credentials(vpninfo->https_cred);
 		vpninfo->https_cred = NULL;
+		vpninfo->https_cred_shared = 0;
 #ifdef HAVE_TROUSERS
 		if (vpninfo->tpm_key_policy) {
 			Tspi_Context_CloseObject(vpninfo->tpm_context, vpninfo->tpm_key_policy);
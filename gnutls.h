@@ -29,4 +29,11 @@ int load_tpm_key(struct openconnect_info *vpninfo, gnutls_datum_t *fdata,
 
 char *get_gnutls_cipher(gnutls_session_t session);
 
+#if defined(HAVE_LINUX_TLS_H) && defined(HAVE_GNUTLS_RECORD_GET_STATE)
+#define HAVE_KTLS
+int ktls_nonblock_recv(struct openconnect_info *vpninfo, void *buf, int maxlen);
+int ktls_nonblock_send(struct openconnect_info *vpninfo, void *buf, int buflen);
+int ktls_flush_tail(struct openconnect_info *vpninfo);
+#endif
+
 #endif /* __OPENCONNECT_GNUTLS_H__ */
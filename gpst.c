@@ -703,6 +703,9 @@ static int gpst_connect(struct openconnect_info *vpninfo)
 	if (ret < 0)
 		openconnect_close_https(vpninfo, 0);
 	else {
+		/* As with CSTP, each read must return exactly one record. */
+		if (vpninfo->ktls)
+			ssl_ktls_offload(vpninfo, 0);
 		monitor_fd_new(vpninfo, ssl);
 		monitor_read_fd(vpninfo, ssl);
 		monitor_except_fd(vpninfo, ssl);
@@ -953,6 +956,10 @@ int gpst_mainloop(struct openconnect_info *vpninfo, int *timeout)
 	uint16_t ethertype;
 	uint32_t one, zero, magic;
 
+	/* Still waiting to retry a failed reconnect or rekey */
+	if (vpninfo->ssl_reconnect_due)
+		goto do_reconnect;
+
 	/* Starting the HTTPS tunnel kills ESP, so we avoid starting
 	 * it if the ESP tunnel is connected or connecting.
 	 */
@@ -997,7 +1004,7 @@ int gpst_mainloop(struct openconnect_info *vpninfo, int *timeout)
 		int len, payload_len;
 
 		if (!vpninfo->cstp_pkt) {
-			vpninfo->cstp_pkt = malloc(sizeof(struct pkt) + receive_mtu);
+			vpninfo->cstp_pkt = alloc_pkt(vpninfo, receive_mtu);
 			if (!vpninfo->cstp_pkt) {
 				vpn_progress(vpninfo, PRG_ERR, _("Allocation failed\n"));
 				break;
@@ -1122,7 +1129,9 @@ int gpst_mainloop(struct openconnect_info *vpninfo, int *timeout)
 		vpn_progress(vpninfo, PRG_ERR,
 			     _("GPST Dead Peer Detection detected dead peer!\n"));
 	do_reconnect:
-		ret = ssl_reconnect(vpninfo);
+		ret = ssl_reconnect(vpninfo, timeout);
+		if (ret == -EAGAIN)
+			return work_done;
 		if (ret) {
 			vpn_progress(vpninfo, PRG_ERR, _("Reconnect failed\n"));
 			vpninfo->quit_reason = "GPST reconnect failed";
@@ -1136,11 +1145,12 @@ int gpst_mainloop(struct openconnect_info *vpninfo, int *timeout)
 		/* No need to send an explicit keepalive
 		   if we have real data to send */
 		if (vpninfo->dtls_state != DTLS_CONNECTED &&
-		    vpninfo->outgoing_queue.head)
+		    vpninfo->outgoing_queue.count)
 			break;
 
 	case KA_DPD:
 		vpn_progress(vpninfo, PRG_DEBUG, _("Send GPST DPD/keepalive request\n"));
+		prefetch_https_address(vpninfo);
 
 		vpninfo->current_ssl_pkt = (struct pkt *)&dpd_pkt;
 		goto handle_outgoing;
@@ -1149,7 +1159,7 @@ int gpst_mainloop(struct openconnect_info *vpninfo, int *timeout)
 
 	/* Service outgoing packet queue */
 	while (vpninfo->dtls_state != DTLS_CONNECTED &&
-	       (vpninfo->current_ssl_pkt = dequeue_packet(&vpninfo->outgoing_queue))) {
+	       (vpninfo->current_ssl_pkt = dequeue_outgoing(vpninfo))) {
 		struct pkt *this = vpninfo->current_ssl_pkt;
 
 		/* store header */
@@ -65,12 +65,14 @@ struct openconnect_info *openconnect_vpninfo_new(const char *useragent,
 #ifndef _WIN32
 	vpninfo->tun_fd = -1;
 #endif
-	init_pkt_queue(&vpninfo->incoming_queue);
-	init_pkt_queue(&vpninfo->outgoing_queue);
+	vpninfo->pkt_pipe[0] = vpninfo->pkt_pipe[1] = -1;
+	init_aqm_queue(&vpninfo->incoming_queue);
+	init_outgoing_queue(vpninfo);
 	init_pkt_queue(&vpninfo->oncp_control_queue);
+	init_pkt_queue(&vpninfo->esp_backlog);
 	vpninfo->dtls_tos_current = 0;
 	vpninfo->dtls_pass_tos = 0;
-	vpninfo->ssl_fd = vpninfo->dtls_fd = -1;
+	vpninfo->ssl_fd = vpninfo->dtls_fd = vpninfo->reconnect_fd = -1;
 	vpninfo->cmd_fd = vpninfo->cmd_fd_write = -1;
 	vpninfo->tncc_fd = -1;
 	vpninfo->cert_expire_warning = 60 * 86400;
@@ -140,6 +142,7 @@ const struct vpn_proto openconnect_protos[] = {
 		.udp_shutdown = esp_shutdown,
 		.udp_send_probes = esp_send_probes,
 		.udp_catch_probe = esp_catch_probe,
+		.udp_send_mtu_probe = esp_send_mtu_probe,
 #endif
 	}, {
 		.name = "gp",
@@ -159,6 +162,7 @@ const struct vpn_proto openconnect_protos[] = {
 		.udp_shutdown = esp_shutdown,
 		.udp_send_probes = esp_send_probes_gp,
 		.udp_catch_probe = esp_catch_probe_gp,
+		.udp_send_mtu_probe = esp_send_mtu_probe_gp,
 #endif
 	},
 	{ /* NULL */ }
@@ -210,6 +214,26 @@ void openconnect_set_pass_tos(struct openconnect_info *vpninfo, int enable)
 	vpninfo->dtls_pass_tos = enable;
 }
 
+void openconnect_set_ktls(struct openconnect_info *vpninfo, int enable)
+{
+	vpninfo->ktls = enable;
+}
+
+void openconnect_set_dscp_priority(struct openconnect_info *vpninfo, int enable)
+{
+	vpninfo->dscp_priority = enable;
+}
+
+int openconnect_set_netlink_config(struct openconnect_info *vpninfo, int enable)
+{
+#ifdef HAVE_LINUX_RTNETLINK_H
+	vpninfo->netlink_config = enable;
+	return 0;
+#else
+	return enable ? -EOPNOTSUPP : 0;
+#endif
+}
+
 void openconnect_set_loglevel(struct openconnect_info *vpninfo, int level)
 {
 	vpninfo->verbose = level;
@@ -290,9 +314,97 @@ void free_optlist(struct oc_vpn_option *opt)
 	}
 }
 
+struct oc_session_group *openconnect_session_group_new(void)
+{
+	return calloc(1, sizeof(struct oc_session_group));
+}
+
+static void session_group_destroy(struct oc_session_group *group)
+{
+	struct oc_shared_trust *t;
+
+	while ((t = group->trust)) {
+		group->trust = t->next;
+		free_shared_trust(t->handle);
+		free(t->cafile);
+		free(t);
+	}
+	free(group->dtls_ciphers_prio);
+	free(group->dtls_ciphers);
+	free(group);
+}
+
+void openconnect_session_group_free(struct oc_session_group *group)
+{
+	if (!group)
+		return;
+	if (group->nr_sessions)
+		group->freed = 1;
+	else
+		session_group_destroy(group);
+}
+
+int openconnect_session_group_add(struct oc_session_group *group,
+				  struct openconnect_info *vpninfo)
+{
+	if (vpninfo->session_group)
+		return -EBUSY;
+	if (group->freed)
+		return -EINVAL;
+
+	vpninfo->session_group = group;
+	group->nr_sessions++;
+	return 0;
+}
+
+/* Trust loaded by another session in the group, which this one can use
+ * too; NULL if there is none yet, or if this session mustn't share. */
+void *session_group_trust(struct openconnect_info *vpninfo)
+{
+	struct oc_shared_trust *t;
+
+	if (!vpninfo->session_group || vpninfo->cert)
+		return NULL;
+
+	for (t = vpninfo->session_group->trust; t; t = t->next) {
+		if (t->no_system_trust == vpninfo->no_system_trust &&
+		    !t->cafile == !vpninfo->cafile &&
+		    (!t->cafile || !strcmp(t->cafile, vpninfo->cafile)))
+			return t->handle;
+	}
+	return NULL;
+}
+
+/* Offer what this session has just loaded to the rest of the group. On
+ * success the group owns the handle and will free it. */
+int session_group_share_trust(struct openconnect_info *vpninfo, void *handle)
+{
+	struct oc_shared_trust *t;
+
+	if (!vpninfo->session_group || vpninfo->cert)
+		return -EINVAL;
+
+	t = calloc(1, sizeof(*t));
+	if (!t)
+		return -ENOMEM;
+	if (vpninfo->cafile) {
+		t->cafile = strdup(vpninfo->cafile);
+		if (!t->cafile) {
+			free(t);
+			return -ENOMEM;
+		}
+	}
+	t->no_system_trust = vpninfo->no_system_trust;
+	t->handle = handle;
+	t->next = vpninfo->session_group->trust;
+	vpninfo->session_group->trust = t;
+	return 0;
+}
+
 void openconnect_vpninfo_free(struct openconnect_info *vpninfo)
 {
 	openconnect_close_https(vpninfo, 1);
+	ssl_reconnect_abort(vpninfo);
 	if (vpninfo->proto->udp_shutdown)
 		vpninfo->proto->udp_shutdown(vpninfo);
 	if (vpninfo->tncc_fd != -1)
@@ -301,6 +413,12 @@ void openconnect_vpninfo_free(struct openconnect_info *vpninfo)
 		closesocket(vpninfo->cmd_fd);
 		closesocket(vpninfo->cmd_fd_write);
 	}
+#ifndef _WIN32
+	if (vpninfo->pkt_pipe[0] != -1) {
+		close(vpninfo->pkt_pipe[0]);
+		close(vpninfo->pkt_pipe[1]);
+	}
+#endif
 
 #ifdef HAVE_ICONV
 	if (vpninfo->ic_utf8_to_legacy != (iconv_t)-1)
@@ -314,9 +432,14 @@ void openconnect_vpninfo_free(struct openconnect_info *vpninfo)
 		CloseHandle(vpninfo->cmd_event);
 	if (vpninfo->ssl_event)
 		CloseHandle(vpninfo->ssl_event);
+	if (vpninfo->reconnect_event)
+		CloseHandle(vpninfo->reconnect_event);
 	if (vpninfo->dtls_event)
 		CloseHandle(vpninfo->dtls_event);
 #endif
+	free(vpninfo->ssl_rbuf);
+	free_dns_prefetch(vpninfo);
+	free(vpninfo->https_session_host);
 	free(vpninfo->peer_addr);
 	free(vpninfo->ip_info.gateway_addr);
 	free_optlist(vpninfo->csd_env);
@@ -325,6 +448,12 @@ void openconnect_vpninfo_free(struct openconnect_info *vpninfo)
 	free_optlist(vpninfo->cstp_options);
 	free_optlist(vpninfo->dtls_options);
 	free_split_routes(vpninfo);
+#ifdef HAVE_LINUX_RTNETLINK_H
+	netlink_free_config(vpninfo);
+#endif
+#ifdef HAVE_TUN_RING
+	tun_ring_free(vpninfo);
+#endif
 	free(vpninfo->hostname);
 	free(vpninfo->unique_hostname);
 	free(vpninfo->urlpath);
@@ -425,14 +554,19 @@ void openconnect_vpninfo_free(struct openconnect_info *vpninfo)
 	}
 	free(vpninfo->pkcs11_cert_id);
 #endif
-	/* These check strm->state so they are safe to call multiple times */
-	inflateEnd(&vpninfo->inflate_strm);
-	deflateEnd(&vpninfo->deflate_strm);
+	compr_free(vpninfo);
 
 	free(vpninfo->deflate_pkt);
 	free(vpninfo->tun_pkt);
 	free(vpninfo->dtls_pkt);
 	free(vpninfo->cstp_pkt);
+	free_pkt_pool(vpninfo);
+
+	/* After openconnect_close_https(), which drops any shared trust */
+	if (vpninfo->session_group &&
+	    !--vpninfo->session_group->nr_sessions &&
+	    vpninfo->session_group->freed)
+		session_group_destroy(vpninfo->session_group);
 	free(vpninfo);
 }
 
@@ -603,6 +737,7 @@ void openconnect_reset_ssl(struct openconnect_info *vpninfo)
 {
 	vpninfo->got_cancel_cmd = 0;
 	openconnect_close_https(vpninfo, 0);
+	ssl_reconnect_abort(vpninfo);
 
 	free(vpninfo->peer_addr);
 	vpninfo->peer_addr = NULL;
@@ -863,6 +998,56 @@ void openconnect_set_reconnected_handler(struct openconnect_info *vpninfo,
 	vpninfo->reconnected = reconnected;
 }
 
+int openconnect_setup_packet_callbacks(struct openconnect_info *vpninfo,
+				       openconnect_packet_sink_vfn sink,
+				       openconnect_packet_source_vfn source)
+{
+#ifdef _WIN32
+	return -EOPNOTSUPP;
+#else
+	if (!sink || !source)
+		return -EINVAL;
+	if (tun_is_up(vpninfo))
+		return -EBUSY;
+
+	/* Kept until openconnect_vpninfo_free(), as other threads may
+	 * still be calling openconnect_packets_ready() */
+	if (vpninfo->pkt_pipe[0] == -1) {
+		if (pipe(vpninfo->pkt_pipe)) {
+			vpn_progress(vpninfo, PRG_ERR,
+				     _("Failed to create pipe: %s\n"),
+				     strerror(errno));
+			vpninfo->pkt_pipe[0] = vpninfo->pkt_pipe[1] = -1;
+			return -EIO;
+		}
+		set_fd_cloexec(vpninfo->pkt_pipe[1]);
+		set_sock_nonblock(vpninfo->pkt_pipe[1]);
+	}
+
+	vpninfo->pkt_sink = sink;
+	vpninfo->pkt_source = source;
+	vpninfo->pkt_sink_full = 0;
+	/* Ask the source on the first pass through the mainloop */
+	vpninfo->pkt_kicked = 1;
+
+	return openconnect_setup_tun_fd(vpninfo, vpninfo->pkt_pipe[0]);
+#endif
+}
+
+void openconnect_packets_ready(struct openconnect_info *vpninfo)
+{
+#ifndef _WIN32
+	/* Don't make a syscall for every packet; tun_mainloop() drains
+	 * the pipe before clearing the flag, and then asks again. */
+	if (vpninfo->pkt_pipe[1] != -1 &&
+	    !__atomic_exchange_n(&vpninfo->pkt_kicked, 1, __ATOMIC_SEQ_CST)) {
+		/* Can't fail unless the pipe is full, and thus readable */
+		if (write(vpninfo->pkt_pipe[1], "", 1) < 0)
+			return;
+	}
+#endif
+}
+
 void openconnect_set_stats_handler(struct openconnect_info *vpninfo,
 				   openconnect_stats_vfn stats_handler)
 {
@@ -1074,6 +1259,20 @@ int openconnect_set_compression_mode(struct openconnect_info *vpninfo,
 	}
 }
 
+int openconnect_set_compression_level(struct openconnect_info *vpninfo,
+				      oc_compression_level_t level)
+{
+	switch(level) {
+	case OC_COMPRESSION_LEVEL_DEFAULT:
+	case OC_COMPRESSION_LEVEL_FAST:
+	case OC_COMPRESSION_LEVEL_MAX:
+		vpninfo->compr_level = level;
+		return 0;
+	default:
+		return -EINVAL;
+	}
+}
+
 void nuke_opt_values(struct oc_form_opt *opt)
 {
 	for (; opt; opt = opt->next) {
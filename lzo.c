@@ -19,6 +19,8 @@
  * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
  */
 
+#include <errno.h>
+#include <stdlib.h>
 #include <string.h>
 
 //#include "avutil.h"
@@ -100,13 +102,17 @@ static inline void copy(LZOContext *c, int cnt)
         c->error |= AV_LZO_OUTPUT_FULL;
     }
 #if defined(INBUF_PADDED) && defined(OUTBUF_PADDED)
-    AV_COPY32U(dst, src);
-    src += 4;
-    dst += 4;
-    cnt -= 4;
-    if (cnt > 0)
-#endif
+    /* Literals never overlap, and we may overrun both buffers by up to
+     * 7 bytes, so just copy whole words. */
+    {
+        int i;
+
+        for (i = 0; i < cnt; i += 8)
+            AV_COPY64U(dst + i, src + i);
+    }
+#else
     memcpy(dst, src, cnt);
+#endif
     c->in  = src + cnt;
     c->out = dst + cnt;
 }
@@ -134,6 +140,21 @@ static inline void copy_backptr(LZOContext *c, int back, int cnt)
         cnt       = FFMAX(c->out_end - dst, 0);
         c->error |= AV_LZO_OUTPUT_FULL;
     }
+#ifdef OUTBUF_PADDED
+    /* If the source is at least 16 bytes back, each pair of words we
+     * copy has already been written. The last pair may overrun the end
+     * of the match, but by no more than 7 bytes into the padding (or
+     * into output which hasn't been written yet). */
+    if (back >= 16) {
+        int i;
+
+        for (i = 0; i < cnt; i += 16) {
+            AV_COPY64U(dst + i, dst + i - back);
+            if (i + 8 < cnt)
+                AV_COPY64U(dst + i + 8, dst + i + 8 - back);
+        }
+    } else
+#endif
     av_memcpy_backptr(dst, back, cnt);
     c->out = dst + cnt;
 }
@@ -211,6 +232,162 @@ int av_lzo1x_decode(void *out, int *outlen, const void *in, int *inlen)
     return c.error;
 }
 
+/*
+ * A simple greedy LZO 1x compressor, along the lines of LZO1X-1. It only
+ * ever emits literal runs and M2/M3/M4 matches of at least 4 bytes, which
+ * keeps the state machine trivial, and it looks for one candidate match
+ * per position through a hash of the next 4 bytes.
+ *
+ * As in lzs.c, the hash table is kept between calls and each entry holds
+ * the input position plus a 'base' which advances by 64KiB for each
+ * packet, so that it doesn't have to be cleared every time.
+ */
+#define LZO_HASH_BITS 14
+#define LZO_MIN_MATCH 4
+#define LZO_MAX_BACK  49151
+#define LZO_MAX_INPUT 65536
+
+struct lzo_state {
+    uint32_t base;
+    uint32_t hash_table[1 << LZO_HASH_BITS];
+};
+
+struct lzo_state *lzo_alloc_state(void)
+{
+    return calloc(1, sizeof(struct lzo_state));
+}
+
+static inline uint32_t lzo_hash(const unsigned char *p)
+{
+    return (((const struct lzo_packed_uint32 *)p)->d * 2654435761U) >>
+        (32 - LZO_HASH_BITS);
+}
+
+/* The remainder of a count which didn't fit in the opcode */
+static inline unsigned char *lzo_put_len(unsigned char *op, int cnt)
+{
+    while (cnt > 255) {
+        *op++ = 0;
+        cnt  -= 255;
+    }
+    *op++ = cnt;
+    return op;
+}
+
+/* 'nn' is where the previous match keeps its trailing literal count,
+ * or NULL at the start of the stream. */
+static inline unsigned char *lzo_put_literals(unsigned char *op, unsigned char *nn,
+                                              const unsigned char *lit, int cnt)
+{
+    if (!cnt)
+        return op;
+
+    if (!nn && cnt <= 238) {
+        *op++ = 17 + cnt;
+    } else if (nn && cnt <= 3) {
+        *nn |= cnt;
+    } else if (cnt - 3 <= 15) {
+        *op++ = cnt - 3;
+    } else {
+        *op++ = 0;
+        op    = lzo_put_len(op, cnt - 3 - 15);
+    }
+    memcpy(op, lit, cnt);
+    return op + cnt;
+}
+
+int lzo1x_compress(struct lzo_state *state, unsigned char *dst, int dstlen,
+                   const unsigned char *src, int srclen)
+{
+    uint32_t *hash_table = state->hash_table;
+    unsigned char *op = dst, *nn = NULL;
+    int ip = 0, lit = 0, cnt;
+    uint32_t base, ent;
+
+    if (srclen > LZO_MAX_INPUT)
+        return -EFBIG;
+
+    base = state->base += LZO_MAX_INPUT;
+    if (!base) {
+        memset(hash_table, 0, sizeof(state->hash_table));
+        base = state->base = LZO_MAX_INPUT;
+    }
+
+    while (ip + LZO_MIN_MATCH <= srclen) {
+        uint32_t h = lzo_hash(src + ip);
+        int cand, back, len;
+
+        ent           = hash_table[h];
+        hash_table[h] = base + ip;
+        cand          = ent - base;
+        back          = ip - cand;
+        if (ent < base || back > LZO_MAX_BACK ||
+            ((const struct lzo_packed_uint32 *)(src + cand))->d !=
+            ((const struct lzo_packed_uint32 *)(src + ip))->d) {
+            /* Skip faster through data that isn't matching */
+            ip += 1 + ((ip - lit) >> 5);
+            continue;
+        }
+
+        len = LZO_MIN_MATCH;
+        while (ip + len < srclen && src[cand + len] == src[ip + len])
+            len++;
+
+        /* Literal run header and its length, the literals themselves,
+         * then the match with its length. */
+        cnt = ip - lit;
+        if (dst + dstlen - op < cnt + cnt / 255 + len / 255 + 8)
+            return -EFBIG;
+
+        op = lzo_put_literals(op, nn, src + lit, cnt);
+
+        if (len <= 8 && back <= 2048) {     /* cccbbbnn BBBBBBBB */
+            back--;
+            nn    = op;
+            *op++ = ((len - 1) << 5) | ((back & 7) << 2);
+            *op++ = back >> 3;
+        } else if (back <= 16384) {         /* 001ccccc (cccccccc...) bbbbbbnn BBBBBBBB */
+            back--;
+            if (len - 2 <= 31) {
+                *op++ = 0x20 | (len - 2);
+            } else {
+                *op++ = 0x20;
+                op    = lzo_put_len(op, len - 2 - 31);
+            }
+            nn    = op;
+            *op++ = (back & 63) << 2;
+            *op++ = back >> 6;
+        } else {                            /* 0001bccc (cccccccc...) bbbbbbnn BBBBBBBB */
+            int hi = (back - 16384) >> 11 & 8;
+
+            back = (back - 16384) & 16383;
+            if (len - 2 <= 7) {
+                *op++ = 0x10 | hi | (len - 2);
+            } else {
+                *op++ = 0x10 | hi;
+                op    = lzo_put_len(op, len - 2 - 7);
+            }
+            nn    = op;
+            *op++ = (back & 63) << 2;
+            *op++ = back >> 6;
+        }
+        ip += len;
+        lit = ip;
+    }
+
+    /* The remaining literals, and the end of stream marker */
+    cnt = srclen - lit;
+    if (dst + dstlen - op < cnt + cnt / 255 + 6)
+        return -EFBIG;
+
+    op    = lzo_put_literals(op, nn, src + lit, cnt);
+    *op++ = 0x11;
+    *op++ = 0;
+    *op++ = 0;
+
+    return op - dst;
+}
+
 #ifdef TEST
 #include <stdio.h>
 #include <lzo/lzo1x.h>
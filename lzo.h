@@ -59,6 +59,26 @@
  */
 int av_lzo1x_decode(void *out, int *outlen, const void *in, int *inlen);
 
+struct lzo_state;
+
+/**
+ * @brief Allocates the hash table kept between calls to lzo1x_compress().
+ * @return new state, to be released with free(), or NULL
+ */
+struct lzo_state *lzo_alloc_state(void);
+
+/**
+ * @brief Compresses one packet as a complete LZO 1x stream.
+ * @param state from lzo_alloc_state()
+ * @param dst output buffer
+ * @param dstlen size of output buffer
+ * @param src input buffer, which may be up to 64KiB
+ * @param srclen size of input buffer
+ * @return compressed length, or -EFBIG if it doesn't fit in dstlen
+ */
+int lzo1x_compress(struct lzo_state *state, unsigned char *dst, int dstlen,
+                   const unsigned char *src, int srclen);
+
 /**
  * @}
  */
@@ -75,6 +95,15 @@ struct lzo_packed_uint32 {
 			((struct lzo_packed_uint32 *)src)->d; \
 	} while (0)
 
+struct lzo_packed_uint64 {
+	uint64_t d;
+} __attribute__((packed));
+
+#define AV_COPY64U(dst,src) do {			\
+		((struct lzo_packed_uint64 *)(dst))->d = \
+			((struct lzo_packed_uint64 *)(src))->d; \
+	} while (0)
+
 static inline void av_memcpy_backptr(unsigned char *dst, int back, int cnt)
 {
 	while (cnt--) {
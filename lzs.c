@@ -19,63 +19,101 @@
 
 #include <errno.h>
 #include <string.h>
+#include <stdlib.h>
 #include <stdint.h>
 
 #include "openconnect-internal.h"
 
-#define GET_BITS(bits)							\
+/*
+ * The decoder keeps up to 64 bits of input in 'bits', with the next bit
+ * to be consumed at the top. It never reads beyond the end of the input;
+ * zeroes are shifted in instead, and CHECK_INPUT() catches any attempt
+ * to actually use them.
+ */
+static inline uint64_t lzs_load_be64(const unsigned char *p)
+{
+	return ((uint64_t)p[0] << 56) | ((uint64_t)p[1] << 48) |
+		((uint64_t)p[2] << 40) | ((uint64_t)p[3] << 32) |
+		((uint64_t)p[4] << 24) | ((uint64_t)p[5] << 16) |
+		((uint64_t)p[6] << 8) | (uint64_t)p[7];
+}
+
+#define REFILL_BITS()							\
 do {									\
-	/* Strictly speaking, this check ought to be on			\
-	 * (srclen < 1 + (bits_left < bits)). However, when bits == 9	\
-	 * the (bits_left < bits) comparison is always true so it	\
-	 * always comes out as (srclen < 2).				\
-	 * And bits is only anything *other* than 9 when we're reading	\
-	 * reading part of a match encoding. And in that case, there	\
-	 * damn well ought to be an end marker (7 more bits) after	\
-	 * what we're reading now, so it's perfectly OK to use		\
-	 * (srclen < 2) in that case too. And a *lot* cheaper. */	\
-	if (srclen < 2)							\
-		return -EINVAL;						\
-	/* Explicit comparison with 8 to optimise it into a tautology	\
-	 * in the the bits == 9 case, because the compiler doesn't	\
-	 * know that bits_left can never be larger than 8. */		\
-	if (bits >= 8 || bits >= bits_left) {				\
-		/* We need *all* the bits that are left in the current	\
-		 * byte. Take them and bump the input pointer. */	\
-		data = (src[0] << (bits - bits_left)) & ((1 << bits) - 1); \
-		src++;							\
-		srclen--;						\
-		bits_left += 8 - bits;					\
-		if (bits > 8 || bits_left < 8) {			\
-			/* We need bits from the next byte too... */	\
-			data |= src[0] >> bits_left;			\
-			/* ...if we used *all* of them then (which can	\
-			 * only happen if bits > 8), then bump the	\
-			 * input pointer again so we never leave	\
-			 * bits_left == 0. */				\
-			if (bits > 8 && !bits_left) {			\
-				bits_left = 8;				\
-				src++;					\
-				srclen--;				\
-			}						\
-		}							\
+	if (inpos + 8 <= srclen) {					\
+		/* Fill the whole word at once. Any bits beyond the	\
+		 * bytes we count as consumed will be loaded again,	\
+		 * identically, next time. */				\
+		bits |= lzs_load_be64(src + inpos) >> nr_bits;		\
+		inpos += (63 - nr_bits) >> 3;				\
+		nr_bits |= 56;						\
 	} else {							\
-		/* We need fewer bits than are left in the current byte */ \
-		data = (src[0] >> (bits_left - bits)) & ((1ULL << bits) - 1); \
-		bits_left -= bits;					\
+		while (nr_bits <= 56 && inpos < srclen) {		\
+			bits |= (uint64_t)src[inpos++] << (56 - nr_bits); \
+			nr_bits += 8;					\
+		}							\
 	}								\
 } while (0)
 
+#define PEEK_BITS(n) ((uint32_t)(bits >> (64 - (n))))
+
+#define SKIP_BITS(n)							\
+do {									\
+	bits <<= (n);							\
+	nr_bits -= (n);							\
+} while (0)
+
+/*
+ * Strictly speaking, we ought to check that there are enough bits left
+ * for each field. However, a field is never longer than 9 bits, so it
+ * never spans more than two bytes. And whenever we are reading a field
+ * which isn't the final end marker, there damn well ought to be an end
+ * marker (7 more bits) after it. So it's perfectly OK just to require
+ * that the byte containing the start of the field (at 'ofs' bits from
+ * the current position) is not the last one. And a *lot* cheaper.
+ */
+#define CHECK_INPUT(ofs)						\
+do {									\
+	if ((long)inpos * 8 - nr_bits + (ofs) >= limit)			\
+		return -EINVAL;						\
+} while (0)
+
+/*
+ * Length encodings, indexed by the next four bits: the length, and how
+ * many bits its code used. 00, 01, 10 ==> 2, 3, 4 and 1100, 1101, 1110
+ * ==> 5, 6, 7. For 1111, the length is at least 8 and continues with
+ * further nybbles.
+ */
+static const struct {
+	unsigned char length;
+	unsigned char nr_bits;
+} lzs_length_codes[16] = {
+	{ 2, 2 }, { 2, 2 }, { 2, 2 }, { 2, 2 },
+	{ 3, 2 }, { 3, 2 }, { 3, 2 }, { 3, 2 },
+	{ 4, 2 }, { 4, 2 }, { 4, 2 }, { 4, 2 },
+	{ 5, 4 }, { 6, 4 }, { 7, 4 }, { 8, 4 },
+};
+
 int lzs_decompress(unsigned char *dst, int dstlen, const unsigned char *src, int srclen)
 {
 	int outlen = 0;
-	int bits_left = 8; /* Bits left in the current byte at *src */
+	int inpos = 0;
+	uint64_t bits = 0;
+	int nr_bits = 0;
+	/* Position of the start of the last byte, in bits */
+	long limit = ((long)srclen - 1) * 8;
 	uint32_t data;
 	uint16_t offset, length;
 
 	while (1) {
+		/* Keep enough bits for a whole match, up to its length
+		 * extension, and for at least one literal after that. */
+		if (nr_bits < 17)
+			REFILL_BITS();
+
 		/* Get 9 bits, which is the minimum and a common case */
-		GET_BITS(9);
+		CHECK_INPUT(0);
+		data = PEEK_BITS(9);
 
 		/* 0bbbbbbbb is a literal byte. The loop gives a hint to
 		 * the compiler that we expect to see a few of these. */
@@ -83,54 +121,70 @@ int lzs_decompress(unsigned char *dst, int dstlen, const unsigned char *src, int
 			if (outlen == dstlen)
 				return -EFBIG;
 			dst[outlen++] = data;
-			GET_BITS(9);
+			SKIP_BITS(9);
+			if (nr_bits < 17)
+				REFILL_BITS();
+			CHECK_INPUT(0);
+			data = PEEK_BITS(9);
 		}
 
-		/* 110000000 is the end marker */
-		if (data == 0x180)
-			return outlen;
-
-		/* 11bbbbbbb is a 7-bit offset */
-		offset = data & 0x7f;
+		if (data >= 0x180) {
+			/* 110000000 is the end marker */
+			if (data == 0x180)
+				return outlen;
 
-		/* 10bbbbbbbbbbb is an 11-bit offset, so get the next 4 bits */
-		if (data < 0x180) {
-			GET_BITS(4);
-
-			offset <<= 4;
-			offset |= data;
+			/* 11bbbbbbb is a 7-bit offset */
+			offset = data & 0x7f;
+			SKIP_BITS(9);
+		} else {
+			/* 10bbbbbbbbbbb is an 11-bit offset */
+			CHECK_INPUT(9);
+			offset = PEEK_BITS(13) & 0x7ff;
+			SKIP_BITS(13);
 		}
 
 		/* This is a compressed sequence; now get the length */
-		GET_BITS(2);
-		if (data != 3) {
-			/* 00, 01, 10 ==> 2, 3, 4 */
-			length = data + 2;
-		} else {
-			GET_BITS(2);
-			if (data != 3) {
-				/* 1100, 1101, 1110 => 5, 6, 7 */
-				length = data + 5;
-			} else {
-				/* For each 1111 prefix add 15 to the length. Then add
-				   the value of final nybble. */
-				length = 8;
-
-				while (1) {
-					GET_BITS(4);
-					if (data != 15) {
-						length += data;
-						break;
-					}
-					length += 15;
+		CHECK_INPUT(0);
+		data = PEEK_BITS(4);
+		if (lzs_length_codes[data].nr_bits == 4)
+			CHECK_INPUT(2);
+		length = lzs_length_codes[data].length;
+		SKIP_BITS(lzs_length_codes[data].nr_bits);
+
+		if (length == 8) {
+			/* For each 1111 prefix add 15 to the length. Then add
+			   the value of final nybble. */
+			while (1) {
+				if (nr_bits < 4)
+					REFILL_BITS();
+				CHECK_INPUT(0);
+				data = PEEK_BITS(4);
+				SKIP_BITS(4);
+				if (data != 15) {
+					length += data;
+					break;
 				}
+				length += 15;
 			}
 		}
-		if (offset > outlen)
+		/* A zero offset would copy bytes we haven't written yet */
+		if (!offset || offset > outlen)
 			return -EINVAL;
 		if (length + outlen > dstlen)
 			return -EFBIG;
 
+		/* When the source is at least a word behind, the copies
+		 * can't overlap and we can move a word at a time. If
+		 * there's room, just overrun the end of the match; those
+		 * bytes will be overwritten by whatever comes next. */
+		if (offset >= 8 && length + 7 <= dstlen - outlen) {
+			int i;
+
+			for (i = 0; i < length; i += 8)
+				memcpy(dst + outlen + i, dst + outlen + i - offset, 8);
+			outlen += length;
+			continue;
+		}
 		while (length) {
 			dst[outlen] = dst[outlen - offset];
 			outlen++;
@@ -163,104 +217,197 @@ do {								\
  * Much of the compression algorithm used here is based very loosely on ideas
  * from isdn_lzscomp.c by Andre Beck: http://micky.ibh.de/~beck/stuff/lzs4i4l/
  */
-int lzs_compress(unsigned char *dst, int dstlen, const unsigned char *src, int srclen)
+
+/*
+ * This is theoretically a hash. But RAM is cheap and just loading the
+ * 16-bit value and using it as a hash is *much* faster.
+ */
+#define HASH_BITS 16
+#define HASH_TABLE_SIZE (1ULL << HASH_BITS)
+#define HASH(p) (((struct oc_packed_uint16_t *)(p))->d)
+
+/*
+ * We use INVALID_OFS (0xffff) in the hash table for 'none', since we know
+ * IP packets are limited to 64KiB and we can never be *starting* a match
+ * at the penultimate byte of the packet.
+ */
+#define INVALID_OFS 0xffff
+#define MAX_HISTORY (1<<11) /* Highest offset LZS can represent is 11 bits */
+
+/*
+ * How hard to try, for each compression level. We stop following the
+ * hash chain after max_chain candidates, or as soon as we have a match
+ * of nice_len bytes. With lazy matching, before using a match we also
+ * look for a longer one starting at the next byte, and if there is one
+ * we emit a literal and use that instead.
+ */
+struct lzs_level {
+	int max_chain;
+	int nice_len;
+	int lazy;
+};
+
+static const struct lzs_level lzs_levels[] = {
+	[OC_COMPRESSION_LEVEL_DEFAULT] = { 64, 128, 0 },
+	[OC_COMPRESSION_LEVEL_FAST] = { 4, 16, 0 },
+	[OC_COMPRESSION_LEVEL_MAX] = { MAX_HISTORY, 0xffff, 1 },
+};
+
+/* Find the longest match for the data at inpos, starting with the
+ * candidate at hofs and following the hash chain from there. Returns
+ * the length, or zero if there is no candidate within reach. */
+static inline int lzs_find_match(const unsigned char *src, int srclen, int inpos,
+				 const uint16_t *hash_chain, uint16_t hofs,
+				 const struct lzs_level *lvl, uint16_t *match_ofs)
+{
+	int longest_match_len, chain = lvl->max_chain;
+
+	if (hofs == INVALID_OFS || hofs + MAX_HISTORY <= inpos)
+		return 0;
+
+	/* Since the hash is 16-bits, we *know* the first two bytes match */
+	longest_match_len = 2;
+	*match_ofs = hofs;
+
+	for (; hofs != INVALID_OFS && hofs + MAX_HISTORY > inpos;
+	     hofs = hash_chain[hofs & (MAX_HISTORY - 1)]) {
+
+		/* We only get here if longest_match_len is >= 2. We need to find
+		   a match of longest_match_len + 1 for it to be interesting. */
+		if (!memcmp(src + hofs + 2, src + inpos + 2, longest_match_len - 1)) {
+			*match_ofs = hofs;
+
+			do {
+				longest_match_len++;
+
+				/* If we cannot *have* a longer match because we're at the
+				 * end of the input, stop looking */
+				if (longest_match_len + inpos == srclen)
+					return longest_match_len;
+
+			} while (src[longest_match_len + inpos] == src[longest_match_len + hofs]);
+		}
+
+		if (longest_match_len >= lvl->nice_len || !--chain)
+			break;
+	}
+	return longest_match_len;
+}
+
+/*
+ * There are two data structures for tracking the history. The first is
+ * the true hash table, an array indexed by the hash value described
+ * above. It yields the offset in the input buffer at which the given
+ * hash was most recently seen.
+ *
+ * The second data structure allows us to find the previous occurrences
+ * of the same hash value. It is a ring buffer containing links only for
+ * the latest MAX_HISTORY bytes of the input. The lookup for a given
+ * offset will yield the previous offset at which the same data hash
+ * value was found.
+ *
+ * Clearing the hash table for each packet would mean writing 128KiB,
+ * which costs more than compressing a typical packet. So it lives in
+ * the state kept across calls, and each entry holds the offset plus a
+ * 'base' which advances by 64KiB for each packet. Entries lower than
+ * the current base are left over from earlier packets and ignored.
+ */
+struct lzs_state {
+	uint32_t base;
+	uint32_t hash_table[HASH_TABLE_SIZE];
+	uint16_t hash_chain[MAX_HISTORY];
+};
+
+struct lzs_state *lzs_alloc_state(void)
 {
+	return calloc(1, sizeof(struct lzs_state));
+}
+
+int lzs_compress(struct lzs_state *state, unsigned char *dst, int dstlen,
+		 const unsigned char *src, int srclen, int level)
+{
+	const struct lzs_level *lvl;
 	int length, offset;
 	int inpos = 0, outpos = 0;
-	uint16_t longest_match_len;
-	uint16_t hofs, longest_match_ofs;
+	int next_insert = 0, match_len, lazy_len;
+	uint16_t match_ofs = 0, lazy_ofs = 0;
+	uint16_t hofs;
 	uint16_t hash;
 	uint32_t outbits = 0;
 	int nr_outbits = 0;
-
+	uint32_t base, ent;
+	uint32_t *hash_table = state->hash_table;
 	/*
-	 * This is theoretically a hash. But RAM is cheap and just loading the
-	 * 16-bit value and using it as a hash is *much* faster.
+	 * We must never search from a position earlier than the last one we
+	 * inserted, or we could follow a link which has been overwritten by
+	 * a later position in the ring.
 	 */
-#define HASH_BITS 16
-#define HASH_TABLE_SIZE (1ULL << HASH_BITS)
-#define HASH(p) (((struct oc_packed_uint16_t *)(p))->d)
+	uint16_t *hash_chain = state->hash_chain;
 
-	/*
-	 * There are two data structures for tracking the history. The first
-	 * is the true hash table, an array indexed by the hash value described
-	 * above. It yields the offset in the input buffer at which the given
-	 * hash was most recently seen. We use INVALID_OFS (0xffff) for none
-	 * since we know IP packets are limited to 64KiB and we can never be
-	 * *starting* a match at the penultimate byte of the packet.
-	 */
-#define INVALID_OFS 0xffff
-	uint16_t hash_table[HASH_TABLE_SIZE]; /* Buffer offset for first match */
+#define INSERT_HASH(pos) do {						\
+		hash = HASH(src + (pos));				\
+		ent = hash_table[hash];					\
+		hash_chain[(pos) & (MAX_HISTORY - 1)] =			\
+			ent >= base ? ent - base : INVALID_OFS;		\
+		hash_table[hash] = base + (pos);			\
+	} while (0)
 
-	/*
-	 * The second data structure allows us to find the previous occurrences
-	 * of the same hash value. It is a ring buffer containing links only for
-	 * the latest MAX_HISTORY bytes of the input. The lookup for a given
-	 * offset will yield the previous offset at which the same data hash
-	 * value was found.
-	 */
-#define MAX_HISTORY (1<<11) /* Highest offset LZS can represent is 11 bits */
-	uint16_t hash_chain[MAX_HISTORY];
+	if (level < 0 || level >= sizeof(lzs_levels) / sizeof(lzs_levels[0]))
+		return -EINVAL;
+	lvl = &lzs_levels[level];
 
 	/* Just in case anyone tries to use this in a more general-purpose
 	 * scenario... */
 	if (srclen > INVALID_OFS + 1)
 		return -EFBIG;
 
-	/* No need to initialise hash_chain since we can only ever follow
+	/* Invalidate everything from the previous packet. Only when the
+	 * base wraps do we actually need to clear the table. There's no
+	 * need to initialise hash_chain since we can only ever follow
 	 * links to it that have already been initialised. */
-	memset(hash_table, 0xff, sizeof(hash_table));
+	base = state->base += INVALID_OFS + 1;
+	if (!base) {
+		memset(hash_table, 0, sizeof(state->hash_table));
+		base = state->base = INVALID_OFS + 1;
+	}
 
 	while (inpos < srclen - 2) {
-		hash = HASH(src + inpos);
-		hofs = hash_table[hash];
-
-		hash_chain[inpos & (MAX_HISTORY - 1)] = hofs;
-		hash_table[hash] = inpos;
+		if (next_insert <= inpos) {
+			INSERT_HASH(inpos);
+			next_insert = inpos + 1;
+		}
 
-		if (hofs == INVALID_OFS || hofs + MAX_HISTORY <= inpos) {
+		match_len = lzs_find_match(src, srclen, inpos, hash_chain,
+					   hash_chain[inpos & (MAX_HISTORY - 1)],
+					   lvl, &match_ofs);
+		if (!match_len) {
 			PUT_BITS(9, src[inpos]);
 			inpos++;
 			continue;
 		}
 
-		/* Since the hash is 16-bits, we *know* the first two bytes match */
-		longest_match_len = 2;
-		longest_match_ofs = hofs;
-
-		for (; hofs != INVALID_OFS && hofs + MAX_HISTORY > inpos;
-		     hofs = hash_chain[hofs & (MAX_HISTORY - 1)]) {
-
-			/* We only get here if longest_match_len is >= 2. We need to find
-			   a match of longest_match_len + 1 for it to be interesting. */
-			if (!memcmp(src + hofs + 2, src + inpos + 2, longest_match_len - 1)) {
-				longest_match_ofs = hofs;
-
-				do {
-					longest_match_len++;
-
-					/* If we cannot *have* a longer match because we're at the
-					 * end of the input, stop looking */
-					if (longest_match_len + inpos == srclen)
-						goto got_match;
-
-				} while (src[longest_match_len + inpos] == src[longest_match_len + hofs]);
+		while (lvl->lazy && match_len < lvl->nice_len &&
+		       inpos + 1 < srclen - 2) {
+			if (next_insert <= inpos + 1) {
+				INSERT_HASH(inpos + 1);
+				next_insert = inpos + 2;
 			}
 
-			/* Typical compressor tuning would have a break out of the loop
-			   here depending on the number of potential match locations we've
-			   tried, or a value of longest_match_len that's considered "good
-			   enough" so we stop looking for something better. We could also
-			   do a hybrid where we count the total bytes compared, so 5
-			   attempts to find a match better than 10 bytes is worth the same
-			   as 10 attempts to find a match better than 5 bytes. Or
-			   something. Anyway, we currently don't give up until we run out
-			   of reachable history — maximal compression. */
+			lazy_len = lzs_find_match(src, srclen, inpos + 1, hash_chain,
+						  hash_chain[(inpos + 1) & (MAX_HISTORY - 1)],
+						  lvl, &lazy_ofs);
+			if (lazy_len <= match_len)
+				break;
+
+			PUT_BITS(9, src[inpos]);
+			inpos++;
+			match_len = lazy_len;
+			match_ofs = lazy_ofs;
 		}
-	got_match:
+
 		/* Output offset, as 7-bit or 11-bit as appropriate */
-		offset = inpos - longest_match_ofs;
-		length = longest_match_len;
+		offset = inpos - match_ofs;
+		length = match_len;
 
 		if (offset < 0x80)
 			PUT_BITS(9, 0x180 | offset);
@@ -284,25 +431,24 @@ int lzs_compress(unsigned char *dst, int dstlen, const unsigned char *src, int s
 				PUT_BITS(4, length);
 		}
 
+		inpos += match_len;
+
 		/* If we're already done, don't bother updating the hash tables. */
-		if (inpos + longest_match_len >= srclen - 2) {
-			inpos += longest_match_len;
+		if (inpos >= srclen - 2)
 			break;
-		}
 
-		/* We already added the first byte to the hash tables. Add the rest. */
-		inpos++;
-		while (--longest_match_len) {
-			hash = HASH(src + inpos);
-			hash_chain[inpos & (MAX_HISTORY - 1)] = hash_table[hash];
-			hash_table[hash] = inpos++;
+		/* Add the rest of the matched bytes to the hash tables. */
+		while (next_insert < inpos) {
+			INSERT_HASH(next_insert);
+			next_insert++;
 		}
 	}
 
 	/* Special cases at the end */
 	if (inpos == srclen - 2) {
 		hash = HASH(src + inpos);
-		hofs = hash_table[hash];
+		ent = hash_table[hash];
+		hofs = ent >= base ? ent - base : INVALID_OFS;
 
 		if (hofs != INVALID_OFS && hofs + MAX_HISTORY > inpos) {
 			offset = inpos - hofs;
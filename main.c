@@ -84,6 +84,7 @@ int background;
 static int do_passphrase_from_fsid;
 static int non_inter;
 static int cookieonly;
+static int benchmark_ciphers;
 static int allow_stdin_read;
 
 static char *token_filename;
@@ -189,6 +190,11 @@ enum {
 	OPT_PROTOCOL,
 	OPT_SERVER,
 	OPT_PASSTOS,
+	OPT_KTLS,
+	OPT_DSCP_PRIORITY,
+	OPT_COMPRESSION_LEVEL,
+	OPT_BENCHMARK_CIPHERS,
+	OPT_NETLINK_CONFIG,
 	OPT_REQUEST_IP,
 };
 
@@ -217,6 +223,7 @@ static const struct option long_options[] = {
 	OPTION("sslkey", 1, 'k'),
 	OPTION("cookie", 1, 'C'),
 	OPTION("compression", 1, OPT_COMPRESSION),
+	OPTION("compression-level", 1, OPT_COMPRESSION_LEVEL),
 	OPTION("deflate", 0, 'd'),
 	OPTION("juniper", 0, OPT_JUNIPER),
 	OPTION("no-deflate", 0, 'D'),
@@ -230,6 +237,10 @@ static const struct option long_options[] = {
 	OPTION("script", 1, 's'),
 	OPTION("timestamp", 0, OPT_TIMESTAMP),
 	OPTION("passtos", 0, OPT_PASSTOS),
+	OPTION("ktls", 0, OPT_KTLS),
+	OPTION("dscp-priority", 0, OPT_DSCP_PRIORITY),
+	OPTION("benchmark-ciphers", 0, OPT_BENCHMARK_CIPHERS),
+	OPTION("netlink-config", 0, OPT_NETLINK_CONFIG),
 	OPTION("key-password", 1, 'p'),
 	OPTION("proxy", 1, 'P'),
 	OPTION("proxy-auth", 1, OPT_PROXY_AUTH),
@@ -796,6 +807,7 @@ static void usage(void)
 	printf("      --cookie-on-stdin           %s\n", _("Read cookie from standard input"));
 	printf("  -d, --deflate                   %s\n", _("Enable compression (default)"));
 	printf("  -D, --no-deflate                %s\n", _("Disable compression"));
+	printf("      --compression-level=LEVEL   %s\n", _("Compression effort: fast, default or max"));
 	printf("      --force-dpd=INTERVAL        %s\n", _("Set minimum Dead Peer Detection interval"));
 	printf("  -g, --usergroup=GROUP           %s\n", _("Set login usergroup"));
 	printf("  -h, --help                      %s\n", _("Display help text"));
@@ -805,6 +817,9 @@ static void usage(void)
 #endif
 	printf("      --timestamp                 %s\n", _("Prepend timestamp to progress messages"));
 	printf("      --passtos                   %s\n", _("copy TOS / TCLASS when using DTLS"));
+	printf("      --ktls                      %s\n", _("Use kernel TLS offload for the HTTPS tunnel"));
+	printf("      --dscp-priority             %s\n", _("Send DSCP EF/CS6 packets ahead of other traffic"));
+	printf("      --benchmark-ciphers         %s\n", _("Prefer the ciphers which are fastest on this CPU"));
 #ifndef _WIN32
 	printf("  -U, --setuid=USER               %s\n", _("Drop privileges after connecting"));
 	printf("      --csd-user=USER             %s\n", _("Drop privileges during CSD execution"));
@@ -826,6 +841,7 @@ static void usage(void)
 	printf("  -Q, --queue-len=LEN             %s\n", _("Set packet queue limit to LEN pkts"));
 	printf("  -s, --script=SCRIPT             %s\n", _("Shell command line for using a vpnc-compatible config script"));
 	printf("                                  %s: \"%s\"\n", _("default"), default_vpncscript);
+	printf("      --netlink-config            %s\n", _("Set addresses and routes directly instead of using the script"));
 #ifndef _WIN32
 	printf("  -S, --script-tun                %s\n", _("Pass traffic to 'script' program, not tun"));
 #endif
@@ -1208,6 +1224,19 @@ int main(int argc, char **argv)
 				exit(1);
 			}
 			break;
+		case OPT_COMPRESSION_LEVEL:
+			if (!strcmp(config_arg, "fast"))
+				openconnect_set_compression_level(vpninfo, OC_COMPRESSION_LEVEL_FAST);
+			else if (!strcmp(config_arg, "default"))
+				openconnect_set_compression_level(vpninfo, OC_COMPRESSION_LEVEL_DEFAULT);
+			else if (!strcmp(config_arg, "max"))
+				openconnect_set_compression_level(vpninfo, OC_COMPRESSION_LEVEL_MAX);
+			else {
+				fprintf(stderr, _("Invalid compression level '%s'\n"),
+					config_arg);
+				exit(1);
+			}
+			break;
 		case OPT_CAFILE:
 			openconnect_set_cafile(vpninfo, dup_config_arg());
 			break;
@@ -1447,6 +1476,21 @@ int main(int argc, char **argv)
 		case OPT_PASSTOS:
 			openconnect_set_pass_tos(vpninfo, 1);
 			break;
+		case OPT_KTLS:
+			openconnect_set_ktls(vpninfo, 1);
+			break;
+		case OPT_DSCP_PRIORITY:
+			openconnect_set_dscp_priority(vpninfo, 1);
+			break;
+		case OPT_BENCHMARK_CIPHERS:
+			benchmark_ciphers = 1;
+			break;
+		case OPT_NETLINK_CONFIG:
+			if (openconnect_set_netlink_config(vpninfo, 1)) {
+				fprintf(stderr, _("--netlink-config is only supported on Linux\n"));
+				exit(1);
+			}
+			break;
 		case OPT_TIMESTAMP:
 			timestamp = 1;
 			break;
@@ -1502,6 +1546,19 @@ int main(int argc, char **argv)
 	}
 #endif /* !_WIN32 && !__native_client__ */
 
+	if (benchmark_ciphers && !openconnect_benchmark_ciphers(vpninfo)) {
+		const struct oc_cipher_speed *speed;
+
+		for (speed = openconnect_get_cipher_speeds(vpninfo); speed->name; speed++) {
+			if (speed->mbps)
+				vpn_progress(vpninfo, PRG_INFO, _("%s: %u MB/s\n"),
+					     speed->name, speed->mbps);
+			else
+				vpn_progress(vpninfo, PRG_INFO, _("%s: not available\n"),
+					     speed->name);
+		}
+	}
+
 #ifndef _WIN32
 	memset(&sa, 0, sizeof(sa));
 
@@ -30,9 +30,109 @@
 
 #include "openconnect-internal.h"
 
-int queue_new_packet(struct pkt_q *q, void *buf, int len)
+/* Received packets are allocated from a small pool, to which tun_mainloop()
+ * returns them once they've been written to the tun device. So in the
+ * steady state, the receive path doesn't need to malloc() and free() each
+ * packet. Only packets which came from alloc_pkt() may be given back with
+ * free_pkt(); anything else must just be freed. */
+#define PKT_POOL_SIZE	64
+
+struct pkt *alloc_pkt(struct openconnect_info *vpninfo, int len)
+{
+	int alloc_len = sizeof(struct pkt) + len;
+	struct pkt *pkt = vpninfo->free_pkts;
+
+	/* If the MTU has grown, the pooled packets may be too small. Leave
+	 * them for callers which want less, and make a new one. */
+	if (pkt && pkt->alloc_len >= alloc_len) {
+		vpninfo->free_pkts = pkt->next;
+		vpninfo->nr_free_pkts--;
+		return pkt;
+	}
+
+	pkt = malloc(alloc_len);
+	if (pkt)
+		pkt->alloc_len = alloc_len;
+	return pkt;
+}
+
+void free_pkt(struct openconnect_info *vpninfo, struct pkt *pkt)
+{
+	if (!pkt)
+		return;
+
+	if (vpninfo->nr_free_pkts >= PKT_POOL_SIZE) {
+		free(pkt);
+		return;
+	}
+	pkt->next = vpninfo->free_pkts;
+	vpninfo->free_pkts = pkt;
+	vpninfo->nr_free_pkts++;
+}
+
+void free_pkt_pool(struct openconnect_info *vpninfo)
+{
+	struct pkt *pkt;
+
+	while ((pkt = vpninfo->free_pkts)) {
+		vpninfo->free_pkts = pkt->next;
+		free(pkt);
+	}
+	vpninfo->nr_free_pkts = 0;
+}
+
+/* Only packets from alloc_pkt() have alloc_len set, so for the rest
+ * (and the queues are full of them) this counts what they hold. */
+static size_t pkt_q_size(struct pkt_q *q)
+{
+	struct pkt *p;
+	size_t size = 0;
+
+	for (p = q->head; p; p = p->next)
+		size += sizeof(*p) + p->len;
+	return size;
+}
+
+size_t openconnect_get_session_footprint(struct openconnect_info *vpninfo)
+{
+	size_t size = sizeof(*vpninfo);
+	struct pkt *p;
+	int i;
+
+	for (p = vpninfo->free_pkts; p; p = p->next)
+		size += p->alloc_len;
+	if (vpninfo->cstp_pkt)
+		size += vpninfo->cstp_pkt->alloc_len;
+	if (vpninfo->dtls_pkt)
+		size += vpninfo->dtls_pkt->alloc_len;
+	if (vpninfo->tun_pkt)
+		size += sizeof(*p) + vpninfo->ip_info.mtu + vpninfo->pkt_trailer;
+	if (vpninfo->deflate_pkt)
+		size += sizeof(*p) + vpninfo->deflate_pkt_size;
+	if (vpninfo->pending_deflated_pkt)
+		size += sizeof(*p) + vpninfo->pending_deflated_pkt->len;
+	/* Otherwise it's the deflate_pkt, already counted */
+	if (vpninfo->current_ssl_pkt &&
+	    vpninfo->current_ssl_pkt != vpninfo->deflate_pkt)
+		size += sizeof(*p) + vpninfo->current_ssl_pkt->len;
+
+	size += pkt_q_size(&vpninfo->incoming_queue);
+	size += pkt_q_size(&vpninfo->outgoing_queue.prio);
+	for (i = 0; i < FQ_FLOWS; i++)
+		size += pkt_q_size(&vpninfo->outgoing_queue.flows[i].q);
+	size += pkt_q_size(&vpninfo->esp_backlog);
+	size += pkt_q_size(&vpninfo->oncp_control_queue);
+
+#ifdef HAVE_TUN_RING
+	size += tun_ring_size(vpninfo);
+#endif
+	return size;
+}
+
+int queue_new_packet(struct openconnect_info *vpninfo, struct pkt_q *q,
+		     void *buf, int len)
 {
-	struct pkt *new = malloc(sizeof(struct pkt) + len);
+	struct pkt *new = alloc_pkt(vpninfo, len);
 	if (!new)
 		return -ENOMEM;
 
@@ -43,6 +143,476 @@ int queue_new_packet(struct pkt_q *q, void *buf, int len)
 	return 0;
 }
 
+/* CoDel active queue management (RFC8289) for the packet queues between
+ * the tun device and the transports. Rather than bounding the queues by
+ * length, we look at how long the packet at the head has been waiting.
+ * Once that has stayed above CODEL_TARGET for a whole CODEL_INTERVAL, we
+ * start dropping (or ECN-marking) packets at a rate that increases until
+ * the standing queue goes away. */
+#define CODEL_TARGET	5000	/* µs */
+#define CODEL_INTERVAL	100000	/* µs */
+/* Hard limit on either queue, regardless of sojourn times */
+#define CODEL_MAX_QLEN	1000
+
+static uint32_t isqrt(uint32_t n)
+{
+	uint32_t r = 0, bit = 1 << 30;
+
+	while (bit > n)
+		bit >>= 2;
+	while (bit) {
+		if (n >= r + bit) {
+			n -= r + bit;
+			r = (r >> 1) + bit;
+		} else
+			r >>= 1;
+		bit >>= 2;
+	}
+	return r;
+}
+
+static uint64_t codel_control_law(uint64_t t, uint32_t count)
+{
+	return t + CODEL_INTERVAL / isqrt(count ? : 1);
+}
+
+/* Incremental update of an Internet checksum when one 16-bit word
+ * covered by it changes from 'old' to 'new' (RFC1624). */
+static void csum_replace16(unsigned char *csum_p, uint16_t old, uint16_t new)
+{
+	uint32_t csum = (uint16_t)~load_be16(csum_p);
+
+	csum += (uint16_t)~old;
+	csum += new;
+	csum = (csum & 0xffff) + (csum >> 16);
+	csum = (csum & 0xffff) + (csum >> 16);
+	store_be16(csum_p, ~csum);
+}
+
+/* Set the Congestion Experienced bits in an ECN-capable IP packet.
+ * Returns 1 if the packet is now marked, 0 if it needs to be dropped. */
+static int codel_mark_ce(struct pkt *p)
+{
+	unsigned char *ip = p->data;
+
+	if (p->len >= 20 && (ip[0] >> 4) == 4) {
+		uint16_t old;
+
+		if (!(ip[1] & 3))
+			return 0;
+
+		old = load_be16(ip);
+		ip[1] |= 3;
+		csum_replace16(ip + 10, old, load_be16(ip));
+		return 1;
+	} else if (p->len >= 40 && (ip[0] >> 4) == 6) {
+		if (!(ip[1] & 0x30))
+			return 0;
+
+		ip[1] |= 0x30;
+		return 1;
+	}
+	return 0;
+}
+
+static struct pkt *codel_do_dequeue(struct pkt_q *q, uint64_t now, int *ok_to_drop)
+{
+	struct pkt *p = dequeue_packet(q);
+
+	*ok_to_drop = 0;
+	if (!p) {
+		q->codel.first_above_time = 0;
+		return NULL;
+	}
+
+	if (now - p->queued < CODEL_TARGET || !q->count) {
+		/* Went below target; stay below for at least an interval */
+		q->codel.first_above_time = 0;
+	} else if (!q->codel.first_above_time) {
+		q->codel.first_above_time = now + CODEL_INTERVAL;
+	} else if (now >= q->codel.first_above_time) {
+		*ok_to_drop = 1;
+	}
+	return p;
+}
+
+static struct pkt *codel_drop(struct openconnect_info *vpninfo, struct pkt_q *q,
+			      struct pkt *p, uint64_t now, int *ok_to_drop)
+{
+	vpn_progress(vpninfo, PRG_TRACE,
+		     _("CoDel dropped packet of %d bytes after %lu us\n"),
+		     p->len, (unsigned long)(now - p->queued));
+	free(p);
+	return codel_do_dequeue(q, now, ok_to_drop);
+}
+
+static struct pkt *codel_dequeue(struct openconnect_info *vpninfo, struct pkt_q *q)
+{
+	struct codel *c = &q->codel;
+	uint64_t now;
+	struct pkt *p;
+	int ok_to_drop;
+
+	if (!q->head)
+		return NULL;
+
+	now = pkt_time_us();
+	p = codel_do_dequeue(q, now, &ok_to_drop);
+
+	if (c->dropping) {
+		if (!ok_to_drop) {
+			c->dropping = 0;
+			return p;
+		}
+		while (p && now >= c->drop_next && c->dropping) {
+			c->count++;
+			if (codel_mark_ce(p)) {
+				c->drop_next = codel_control_law(c->drop_next, c->count);
+				return p;
+			}
+			p = codel_drop(vpninfo, q, p, now, &ok_to_drop);
+			if (!ok_to_drop)
+				c->dropping = 0;
+			else
+				c->drop_next = codel_control_law(c->drop_next, c->count);
+		}
+	} else if (ok_to_drop) {
+		uint32_t delta = c->count - c->lastcount;
+
+		vpn_progress(vpninfo, PRG_DEBUG,
+			     _("Packet queue delay above %d ms; CoDel dropping\n"),
+			     CODEL_TARGET / 1000);
+		c->dropping = 1;
+		/* If we were dropping recently, start at the rate we left off */
+		if (delta > 1 && now - c->drop_next < 16 * CODEL_INTERVAL)
+			c->count = delta;
+		else
+			c->count = 1;
+		c->drop_next = codel_control_law(now, c->count);
+		c->lastcount = c->count;
+
+		if (!codel_mark_ce(p))
+			p = codel_drop(vpninfo, q, p, now, &ok_to_drop);
+	}
+	return p;
+}
+
+/* Flow-fair queuing of outgoing packets, after fq_codel (RFC8290). Each
+ * packet is hashed on its inner 5-tuple into one of FQ_FLOWS queues, and
+ * those are served by deficit round robin with a quantum of one MTU, each
+ * with its own CoDel state. Flows which have only just become active are
+ * served ahead of those which have been busy for a while, so sparse
+ * traffic like SSH or VoIP overtakes a bulk upload instead of queuing
+ * behind it. With dscp_priority set, packets marked EF or CS6/CS7 bypass
+ * the flow queues altogether. */
+int pkt_get_tos(const struct pkt *p)
+{
+	switch (p->data[0] >> 4) {
+	case 4:
+		return p->data[1];
+	case 6:
+		return (load_be16(p->data) >> 4) & 0xff;
+	default:
+		return -EINVAL;
+	}
+}
+
+uint32_t pkt_flow_hash(const struct pkt *p)
+{
+	const unsigned char *ip = p->data;
+	const unsigned char *ports = NULL;
+	uint32_t h = 2166136261U; /* FNV-1a */
+	int i, proto, addr_ofs, addr_len;
+
+	if (p->len >= 20 && (ip[0] >> 4) == 4) {
+		int hlen = (ip[0] & 0xf) * 4;
+
+		proto = ip[9];
+		addr_ofs = 12;
+		addr_len = 8;
+		/* Only the first fragment carries the ports */
+		if (hlen >= 20 && p->len >= hlen + 4 && !(load_be16(ip + 6) & 0x1fff))
+			ports = ip + hlen;
+	} else if (p->len >= 40 && (ip[0] >> 4) == 6) {
+		proto = ip[6];
+		addr_ofs = 8;
+		addr_len = 32;
+		if (p->len >= 44)
+			ports = ip + 40;
+	} else
+		return 0;
+
+	if (proto != IPPROTO_TCP && proto != IPPROTO_UDP)
+		ports = NULL;
+
+	h = (h ^ proto) * 16777619;
+	for (i = 0; i < addr_len; i++)
+		h = (h ^ ip[addr_ofs + i]) * 16777619;
+	for (i = 0; ports && i < 4; i++)
+		h = (h ^ ports[i]) * 16777619;
+	return h;
+}
+
+/* The DRR quantum */
+static int fq_quantum(struct openconnect_info *vpninfo)
+{
+	return vpninfo->ip_info.mtu ? : 1500;
+}
+
+static void flow_list_add(struct flow_q ***tail, struct flow_q *f)
+{
+	f->next = NULL;
+	**tail = f;
+	*tail = &f->next;
+}
+
+static void flow_list_pop(struct flow_q **head, struct flow_q ***tail)
+{
+	*head = (*head)->next;
+	if (!*head)
+		*tail = head;
+}
+
+void init_outgoing_queue(struct openconnect_info *vpninfo)
+{
+	struct pkt_fq *fq = &vpninfo->outgoing_queue;
+	int i;
+
+	init_aqm_queue(&fq->prio);
+	for (i = 0; i < FQ_FLOWS; i++)
+		init_aqm_queue(&fq->flows[i].q);
+	fq->new_tail = &fq->new_flows;
+	fq->old_tail = &fq->old_flows;
+}
+
+void queue_outgoing(struct openconnect_info *vpninfo, struct pkt *p)
+{
+	struct pkt_fq *fq = &vpninfo->outgoing_queue;
+	struct flow_q *f;
+
+	fq->count++;
+
+	if (vpninfo->dscp_priority) {
+		int dscp = pkt_get_tos(p) >> 2;
+
+		/* EF, CS6 and CS7 */
+		if (dscp == 46 || dscp == 48 || dscp == 56) {
+			queue_packet(&fq->prio, p);
+			return;
+		}
+	}
+
+	f = &fq->flows[pkt_flow_hash(p) % FQ_FLOWS];
+	queue_packet(&f->q, p);
+	if (!f->active) {
+		f->active = 1;
+		f->deficit = fq_quantum(vpninfo);
+		flow_list_add(&fq->new_tail, f);
+	}
+}
+
+/* For a packet which was dequeued but couldn't be sent after all */
+void requeue_outgoing(struct openconnect_info *vpninfo, struct pkt *p)
+{
+	requeue_packet(&vpninfo->outgoing_queue.prio, p);
+	vpninfo->outgoing_queue.count++;
+}
+
+struct pkt *dequeue_outgoing(struct openconnect_info *vpninfo)
+{
+	struct pkt_fq *fq = &vpninfo->outgoing_queue;
+	struct flow_q *f, **head, ***tail;
+	struct pkt *p;
+	int before;
+
+	if ((p = dequeue_packet(&fq->prio))) {
+		fq->count--;
+		return p;
+	}
+
+	while (1) {
+		if (fq->new_flows) {
+			head = &fq->new_flows;
+			tail = &fq->new_tail;
+		} else if (fq->old_flows) {
+			head = &fq->old_flows;
+			tail = &fq->old_tail;
+		} else
+			return NULL;
+		f = *head;
+
+		if (f->deficit <= 0) {
+			f->deficit += fq_quantum(vpninfo);
+			flow_list_pop(head, tail);
+			flow_list_add(&fq->old_tail, f);
+			continue;
+		}
+
+		before = f->q.count;
+		p = codel_dequeue(vpninfo, &f->q);
+		fq->count -= before - f->q.count;
+		if (p) {
+			f->deficit -= p->len;
+			return p;
+		}
+
+		/* An emptied new flow always goes to the back of the old list
+		 * (RFC8290 §4.2), even if that was empty, so that it can't
+		 * jump the queue again straight away. Only an emptied old
+		 * flow becomes inactive. */
+		flow_list_pop(head, tail);
+		if (head == &fq->new_flows)
+			flow_list_add(&fq->old_tail, f);
+		else
+			f->active = 0;
+	}
+}
+
+static uint64_t outgoing_queue_oldest(struct openconnect_info *vpninfo)
+{
+	struct pkt_fq *fq = &vpninfo->outgoing_queue;
+	uint64_t oldest = fq->prio.head ? fq->prio.head->queued : UINT64_MAX;
+	int i;
+
+	for (i = 0; i < FQ_FLOWS; i++) {
+		struct pkt *p = fq->flows[i].q.head;
+
+		if (p && p->queued < oldest)
+			oldest = p->queued;
+	}
+	return oldest;
+}
+
+/* With CoDel watching latency in each flow, the outgoing queue may grow
+ * beyond max_qlen as long as packets are still leaving it. It is full
+ * (and we stop reading from tun) once even CoDel isn't keeping up, or at
+ * the hard limit. */
+static int outgoing_queue_full(struct openconnect_info *vpninfo)
+{
+	int count = vpninfo->outgoing_queue.count;
+	uint64_t oldest;
+
+	if (count < vpninfo->max_qlen)
+		return 0;
+	if (count >= CODEL_MAX_QLEN)
+		return 1;
+
+	oldest = outgoing_queue_oldest(vpninfo);
+	return oldest != UINT64_MAX && pkt_time_us() - oldest >= CODEL_INTERVAL;
+}
+
+/* Clamp the MSS option of TCP SYN packets in either direction, so that
+ * inner connections never negotiate segments which won't fit through the
+ * tunnel. The MTU may drop after the tun device was configured (when
+ * DTLS MTU detection completes, for example), and we can't rely on the
+ * vpnc-script having set up firewall rules to do this for us. */
+static void clamp_tcp_mss(struct openconnect_info *vpninfo, struct pkt *p)
+{
+	unsigned char *ip = p->data, *tcp;
+	int hlen, doff, i, max_mss;
+
+	if (!vpninfo->ip_info.mtu)
+		return;
+
+	if (p->len >= 20 && (ip[0] >> 4) == 4) {
+		hlen = (ip[0] & 0xf) * 4;
+		/* Not TCP, or not the first fragment */
+		if (ip[9] != IPPROTO_TCP || hlen < 20 || (load_be16(ip + 6) & 0x1fff))
+			return;
+		max_mss = vpninfo->ip_info.mtu - 40;
+	} else if (p->len >= 40 && (ip[0] >> 4) == 6) {
+		/* We don't bother to walk extension headers */
+		if (ip[6] != IPPROTO_TCP)
+			return;
+		hlen = 40;
+		max_mss = vpninfo->ip_info.mtu - 60;
+	} else
+		return;
+
+	if (p->len < hlen + 20)
+		return;
+	tcp = ip + hlen;
+
+	/* SYN flag */
+	if (!(tcp[13] & 0x02))
+		return;
+
+	doff = (tcp[12] >> 4) * 4;
+	if (doff < 20 || p->len < hlen + doff)
+		return;
+
+	for (i = 20; i < doff; ) {
+		uint16_t mss;
+
+		if (tcp[i] == 0) /* End of options */
+			return;
+		if (tcp[i] == 1) { /* NOP */
+			i++;
+			continue;
+		}
+		if (i + 1 >= doff || tcp[i + 1] < 2 || i + tcp[i + 1] > doff)
+			return;
+		if (tcp[i] != 2 || tcp[i + 1] != 4) {
+			i += tcp[i + 1];
+			continue;
+		}
+
+		mss = load_be16(tcp + i + 2);
+		if (mss <= max_mss)
+			return;
+
+		vpn_progress(vpninfo, PRG_TRACE,
+			     _("Clamping TCP MSS from %d to %d\n"), mss, max_mss);
+		store_be16(tcp + i + 2, max_mss);
+		/* The checksum is over 16-bit words from the start of the
+		 * TCP header; if the option isn't aligned to that, the
+		 * byte-swapped values give the same result. */
+		if (i & 1)
+			csum_replace16(tcp + 16, (mss >> 8) | (mss << 8),
+				       (max_mss >> 8) | (max_mss << 8));
+		else
+			csum_replace16(tcp + 16, mss, max_mss);
+		return;
+	}
+}
+
+static int read_tun_pkt(struct openconnect_info *vpninfo, struct pkt *pkt)
+{
+#ifndef _WIN32
+	if (vpninfo->pkt_source) {
+		int len;
+
+		if (!vpninfo->pkt_source_more)
+			return -1;
+
+		len = vpninfo->pkt_source(vpninfo->cbdata, pkt->data, pkt->len);
+		if (len <= 0 || len > pkt->len) {
+			vpninfo->pkt_source_more = 0;
+			return -1;
+		}
+		pkt->len = len;
+		return 0;
+	}
+#endif
+	return os_read_tun(vpninfo, pkt);
+}
+
+static int write_tun_pkt(struct openconnect_info *vpninfo, struct pkt *pkt)
+{
+#ifndef _WIN32
+	if (vpninfo->pkt_sink) {
+		/* Straight from the buffer it was decrypted into */
+		if (vpninfo->pkt_sink_full ||
+		    vpninfo->pkt_sink(vpninfo->cbdata, pkt->data, pkt->len)) {
+			vpninfo->pkt_sink_full = 1;
+			return -1;
+		}
+		return 0;
+	}
+#endif
+	return os_write_tun(vpninfo, pkt);
+}
+
 /* This is here because it's generic and hence can't live in either of the
    tun*.c files for specific platforms */
 int tun_mainloop(struct openconnect_info *vpninfo, int *timeout)
@@ -53,11 +623,26 @@ int tun_mainloop(struct openconnect_info *vpninfo, int *timeout)
 	if (!tun_is_up(vpninfo)) {
 		/* no tun yet; clear any queued packets */
 		while ((this = dequeue_packet(&vpninfo->incoming_queue)))
-			free(this);
+			free_pkt(vpninfo, this);
 
 		return 0;
 	}
 
+#ifndef _WIN32
+	if (vpninfo->pkt_source) {
+		char buf[16];
+
+		/* Drain the pipe before looking at the flag, so that neither
+		 * a wakeup is lost nor the pipe left readable. */
+		while (read(vpninfo->tun_fd, buf, sizeof(buf)) > 0)
+			;
+		if (__atomic_exchange_n(&vpninfo->pkt_kicked, 0, __ATOMIC_SEQ_CST)) {
+			vpninfo->pkt_source_more = 1;
+			vpninfo->pkt_sink_full = 0;
+		}
+	}
+#endif
+
 	if (read_fd_monitored(vpninfo, tun)) {
 		struct pkt *out_pkt = vpninfo->tun_pkt;
 		while (1) {
@@ -72,15 +657,17 @@ int tun_mainloop(struct openconnect_info *vpninfo, int *timeout)
 				out_pkt->len = len;
 			}
 
-			if (os_read_tun(vpninfo, out_pkt))
+			if (read_tun_pkt(vpninfo, out_pkt))
 				break;
 
+			clamp_tcp_mss(vpninfo, out_pkt);
+
 			vpninfo->stats.tx_pkts++;
 			vpninfo->stats.tx_bytes += out_pkt->len;
 			work_done = 1;
 
-			if (queue_packet(&vpninfo->outgoing_queue, out_pkt) ==
-			    vpninfo->max_qlen) {
+			queue_outgoing(vpninfo, out_pkt);
+			if (outgoing_queue_full(vpninfo)) {
 				out_pkt = NULL;
 				unmonitor_read_fd(vpninfo, tun);
 				break;
@@ -88,15 +675,20 @@ int tun_mainloop(struct openconnect_info *vpninfo, int *timeout)
 			out_pkt = NULL;
 		}
 		vpninfo->tun_pkt = out_pkt;
-	} else if (vpninfo->outgoing_queue.count < vpninfo->max_qlen) {
+	} else if (!outgoing_queue_full(vpninfo)) {
 		monitor_read_fd(vpninfo, tun);
 	}
 
-	while ((this = dequeue_packet(&vpninfo->incoming_queue))) {
+	/* Nothing stops the transports from adding to the incoming queue */
+	while (vpninfo->incoming_queue.count > CODEL_MAX_QLEN)
+		free_pkt(vpninfo, dequeue_packet(&vpninfo->incoming_queue));
+
+	while ((this = codel_dequeue(vpninfo, &vpninfo->incoming_queue))) {
 
 		unmonitor_write_fd(vpninfo, tun);
 
-		if (os_write_tun(vpninfo, this)) {
+		clamp_tcp_mss(vpninfo, this);
+		if (write_tun_pkt(vpninfo, this)) {
 			requeue_packet(&vpninfo->incoming_queue, this);
 			break;
 		}
@@ -104,7 +696,7 @@ int tun_mainloop(struct openconnect_info *vpninfo, int *timeout)
 		vpninfo->stats.rx_pkts++;
 		vpninfo->stats.rx_bytes += this->len;
 
-		free(this);
+		free_pkt(vpninfo, this);
 	}
 	/* Work is not done if we just got rid of packets off the queue */
 	return work_done;
@@ -164,6 +756,104 @@ static int setup_tun_device(struct openconnect_info *vpninfo)
 	return 0;
 }
 
+/* One pass over everything which might have work to do. Returns zero,
+ * with did_work and timeout set, if the session is still running, 1 if
+ * the caller paused it, or the error from openconnect_mainloop(). */
+static int mainloop_pass(struct openconnect_info *vpninfo, int *timeout,
+			 int *did_work)
+{
+	int ret = 0;
+
+	*did_work = 0;
+	if (vpninfo->quit_reason)
+		return -EIO;
+
+	/* If tun is not up, loop more often to detect
+	 * a DTLS timeout (due to a firewall block) as soon. */
+	if (tun_is_up(vpninfo))
+		*timeout = INT_MAX;
+	else
+		*timeout = 1000;
+
+	if (vpninfo->dtls_state > DTLS_DISABLED) {
+		/* Postpone tun device creation after DTLS is connected so
+		 * we have a better knowledge of the link MTU. We also
+		 * force the creation if DTLS enters sleeping mode - i.e.,
+		 * we failed to connect on time. */
+		if (!tun_is_up(vpninfo) && (vpninfo->dtls_state == DTLS_CONNECTED ||
+		    vpninfo->dtls_state == DTLS_SLEEPING)) {
+			ret = setup_tun_device(vpninfo);
+			if (ret)
+				goto out;
+		}
+
+		ret = vpninfo->proto->udp_mainloop(vpninfo, timeout);
+		if (vpninfo->quit_reason)
+			goto out;
+		*did_work += ret;
+
+	} else if (!tun_is_up(vpninfo)) {
+		/* No DTLS - setup TUN device unconditionally */
+		ret = setup_tun_device(vpninfo);
+		if (ret)
+			goto out;
+	}
+
+	ret = vpninfo->proto->tcp_mainloop(vpninfo, timeout);
+	if (vpninfo->quit_reason)
+		goto out;
+	*did_work += ret;
+
+	/* Tun must be last because it will set/clear its read
+	   bit in tun_monitored according to the queue length */
+	*did_work += tun_mainloop(vpninfo, timeout);
+	if (vpninfo->quit_reason)
+		goto out;
+
+	tune_socket_buffers(vpninfo);
+
+	poll_cmd_fd(vpninfo, 0);
+	if (vpninfo->got_cancel_cmd) {
+		if (vpninfo->cancel_type == OC_CMD_CANCEL) {
+			vpninfo->quit_reason = "Aborted by caller";
+			ret = -EINTR;
+		} else {
+			ret = -ECONNABORTED;
+		}
+		vpninfo->got_cancel_cmd = 0;
+		goto out;
+	}
+
+	if (vpninfo->got_pause_cmd) {
+		/* close all connections and wait for the user to call
+		   openconnect_mainloop() again */
+		openconnect_close_https(vpninfo, 0);
+		ssl_reconnect_abort(vpninfo);
+		if (vpninfo->dtls_state != DTLS_DISABLED) {
+			vpninfo->proto->udp_close(vpninfo);
+			vpninfo->new_dtls_started = 0;
+		}
+
+		vpninfo->got_pause_cmd = 0;
+		vpn_progress(vpninfo, PRG_INFO, _("Caller paused the connection\n"));
+		return 1;
+	}
+	return 0;
+
+ out:
+	return ret < 0 ? ret : -EIO;
+}
+
+static int mainloop_finish(struct openconnect_info *vpninfo, int ret)
+{
+	if (vpninfo->quit_reason && vpninfo->proto->vpn_close_session)
+		vpninfo->proto->vpn_close_session(vpninfo, vpninfo->quit_reason);
+
+	if (tun_is_up(vpninfo))
+		os_shutdown_tun(vpninfo);
+	return ret;
+}
+
 /* Return value:
  *  = 0, when successfully paused (may call again)
  *  = -EINTR, if aborted locally via OC_CMD_CANCEL
@@ -176,7 +866,10 @@ int openconnect_mainloop(struct openconnect_info *vpninfo,
 			 int reconnect_timeout,
 			 int reconnect_interval)
 {
-	int ret = 0;
+	int ret;
+#ifndef _WIN32
+	int fd_too_large = 0;
+#endif
 
 	vpninfo->reconnect_timeout = reconnect_timeout;
 	vpninfo->reconnect_interval = reconnect_interval;
@@ -186,85 +879,23 @@ int openconnect_mainloop(struct openconnect_info *vpninfo,
 		monitor_read_fd(vpninfo, cmd);
 	}
 
-	while (!vpninfo->quit_reason) {
-		int did_work = 0;
-		int timeout;
+	while (1) {
+		int did_work, timeout;
 #ifdef _WIN32
-		HANDLE events[4];
+		HANDLE events[5];
 		int nr_events = 0;
 #else
+		struct oc_poll_fd pfds[OC_MAX_POLL_FDS];
 		struct timeval tv;
 		fd_set rfds, wfds, efds;
+		int i, nr_pfds, nfds = 0;
 #endif
 
-		/* If tun is not up, loop more often to detect
-		 * a DTLS timeout (due to a firewall block) as soon. */
-		if (tun_is_up(vpninfo))
-			timeout = INT_MAX;
-		else
-			timeout = 1000;
-
-		if (vpninfo->dtls_state > DTLS_DISABLED) {
-			/* Postpone tun device creation after DTLS is connected so
-			 * we have a better knowledge of the link MTU. We also
-			 * force the creation if DTLS enters sleeping mode - i.e.,
-			 * we failed to connect on time. */
-			if (!tun_is_up(vpninfo) && (vpninfo->dtls_state == DTLS_CONNECTED ||
-			    vpninfo->dtls_state == DTLS_SLEEPING)) {
-				ret = setup_tun_device(vpninfo);
-				if (ret) {
-					break;
-				}
-			}
-
-			ret = vpninfo->proto->udp_mainloop(vpninfo, &timeout);
-			if (vpninfo->quit_reason)
-				break;
-			did_work += ret;
-
-		} else if (!tun_is_up(vpninfo)) {
-			/* No DTLS - setup TUN device unconditionally */
-			ret = setup_tun_device(vpninfo);
-			if (ret)
-				break;
-		}
-
-		ret = vpninfo->proto->tcp_mainloop(vpninfo, &timeout);
-		if (vpninfo->quit_reason)
-			break;
-		did_work += ret;
-
-		/* Tun must be last because it will set/clear its bit
-		   in the select_rfds according to the queue length */
-		did_work += tun_mainloop(vpninfo, &timeout);
-		if (vpninfo->quit_reason)
-			break;
-
-		poll_cmd_fd(vpninfo, 0);
-		if (vpninfo->got_cancel_cmd) {
-			if (vpninfo->cancel_type == OC_CMD_CANCEL) {
-				vpninfo->quit_reason = "Aborted by caller";
-				ret = -EINTR;
-			} else {
-				ret = -ECONNABORTED;
-			}
-			vpninfo->got_cancel_cmd = 0;
-			break;
-		}
-
-		if (vpninfo->got_pause_cmd) {
-			/* close all connections and wait for the user to call
-			   openconnect_mainloop() again */
-			openconnect_close_https(vpninfo, 0);
-			if (vpninfo->dtls_state != DTLS_DISABLED) {
-				vpninfo->proto->udp_close(vpninfo);
-				vpninfo->new_dtls_started = 0;
-			}
-
-			vpninfo->got_pause_cmd = 0;
-			vpn_progress(vpninfo, PRG_INFO, _("Caller paused the connection\n"));
+		ret = mainloop_pass(vpninfo, &timeout, &did_work);
+		if (ret > 0)
 			return 0;
-		}
+		if (ret < 0)
+			break;
 
 		if (did_work)
 			continue;
@@ -281,6 +912,12 @@ int openconnect_mainloop(struct openconnect_info *vpninfo,
 			WSAEventSelect(vpninfo->ssl_fd, vpninfo->ssl_event, vpninfo->ssl_monitored);
 			events[nr_events++] = vpninfo->ssl_event;
 		}
+		if (vpninfo->reconnect_monitored) {
+			/* A failed connect() is only reported by FD_CONNECT */
+			WSAEventSelect(vpninfo->reconnect_fd, vpninfo->reconnect_event,
+				       vpninfo->reconnect_monitored | FD_CONNECT);
+			events[nr_events++] = vpninfo->reconnect_event;
+		}
 		if (vpninfo->cmd_monitored) {
 			WSAEventSelect(vpninfo->cmd_fd, vpninfo->cmd_event, vpninfo->cmd_monitored);
 			events[nr_events++] = vpninfo->cmd_event;
@@ -296,25 +933,125 @@ int openconnect_mainloop(struct openconnect_info *vpninfo,
 			free(errstr);
 		}
 #else
-		memcpy(&rfds, &vpninfo->_select_rfds, sizeof(rfds));
-		memcpy(&wfds, &vpninfo->_select_wfds, sizeof(wfds));
-		memcpy(&efds, &vpninfo->_select_efds, sizeof(efds));
+		FD_ZERO(&rfds);
+		FD_ZERO(&wfds);
+		FD_ZERO(&efds);
+
+		nr_pfds = openconnect_get_poll_fds(vpninfo, pfds, OC_MAX_POLL_FDS);
+		for (i = 0; i < nr_pfds; i++) {
+			int fd = pfds[i].fd;
+
+			if (fd >= FD_SETSIZE) {
+				/* Once is enough; the poll API can cope with it */
+				if (!fd_too_large)
+					vpn_progress(vpninfo, PRG_ERR,
+						     _("fd %d too large for select()\n"), fd);
+				fd_too_large = 1;
+				continue;
+			}
+			if (pfds[i].events & OC_POLL_READ)
+				FD_SET(fd, &rfds);
+			if (pfds[i].events & OC_POLL_WRITE)
+				FD_SET(fd, &wfds);
+			if (pfds[i].events & OC_POLL_EXCEPT)
+				FD_SET(fd, &efds);
+			if (nfds <= fd)
+				nfds = fd + 1;
+		}
 
 		tv.tv_sec = timeout / 1000;
 		tv.tv_usec = (timeout % 1000) * 1000;
 
-		select(vpninfo->_select_nfds, &rfds, &wfds, &efds, &tv);
+		select(nfds, &rfds, &wfds, &efds, &tv);
 #endif
 	}
 
-	if (vpninfo->quit_reason && vpninfo->proto->vpn_close_session)
-		vpninfo->proto->vpn_close_session(vpninfo, vpninfo->quit_reason);
+	return mainloop_finish(vpninfo, ret);
+}
 
-	if (tun_is_up(vpninfo))
-		os_shutdown_tun(vpninfo);
-	return ret < 0 ? ret : -EIO;
+#ifdef _WIN32
+int openconnect_mainloop_start(struct openconnect_info *vpninfo,
+			       int reconnect_timeout,
+			       int reconnect_interval)
+{
+	return -EOPNOTSUPP;
 }
 
+int openconnect_get_poll_fds(struct openconnect_info *vpninfo,
+			     struct oc_poll_fd *fds, int nr_fds)
+{
+	return -EOPNOTSUPP;
+}
+
+int openconnect_mainloop_dispatch(struct openconnect_info *vpninfo,
+				  int *timeout)
+{
+	return -EOPNOTSUPP;
+}
+#else
+int openconnect_mainloop_start(struct openconnect_info *vpninfo,
+			       int reconnect_timeout,
+			       int reconnect_interval)
+{
+	vpninfo->reconnect_timeout = reconnect_timeout;
+	vpninfo->reconnect_interval = reconnect_interval;
+
+	if (vpninfo->cmd_fd != -1) {
+		monitor_fd_new(vpninfo, cmd);
+		monitor_read_fd(vpninfo, cmd);
+	}
+	return 0;
+}
+
+int openconnect_get_poll_fds(struct openconnect_info *vpninfo,
+			     struct oc_poll_fd *fds, int nr_fds)
+{
+	const struct {
+		int fd, events;
+	} all[OC_MAX_POLL_FDS] = {
+		{ vpninfo->ssl_fd, vpninfo->ssl_monitored },
+		{ vpninfo->dtls_fd, vpninfo->dtls_monitored },
+		{ vpninfo->tun_fd, vpninfo->tun_monitored },
+		{ vpninfo->cmd_fd, vpninfo->cmd_monitored },
+		{ vpninfo->reconnect_fd, vpninfo->reconnect_monitored },
+	};
+	int i, nr = 0;
+
+	for (i = 0; i < OC_MAX_POLL_FDS; i++) {
+		if (all[i].fd < 0 || !all[i].events)
+			continue;
+		if (nr < nr_fds) {
+			fds[nr].fd = all[i].fd;
+			fds[nr].events = all[i].events;
+		}
+		nr++;
+	}
+	return nr;
+}
+
+/* Everything is tried on every pass, so which fd woke the caller makes
+ * no difference. Just one pass per call, so that a busy session can't
+ * starve the others in the caller's loop; if it did some work, it asks
+ * to be called again straight away. */
+int openconnect_mainloop_dispatch(struct openconnect_info *vpninfo,
+				  int *timeout)
+{
+	int ret, did_work;
+
+	ret = mainloop_pass(vpninfo, timeout, &did_work);
+	if (ret > 0)
+		return 0;
+	if (ret < 0)
+		return mainloop_finish(vpninfo, ret);
+
+	if (did_work)
+		*timeout = 0;
+	else if (*timeout == INT_MAX)
+		*timeout = -1;
+	return 1;
+}
+#endif
+
 int ka_check_deadline(int *timeout, time_t now, time_t due)
 {
 	if (now >= due)
@@ -0,0 +1,629 @@
+/*
+ * OpenConnect (SSL + DTLS) VPN client
+ *
+ * Copyright © 2008-2015 Intel Corporation.
+ *
+ * Author: David Woodhouse <dwmw2@infradead.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ */
+
+/*
+ * Built-in configuration of the tun device, as an alternative to running
+ * vpnc-script. The addresses, MTU and routes in vpninfo->ip_info are
+ * applied over rtnetlink, many requests to a sendmsg(). What was applied
+ * is remembered, so that on reconnect only the differences are sent.
+ *
+ * Like vpnc-script, traffic to the VPN server itself and to the split
+ * excludes is routed the way it went before we started. Unlike
+ * vpnc-script, the default route is not replaced; it is overridden by
+ * 0.0.0.0/1 and 128.0.0.0/1 (or ::/1 and 8000::/1) via the tun device,
+ * which disappear along with it. DNS is not configured.
+ */
+
+#include <config.h>
+
+#ifdef HAVE_LINUX_RTNETLINK_H
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <net/if.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "openconnect-internal.h"
+
+/* Requests sent before we stop and collect the acks. Each ack costs
+ * a skb in our receive queue, and too many would overflow it. */
+#define NL_BATCH 64
+
+struct nl_route {
+	unsigned char family;
+	unsigned char plen;
+	unsigned char has_gw;
+	unsigned char dst[16];
+	unsigned char gw[16];
+	int oif;		/* 0 for the tun device */
+};
+
+struct nl_config {
+	int mtu;
+	int nr_addrs;
+	struct nl_route *addrs;
+	int nr_routes;
+	struct nl_route *routes;
+};
+
+struct nl_sock {
+	struct openconnect_info *vpninfo;
+	int fd;
+	unsigned int seq;
+	int nr_pending;
+	int errors;
+	struct oc_text_buf *buf;
+	/* For RTM_GETROUTE replies */
+	struct nl_route *reply;
+};
+
+struct nl_req {
+	struct nlmsghdr n;
+	union {
+		struct ifinfomsg i;
+		struct ifaddrmsg a;
+		struct rtmsg r;
+	};
+	char attrs[64];
+};
+
+static int addr_len(int family)
+{
+	return family == AF_INET6 ? 16 : 4;
+}
+
+static void nl_addattr(struct nl_req *req, int type, const void *data, int len)
+{
+	struct rtattr *rta = (void *)((char *)req + NLMSG_ALIGN(req->n.nlmsg_len));
+
+	rta->rta_type = type;
+	rta->rta_len = RTA_LENGTH(len);
+	memcpy(RTA_DATA(rta), data, len);
+	req->n.nlmsg_len = NLMSG_ALIGN(req->n.nlmsg_len) + RTA_ALIGN(rta->rta_len);
+}
+
+static void nl_parse_route(struct nlmsghdr *n, struct nl_route *r)
+{
+	struct rtmsg *rtm = NLMSG_DATA(n);
+	struct rtattr *rta = RTM_RTA(rtm);
+	int len = RTM_PAYLOAD(n);
+	int alen = addr_len(rtm->rtm_family);
+
+	for (; RTA_OK(rta, len); rta = RTA_NEXT(rta, len)) {
+		if (rta->rta_type == RTA_GATEWAY && RTA_PAYLOAD(rta) == alen) {
+			memcpy(r->gw, RTA_DATA(rta), alen);
+			r->has_gw = 1;
+		} else if (rta->rta_type == RTA_OIF && RTA_PAYLOAD(rta) == sizeof(int)) {
+			memcpy(&r->oif, RTA_DATA(rta), sizeof(int));
+		}
+	}
+}
+
+/* Collect the acks for everything sent so far */
+static int nl_wait(struct nl_sock *nl)
+{
+	char buf[8192];
+
+	while (nl->nr_pending) {
+		struct nlmsghdr *n;
+		int len = recv(nl->fd, buf, sizeof(buf), 0);
+
+		if (len < 0) {
+			if (errno == EINTR)
+				continue;
+			vpn_progress(nl->vpninfo, PRG_ERR,
+				     _("Failed to receive netlink reply: %s\n"),
+				     strerror(errno));
+			return -errno;
+		}
+
+		for (n = (void *)buf; NLMSG_OK(n, len); n = NLMSG_NEXT(n, len)) {
+			struct nlmsgerr *e = NLMSG_DATA(n);
+
+			if (n->nlmsg_type == RTM_NEWROUTE && nl->reply) {
+				nl_parse_route(n, nl->reply);
+				continue;
+			}
+			if (n->nlmsg_type != NLMSG_ERROR)
+				continue;
+
+			nl->nr_pending--;
+			if (nl->reply && e->error) {
+				/* A failed lookup just means there is no route */
+				nl->reply->oif = 0;
+				continue;
+			}
+			/* Whatever we were deleting is gone anyway */
+			if (e->msg.nlmsg_type == RTM_DELROUTE ||
+			    e->msg.nlmsg_type == RTM_DELADDR)
+				continue;
+			switch (e->error) {
+			case 0:
+			case -EEXIST:
+				break;
+			default:
+				if (!nl->errors++)
+					vpn_progress(nl->vpninfo, PRG_ERR,
+						     _("Netlink request failed: %s\n"),
+						     strerror(-e->error));
+			}
+		}
+	}
+	return 0;
+}
+
+static int nl_flush(struct nl_sock *nl)
+{
+	struct sockaddr_nl sa;
+	int ret;
+
+	if (buf_error(nl->buf))
+		return buf_error(nl->buf);
+	if (!nl->buf->pos)
+		return 0;
+
+	memset(&sa, 0, sizeof(sa));
+	sa.nl_family = AF_NETLINK;
+	ret = sendto(nl->fd, nl->buf->data, nl->buf->pos, 0,
+		     (struct sockaddr *)&sa, sizeof(sa));
+	nl->buf->pos = 0;
+	if (ret < 0) {
+		ret = -errno;
+		vpn_progress(nl->vpninfo, PRG_ERR,
+			     _("Failed to send netlink request: %s\n"),
+			     strerror(-ret));
+		nl->nr_pending = 0;
+		return ret;
+	}
+	return nl_wait(nl);
+}
+
+static int nl_queue(struct nl_sock *nl, struct nl_req *req)
+{
+	req->n.nlmsg_flags |= NLM_F_REQUEST | NLM_F_ACK;
+	req->n.nlmsg_seq = ++nl->seq;
+	buf_append_bytes(nl->buf, req, NLMSG_ALIGN(req->n.nlmsg_len));
+	if (++nl->nr_pending >= NL_BATCH)
+		return nl_flush(nl);
+	return 0;
+}
+
+static int nl_open(struct openconnect_info *vpninfo, struct nl_sock *nl)
+{
+	memset(nl, 0, sizeof(*nl));
+	nl->vpninfo = vpninfo;
+	nl->fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE);
+	if (nl->fd < 0) {
+		int err = -errno;
+		vpn_progress(vpninfo, PRG_ERR,
+			     _("Failed to open netlink socket: %s\n"),
+			     strerror(-err));
+		return err;
+	}
+	nl->buf = buf_alloc();
+	return 0;
+}
+
+static void nl_close(struct nl_sock *nl)
+{
+	close(nl->fd);
+	buf_free(nl->buf);
+}
+
+static int nl_link(struct nl_sock *nl, int ifindex, int mtu)
+{
+	struct nl_req req;
+
+	memset(&req, 0, sizeof(req));
+	req.n.nlmsg_len = NLMSG_LENGTH(sizeof(req.i));
+	req.n.nlmsg_type = RTM_NEWLINK;
+	req.i.ifi_family = AF_UNSPEC;
+	req.i.ifi_index = ifindex;
+	req.i.ifi_flags = IFF_UP;
+	req.i.ifi_change = IFF_UP;
+	if (mtu > 0)
+		nl_addattr(&req, IFLA_MTU, &mtu, sizeof(mtu));
+	return nl_queue(nl, &req);
+}
+
+static int nl_set_addr(struct nl_sock *nl, int type, int ifindex, struct nl_route *a)
+{
+	struct nl_req req;
+
+	/* If the device has gone, so have its addresses */
+	if (!ifindex)
+		return 0;
+
+	memset(&req, 0, sizeof(req));
+	req.n.nlmsg_len = NLMSG_LENGTH(sizeof(req.a));
+	req.n.nlmsg_type = type;
+	if (type == RTM_NEWADDR)
+		req.n.nlmsg_flags = NLM_F_CREATE | NLM_F_REPLACE;
+	req.a.ifa_family = a->family;
+	req.a.ifa_prefixlen = a->plen;
+	req.a.ifa_index = ifindex;
+	nl_addattr(&req, IFA_LOCAL, a->dst, addr_len(a->family));
+	nl_addattr(&req, IFA_ADDRESS, a->dst, addr_len(a->family));
+	return nl_queue(nl, &req);
+}
+
+static int nl_set_route(struct nl_sock *nl, int type, int ifindex, struct nl_route *r)
+{
+	struct nl_req req;
+	int oif = r->oif ? : ifindex;
+
+	/* ...and its routes */
+	if (!oif)
+		return 0;
+
+	memset(&req, 0, sizeof(req));
+	req.n.nlmsg_len = NLMSG_LENGTH(sizeof(req.r));
+	req.n.nlmsg_type = type;
+	if (type == RTM_NEWROUTE)
+		req.n.nlmsg_flags = NLM_F_CREATE | NLM_F_REPLACE;
+	req.r.rtm_family = r->family;
+	req.r.rtm_dst_len = r->plen;
+	req.r.rtm_table = RT_TABLE_MAIN;
+	req.r.rtm_protocol = RTPROT_STATIC;
+	req.r.rtm_scope = r->has_gw ? RT_SCOPE_UNIVERSE : RT_SCOPE_LINK;
+	req.r.rtm_type = RTN_UNICAST;
+	nl_addattr(&req, RTA_DST, r->dst, addr_len(r->family));
+	nl_addattr(&req, RTA_OIF, &oif, sizeof(oif));
+	if (r->has_gw)
+		nl_addattr(&req, RTA_GATEWAY, r->gw, addr_len(r->family));
+	return nl_queue(nl, &req);
+}
+
+/* Find out how we would reach @dst without the VPN. The lookup is done
+ * synchronously, before any of our own routes are added. */
+static int nl_lookup(struct nl_sock *nl, int tun_idx, struct nl_route *r)
+{
+	struct nl_route res;
+	struct nl_req req;
+	int ret;
+
+	memset(&req, 0, sizeof(req));
+	req.n.nlmsg_len = NLMSG_LENGTH(sizeof(req.r));
+	req.n.nlmsg_type = RTM_GETROUTE;
+	req.r.rtm_family = r->family;
+	req.r.rtm_dst_len = addr_len(r->family) * 8;
+	nl_addattr(&req, RTA_DST, r->dst, addr_len(r->family));
+
+	memset(&res, 0, sizeof(res));
+	nl->reply = &res;
+	ret = nl_queue(nl, &req);
+	if (!ret)
+		ret = nl_flush(nl);
+	nl->reply = NULL;
+	if (ret)
+		return ret;
+
+	/* On reconnect the answer may be our own route */
+	if (!res.oif || res.oif == tun_idx)
+		return -ENETUNREACH;
+
+	r->oif = res.oif;
+	r->has_gw = res.has_gw;
+	memcpy(r->gw, res.gw, sizeof(r->gw));
+	return 0;
+}
+
+static int parse_prefix(const char *str, struct nl_route *r)
+{
+	struct oc_cidr c;
+
+	memset(r, 0, sizeof(*r));
+	if (parse_cidr(str, &c))
+		return -EINVAL;
+	r->family = c.family;
+	r->plen = c.plen;
+	memcpy(r->dst, c.addr, sizeof(r->dst));
+	return 0;
+}
+
+/* The kernel won't accept host bits in a route */
+static int parse_route(const char *str, struct nl_route *r)
+{
+	int ret = parse_prefix(str, r);
+	int bit;
+
+	if (ret)
+		return ret;
+	for (bit = r->plen; bit < addr_len(r->family) * 8; bit++)
+		r->dst[bit / 8] &= ~(0x80 >> (bit % 8));
+	return 0;
+}
+
+static int add_entry(struct nl_route **list, int *nr, struct nl_route *r)
+{
+	struct nl_route *new;
+
+	if (!(*nr & 63)) {
+		new = realloc(*list, (*nr + 64) * sizeof(*new));
+		if (!new)
+			return -ENOMEM;
+		*list = new;
+	}
+	(*list)[(*nr)++] = *r;
+	return 0;
+}
+
+static int cmp_route(const void *_a, const void *_b)
+{
+	const struct nl_route *a = _a, *b = _b;
+	int ret;
+
+	if (a->family != b->family)
+		return a->family - b->family;
+	if (a->plen != b->plen)
+		return a->plen - b->plen;
+	ret = memcmp(a->dst, b->dst, sizeof(a->dst));
+	if (ret)
+		return ret;
+	if (a->oif != b->oif)
+		return a->oif < b->oif ? -1 : 1;
+	if (a->has_gw != b->has_gw)
+		return a->has_gw - b->has_gw;
+	return memcmp(a->gw, b->gw, sizeof(a->gw));
+}
+
+static void free_config(struct nl_config *c)
+{
+	if (c) {
+		free(c->addrs);
+		free(c->routes);
+		free(c);
+	}
+}
+
+/* Work out what vpnc-script would have done with vpninfo->ip_info */
+static struct nl_config *build_config(struct openconnect_info *vpninfo,
+				      struct nl_sock *nl, int ifindex)
+{
+	static const char * const defaults[] = {
+		"0.0.0.0/1", "128.0.0.0/1", "::/1", "8000::/1"
+	};
+	struct oc_ip_info *ip = &vpninfo->ip_info;
+	struct oc_split_include *inc, *incs, *excs;
+	struct nl_config *c;
+	struct nl_route r;
+	int have_v4 = 0, have_v6 = 0, v4_incs = 0, v6_incs = 0;
+	int i, ret = 0;
+	const char *v6;
+
+	if (aggregate_split_routes(vpninfo, ip->split_includes,
+				   ip->split_excludes, &incs, &excs))
+		return NULL;
+
+	c = calloc(1, sizeof(*c));
+	if (!c) {
+		free_split_list(incs);
+		free_split_list(excs);
+		return NULL;
+	}
+	c->mtu = ip->mtu;
+
+	if (ip->addr && !parse_prefix(ip->addr, &r) && r.family == AF_INET) {
+		have_v4 = 1;
+		ret |= add_entry(&c->addrs, &c->nr_addrs, &r);
+		if (ip->netmask) {
+			char str[64];
+
+			snprintf(str, sizeof(str), "%s/%s", ip->addr, ip->netmask);
+			if (!parse_route(str, &r) && r.plen < 32)
+				ret |= add_entry(&c->routes, &c->nr_routes, &r);
+		}
+	}
+	/* netmask6 is "addr/len", which is what vpnc-script adds */
+	if (ip->netmask6 && strchr(ip->netmask6, '/'))
+		v6 = ip->netmask6;
+	else
+		v6 = ip->addr6;
+	if (v6 && !parse_prefix(v6, &r) && r.family == AF_INET6) {
+		have_v6 = 1;
+		ret |= add_entry(&c->addrs, &c->nr_addrs, &r);
+	}
+
+	for (inc = incs; inc; inc = inc->next) {
+		if (parse_route(inc->route, &r))
+			continue;
+		if (r.family == AF_INET)
+			v4_incs++;
+		else
+			v6_incs++;
+		ret |= add_entry(&c->routes, &c->nr_routes, &r);
+	}
+	for (i = 0; i < 4; i++) {
+		if ((i < 2 && have_v4 && !v4_incs) ||
+		    (i >= 2 && have_v6 && !v6_incs)) {
+			parse_route(defaults[i], &r);
+			ret |= add_entry(&c->routes, &c->nr_routes, &r);
+		}
+	}
+
+	/* Everything from here on goes outside the tunnel, including the
+	 * VPN server itself whenever we take over the default route. */
+	i = c->nr_routes;
+	for (inc = excs; inc; inc = inc->next) {
+		if (!parse_route(inc->route, &r))
+			ret |= add_entry(&c->routes, &c->nr_routes, &r);
+	}
+	free_split_list(incs);
+	free_split_list(excs);
+	if (vpninfo->peer_addr && ((have_v4 && !v4_incs) || (have_v6 && !v6_incs) ||
+				   c->nr_routes > i)) {
+		memset(&r, 0, sizeof(r));
+		r.family = vpninfo->peer_addr->sa_family;
+		if (r.family == AF_INET) {
+			memcpy(r.dst, &((struct sockaddr_in *)vpninfo->peer_addr)->sin_addr, 4);
+			r.plen = 32;
+		} else if (r.family == AF_INET6) {
+			memcpy(r.dst, &((struct sockaddr_in6 *)vpninfo->peer_addr)->sin6_addr, 16);
+			r.plen = 128;
+		}
+		if (r.plen)
+			ret |= add_entry(&c->routes, &c->nr_routes, &r);
+	}
+	while (!ret && i < c->nr_routes) {
+		if (nl_lookup(nl, ifindex, &c->routes[i])) {
+			char str[INET6_ADDRSTRLEN];
+
+			inet_ntop(c->routes[i].family, c->routes[i].dst, str, sizeof(str));
+			vpn_progress(vpninfo, PRG_ERR,
+				     _("No route to %s/%d outside the VPN\n"),
+				     str, c->routes[i].plen);
+			c->routes[i] = c->routes[--c->nr_routes];
+		} else
+			i++;
+	}
+
+	if (ret) {
+		free_config(c);
+		return NULL;
+	}
+	if (c->nr_addrs)
+		qsort(c->addrs, c->nr_addrs, sizeof(*c->addrs), cmp_route);
+	if (c->nr_routes)
+		qsort(c->routes, c->nr_routes, sizeof(*c->routes), cmp_route);
+	return c;
+}
+
+typedef int (*nl_entry_fn)(struct nl_sock *nl, int type, int ifindex,
+			   struct nl_route *r);
+
+/* Both lists are sorted; remove what's only in @old, then add what's
+ * only in @new, or everything in @new if @resync is set. */
+static int apply_diff(struct nl_sock *nl, nl_entry_fn fn, int del, int add,
+		      int ifindex, struct nl_route *old, int nr_old,
+		      struct nl_route *new, int nr_new, int resync, int *changes)
+{
+	int i = 0, j = 0, ret = 0;
+
+	while (!ret && i < nr_old) {
+		int cmp = j < nr_new ? cmp_route(&old[i], &new[j]) : -1;
+
+		if (cmp < 0) {
+			ret = fn(nl, del, ifindex, &old[i++]);
+			(*changes)++;
+		} else {
+			if (!cmp)
+				i++;
+			j++;
+		}
+	}
+	for (i = j = 0; !ret && j < nr_new; ) {
+		int cmp = i < nr_old ? cmp_route(&old[i], &new[j]) : 1;
+
+		if (cmp < 0) {
+			i++;
+			continue;
+		}
+		if (cmp > 0 || resync) {
+			ret = fn(nl, add, ifindex, &new[j]);
+			(*changes)++;
+		}
+		if (!cmp)
+			i++;
+		j++;
+	}
+	return ret;
+}
+
+int netlink_config_tun(struct openconnect_info *vpninfo, const char *reason)
+{
+	struct nl_config *old = vpninfo->nl_config, *new = NULL;
+	struct nl_sock nl;
+	int ifindex, ret = 0, resync = 0, changes = 0;
+
+	if (strcmp(reason, "connect") && strcmp(reason, "reconnect") &&
+	    strcmp(reason, "disconnect"))
+		return 0;
+
+	if (!vpninfo->ifname) {
+		if (strcmp(reason, "disconnect")) {
+			vpn_progress(vpninfo, PRG_ERR,
+				     _("No interface name for netlink configuration\n"));
+			return -EINVAL;
+		}
+		/* Still remove whatever we added before */
+		ifindex = 0;
+	} else
+		ifindex = if_nametoindex(vpninfo->ifname);
+	if (!ifindex && strcmp(reason, "disconnect")) {
+		vpn_progress(vpninfo, PRG_ERR,
+			     _("Failed to find interface %s\n"), vpninfo->ifname);
+		return -ENODEV;
+	}
+
+	if (nl_open(vpninfo, &nl))
+		return -EIO;
+
+	if (strcmp(reason, "disconnect")) {
+		new = build_config(vpninfo, &nl, ifindex);
+		if (!new) {
+			nl_close(&nl);
+			return -ENOMEM;
+		}
+		/* The kernel drops IPv6 configuration from a device whose
+		 * MTU falls below 1280, so put everything back if it changed. */
+		if (!old || old->mtu != new->mtu) {
+			ret = nl_link(&nl, ifindex, new->mtu);
+			resync = 1;
+		}
+	}
+
+	/* Addresses before routes, since routes need the link up */
+	if (!ret)
+		ret = apply_diff(&nl, nl_set_addr, RTM_DELADDR, RTM_NEWADDR, ifindex,
+				 old ? old->addrs : NULL, old ? old->nr_addrs : 0,
+				 new ? new->addrs : NULL, new ? new->nr_addrs : 0,
+				 resync, &changes);
+	if (!ret)
+		ret = apply_diff(&nl, nl_set_route, RTM_DELROUTE, RTM_NEWROUTE, ifindex,
+				 old ? old->routes : NULL, old ? old->nr_routes : 0,
+				 new ? new->routes : NULL, new ? new->nr_routes : 0,
+				 resync, &changes);
+	if (!ret)
+		ret = nl_flush(&nl);
+	if (!ret && nl.errors)
+		ret = -EIO;
+
+	vpn_progress(vpninfo, PRG_DEBUG,
+		     _("Applied %d netlink changes for %s (%d failed)\n"),
+		     changes, reason, nl.errors);
+
+	nl_close(&nl);
+	free_config(old);
+	vpninfo->nl_config = new;
+	return ret;
+}
+
+void netlink_free_config(struct openconnect_info *vpninfo)
+{
+	free_config(vpninfo->nl_config);
+	vpninfo->nl_config = NULL;
+}
+
+#endif /* HAVE_LINUX_RTNETLINK_H */
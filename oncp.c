@@ -824,6 +824,10 @@ int oncp_connect(struct openconnect_info *vpninfo)
 	if (ret)
 		openconnect_close_https(vpninfo, 0);
 	else {
+		/* oNCP is a byte stream with its own framing, so we can let
+		 * the kernel handle both directions. */
+		if (vpninfo->ktls)
+			ssl_ktls_offload(vpninfo, 1);
 		monitor_fd_new(vpninfo, ssl);
 		monitor_read_fd(vpninfo, ssl);
 		monitor_except_fd(vpninfo, ssl);
@@ -928,7 +932,7 @@ int oncp_mainloop(struct openconnect_info *vpninfo, int *timeout)
 	int ret;
 	int work_done = 0;
 
-	if (vpninfo->ssl_fd == -1)
+	if (vpninfo->ssl_fd == -1 || vpninfo->ssl_reconnect_due)
 		goto do_reconnect;
 
 	/* FIXME: The poll() handling here is fairly simplistic. Actually,
@@ -946,7 +950,7 @@ int oncp_mainloop(struct openconnect_info *vpninfo, int *timeout)
 
 		len = receive_mtu + vpninfo->pkt_trailer;
 		if (!vpninfo->cstp_pkt) {
-			vpninfo->cstp_pkt = malloc(sizeof(struct pkt) + len);
+			vpninfo->cstp_pkt = alloc_pkt(vpninfo, len);
 			if (!vpninfo->cstp_pkt) {
 				vpn_progress(vpninfo, PRG_ERR, _("Allocation failed\n"));
 				break;
@@ -1051,7 +1055,7 @@ int oncp_mainloop(struct openconnect_info *vpninfo, int *timeout)
 			}
 
 			/* OK, we have a whole packet, and we have stuff after it */
-			queue_new_packet(&vpninfo->incoming_queue, vpninfo->cstp_pkt->data, iplen);
+			queue_new_packet(vpninfo, &vpninfo->incoming_queue, vpninfo->cstp_pkt->data, iplen);
 			kmplen -= iplen;
 			if (kmplen) {
 				/* Still data packets to come in this KMP300 */
@@ -1117,18 +1121,20 @@ int oncp_mainloop(struct openconnect_info *vpninfo, int *timeout)
 					 vpninfo->current_ssl_pkt->len + 22);
 		if (ret < 0) {
 		do_reconnect:
-			/* XXX: Do we have to do this or can we leave it open?
-			 * Perhaps we could even reconnect asynchronously while
-			 * the ESP is still running? */
-#ifdef HAVE_ESP
-			esp_shutdown(vpninfo);
-#endif
-			ret = ssl_reconnect(vpninfo);
+			/* ESP is left running while we reconnect. Only once
+			 * the new connection has negotiated fresh keys do we
+			 * close it and probe again with them. */
+			ret = ssl_reconnect(vpninfo, timeout);
+			if (ret == -EAGAIN)
+				return work_done;
 			if (ret) {
 				vpn_progress(vpninfo, PRG_ERR, _("Reconnect failed\n"));
 				vpninfo->quit_reason = "oNCP reconnect failed";
 				return ret;
 			}
+#ifdef HAVE_ESP
+			esp_close(vpninfo);
+#endif
 			vpninfo->dtls_need_reconnect = 1;
 			return 1;
 		} else if (!ret) {
@@ -1232,6 +1238,7 @@ int oncp_mainloop(struct openconnect_info *vpninfo, int *timeout)
 
 	case KA_DPD:
 		vpn_progress(vpninfo, PRG_DEBUG, _("Send CSTP DPD\n"));
+		prefetch_https_address(vpninfo);
 
 		vpninfo->current_ssl_pkt = (struct pkt *)&dpd_pkt;
 		goto handle_outgoing;
@@ -1257,7 +1264,7 @@ int oncp_mainloop(struct openconnect_info *vpninfo, int *timeout)
 
 	/* Service outgoing packet queue, if no DTLS */
 	while (vpninfo->dtls_state != DTLS_CONNECTED &&
-	       (vpninfo->current_ssl_pkt = dequeue_packet(&vpninfo->outgoing_queue))) {
+	       (vpninfo->current_ssl_pkt = dequeue_outgoing(vpninfo))) {
 		struct pkt *this = vpninfo->current_ssl_pkt;
 
 		/* Little-endian overall record length */
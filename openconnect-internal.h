@@ -128,6 +128,8 @@
 /****************************************************************************/
 
 struct pkt {
+	uint64_t queued; /* Time of queue_packet() in µs, for CoDel */
+	int alloc_len; /* Size of the allocation, if from alloc_pkt() */
 	int len;
 	struct pkt *next;
 	union {
@@ -175,6 +177,8 @@ struct pkt {
 #define COMPR_LZS	(1<<1)
 #define COMPR_LZ4	(1<<2)
 #define COMPR_MAX	COMPR_LZ4
+/* Not negotiated over CSTP; only for Juniper ESP packets */
+#define COMPR_LZO	(1<<3)
 
 #ifdef HAVE_LZ4
 #define COMPR_STATELESS	(COMPR_LZS | COMPR_LZ4)
@@ -183,6 +187,12 @@ struct pkt {
 #endif
 #define COMPR_ALL	(COMPR_STATELESS | COMPR_DEFLATE)
 
+/* One maximum-sized TLS record */
+#define SSL_RBUF_SIZE	16384
+
+#define KTLS_TX		(1<<0)	/* Kernel encrypts outgoing TLS records */
+#define KTLS_RX		(1<<1)	/* Kernel decrypts incoming TLS records */
+
 #define DTLS_APP_ID_EXT 48018
 
 struct keepalive_info {
@@ -296,14 +306,109 @@ struct vpn_proto {
 
 	/* Catch probe packet confirming the (UDP) session */
 	int (*udp_catch_probe)(struct openconnect_info *vpninfo, struct pkt *p);
+
+	/* Send a probe padded to 'size' bytes, for path MTU discovery. The
+	   reply must be the same size, and be caught by udp_catch_probe */
+	int (*udp_send_mtu_probe)(struct openconnect_info *vpninfo, int size);
+};
+
+/* CoDel (RFC8289) state for a packet queue; see codel_dequeue() */
+struct codel {
+	uint64_t first_above_time;
+	uint64_t drop_next;
+	uint32_t count;
+	uint32_t lastcount;
+	int dropping;
 };
 
 struct pkt_q {
 	struct pkt *head;
 	struct pkt **tail;
 	int count;
+	int aqm;	/* Stamp packets on the way in, for CoDel */
+	struct codel codel;
+};
+
+/* Flow-fair queuing (RFC8290) of the outgoing packets; see mainloop.c */
+#define FQ_FLOWS 64
+
+struct flow_q {
+	struct pkt_q q;
+	struct flow_q *next;
+	int deficit;
+	int active;
+};
+
+struct pkt_fq {
+	struct pkt_q prio; /* DSCP EF/CS6 and requeued packets go first */
+	struct flow_q flows[FQ_FLOWS];
+	struct flow_q *new_flows, **new_tail;
+	struct flow_q *old_flows, **old_tail;
+	int count;
+};
+
+/* Per-flow record of whether compression is worthwhile; see compr.c */
+#define COMPR_FLOWS 256
+
+struct compr_flow {
+	uint32_t hash;
+	uint16_t skip;
+	uint8_t fails;
+	uint8_t backoff;
 };
 
+/* Compression engines, one for each COMPR_xxx bit; see compr.c */
+#define COMPR_ENGINES	4
+
+struct compr_stats {
+	uint64_t compr_pkts;
+	uint64_t compr_in_bytes;
+	uint64_t compr_out_bytes;
+	uint64_t uncompr_pkts;		/* Didn't shrink, or flow bypassed */
+	uint64_t decompr_pkts;
+	uint64_t decompr_in_bytes;
+	uint64_t decompr_out_bytes;
+	uint64_t errors;
+};
+
+struct compr_ctx;
+
+struct compr_engine {
+	const char *name;
+	int type;
+	/* Set up the per-session state for packets of up to 'mtu' bytes,
+	 * allocating it if necessary. Returns the largest compressed
+	 * packet it may produce, or a negative error. */
+	int (*init)(struct openconnect_info *vpninfo, struct compr_ctx *ctx, int mtu);
+	/* Discard any stream state, when the session is reconnected. */
+	void (*reset)(struct compr_ctx *ctx);
+	/* Release everything that init allocated */
+	void (*free)(struct compr_ctx *ctx);
+	/* These return the output length, or a negative error. For
+	 * compression, -EFBIG means the packet just didn't shrink. */
+	int (*compress)(struct openconnect_info *vpninfo, struct compr_ctx *ctx,
+			unsigned char *dst, int dstlen,
+			const unsigned char *src, int srclen);
+	/* NULL if the transport decompresses for itself */
+	int (*decompress)(struct openconnect_info *vpninfo, struct compr_ctx *ctx,
+			  unsigned char *dst, int dstlen,
+			  const unsigned char *src, int srclen);
+};
+
+struct compr_ctx {
+	const struct compr_engine *engine;	/* NULL until initialised */
+	void *state;
+	struct compr_stats stats;
+};
+
+static inline uint64_t pkt_time_us(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
 static inline struct pkt *dequeue_packet(struct pkt_q *q)
 {
 	struct pkt *ret = q->head;
@@ -328,6 +433,8 @@ static inline int queue_packet(struct pkt_q *q, struct pkt *p)
 {
 	*(q->tail) = p;
 	p->next = NULL;
+	if (q->aqm)
+		p->queued = pkt_time_us();
 	q->tail = &p->next;
 	return ++q->count;
 }
@@ -337,6 +444,13 @@ static inline void init_pkt_queue(struct pkt_q *q)
 	q->tail = &q->head;
 }
 
+/* For a queue which will be dequeued through codel_dequeue() */
+static inline void init_aqm_queue(struct pkt_q *q)
+{
+	init_pkt_queue(q);
+	q->aqm = 1;
+}
+
 #define DTLS_OVERHEAD (1 /* packet + header */ + 13 /* DTLS header */ + \
 	 20 /* biggest supported MAC (SHA1) */ +  16 /* biggest supported IV (AES-128) */ + \
 	 16 /* max padding */)
@@ -356,6 +470,45 @@ struct esp {
 	unsigned char hmac_key[0x40]; /* HMAC key */
 };
 
+/* Ciphers timed by openconnect_benchmark_ciphers() */
+enum {
+	OC_BENCH_AES_128_GCM,
+	OC_BENCH_AES_256_GCM,
+	OC_BENCH_CHACHA20_POLY1305,
+	OC_BENCH_AES_128_CBC,
+	OC_BENCH_AES_256_CBC,
+	OC_BENCH_MAX
+};
+
+/* ESP path MTU discovery state; see esp_pmtud() */
+struct esp_pmtud {
+	int max;	/* MTU at setup, which we never go above */
+	int lo;		/* Largest probe size confirmed, or 0 */
+	int hi;		/* Smallest size known not to fit, or 0 when idle */
+	int probe;	/* Size of the probe in flight, or 0 */
+	int tries;
+	time_t due;	/* Next probe, or time to give up on this one */
+};
+
+/* Certificate trust loaded once for all the sessions in a group which
+   have the same CA file and no client certificate. The handle is a
+   gnutls_certificate_credentials_t or an X509_STORE. */
+struct oc_shared_trust {
+	struct oc_shared_trust *next;
+	char *cafile;
+	int no_system_trust;
+	void *handle;
+};
+
+struct oc_session_group {
+	struct oc_shared_trust *trust;
+	/* X-DTLS-CipherSuite list, and the TLS priority it came from */
+	char *dtls_ciphers_prio;
+	char *dtls_ciphers;
+	int nr_sessions;
+	int freed; /* openconnect_session_group_free() called with sessions left */
+};
+
 struct openconnect_info {
 	const struct vpn_proto *proto;
 
@@ -377,6 +530,10 @@ struct openconnect_info {
 	int old_esp_maxseq;
 	struct esp esp_in[2];
 	struct esp esp_out;
+	/* Encrypted ESP packets which the socket wasn't ready to take. Their
+	   pkt->len is the length of the encrypted packet, not the payload. */
+	struct pkt_q esp_backlog;
+	struct esp_pmtud esp_pmtud;
 	int enc_key_len;
 	int hmac_key_len;
 #ifdef _WIN32
@@ -497,6 +654,12 @@ struct openconnect_info {
 	struct oc_vpn_option *csd_env;
 
 	unsigned pfs;
+	/* Valid once ciphers_benchmarked is set; ends with a NULL name */
+	struct oc_cipher_speed cipher_speeds[OC_BENCH_MAX + 1];
+	int ciphers_benchmarked;
+	/* Server for which https_session is valid */
+	char *https_session_host;
+	int https_session_port;
 #if defined(OPENCONNECT_OPENSSL)
 #ifdef HAVE_LIBP11
 	PKCS11_CTX *pkcs11_ctx;
@@ -509,9 +672,14 @@ struct openconnect_info {
 	X509 *cert_x509;
 	SSL_CTX *https_ctx;
 	SSL *https_ssl;
+	SSL_SESSION *https_session; /* Offered for resumption on reconnect */
+	SSL_SESSION *dtls_session; /* Resumed on DTLS reconnect (PSK-NEGOTIATE) */
 #elif defined(OPENCONNECT_GNUTLS)
 	gnutls_session_t https_sess;
+	gnutls_datum_t https_session; /* Offered for resumption on reconnect */
+	gnutls_datum_t dtls_session; /* Resumed on DTLS reconnect (PSK-NEGOTIATE) */
 	gnutls_certificate_credentials_t https_cred;
+	int https_cred_shared; /* Belongs to the session group */
 	gnutls_psk_client_credentials_t psk_cred;
 	char local_cert_md5[MD5_SIZE * 2 + 1]; /* For CSD */
 	char gnutls_prio[256];
@@ -539,14 +707,16 @@ struct openconnect_info {
 	struct pkt *tun_pkt;
 	int pkt_trailer; /* How many bytes after payload for encryption (ESP HMAC) */
 
-	z_stream inflate_strm;
-	uint32_t inflate_adler32;
-	z_stream deflate_strm;
-	uint32_t deflate_adler32;
+	struct compr_ctx compr_ctx[COMPR_ENGINES];
 
 	int disable_ipv6;
 	int reconnect_timeout;
 	int reconnect_interval;
+	/* Non-zero while ssl_reconnect() is in progress */
+	time_t ssl_reconnect_due;
+	int ssl_reconnect_left;
+	int ssl_reconnect_cur_interval;
+	int reconnect_fd; /* Its new connection, while the old one stays open */
 	int dtls_attempt_period;
 	time_t new_dtls_started;
 #if defined(OPENCONNECT_OPENSSL)
@@ -581,6 +751,9 @@ struct openconnect_info {
 #endif
 	int use_tun_script;
 	int script_tun;
+	int netlink_config; /* Configure the tun device ourselves, not vpnc-script */
+	struct nl_config *nl_config; /* What netlink_config_tun() last applied */
+	struct tun_ring *tun_ring; /* Shared-memory alternative to script_tun socket */
 	char *ifname;
 	char *cmd_ifname;
 
@@ -590,14 +763,14 @@ struct openconnect_info {
 	struct oc_ip_info ip_info;
 	int cstp_basemtu; /* Returned by server */
 
+	/* What we're waiting for on each fd; MONITOR_* bits */
 #ifdef _WIN32
 	long dtls_monitored, ssl_monitored, cmd_monitored, tun_monitored;
-	HANDLE dtls_event, ssl_event, cmd_event;
+	long reconnect_monitored;
+	HANDLE dtls_event, ssl_event, cmd_event, reconnect_event;
 #else
-	int _select_nfds;
-	fd_set _select_rfds;
-	fd_set _select_wfds;
-	fd_set _select_efds;
+	int dtls_monitored, ssl_monitored, cmd_monitored, tun_monitored;
+	int reconnect_monitored;
 #endif
 
 #ifdef __sun__
@@ -614,6 +787,12 @@ struct openconnect_info {
 	int ssl_fd;
 	int dtls_fd;
 
+	int ktls;
+	int ssl_ktls; /* KTLS_TX / KTLS_RX when offloaded to the kernel */
+	/* Rest of a record the kernel took only part of */
+	char *ssl_ktls_tail;
+	int ssl_ktls_tail_len;
+
 	int dtls_tos_current;
 	int dtls_pass_tos;
 	int dtls_tos_proto, dtls_tos_optname;
@@ -625,9 +804,20 @@ struct openconnect_info {
 	char cancel_type;
 
 	struct pkt_q incoming_queue;
-	struct pkt_q outgoing_queue;
+	struct pkt_fq outgoing_queue;
 	int max_qlen;
+	/* Received packets, once written to the tun device, are kept for
+	 * reuse by alloc_pkt() */
+	struct pkt *free_pkts;
+	int nr_free_pkts;
 	struct oc_stats stats;
+	int dscp_priority;
+	/* Socket buffer auto-tuning; see tune_socket_buffers() */
+	struct oc_socket_stats sock_stats;
+	struct timeval udp_rtt_probe;
+	time_t sockbuf_last_tune;
+	uint64_t sockbuf_last_tx, sockbuf_last_rx;
+	int udp_sockbuf;
 	openconnect_stats_vfn stats_handler;
 
 	socklen_t peer_addrlen;
@@ -636,11 +826,14 @@ struct openconnect_info {
 
 	int dtls_local_port;
 
+	struct compr_flow compr_flows[COMPR_FLOWS];
 	int req_compr; /* What we requested */
+	oc_compression_level_t compr_level;
 	int cstp_compr; /* Accepted for CSTP */
 	int dtls_compr; /* Accepted for DTLS */
 
 	int is_dyndns; /* Attempt to redo DNS lookup on each CSTP reconnect */
+	struct dns_prefetch *dns_prefetch;
 	char *useragent;
 
 	const char *quit_reason;
@@ -655,39 +848,46 @@ struct openconnect_info {
 	openconnect_getaddrinfo_vfn getaddrinfo_override;
 	openconnect_setup_tun_vfn setup_tun;
 	openconnect_reconnected_vfn reconnected;
+	openconnect_packet_sink_vfn pkt_sink;
+	openconnect_packet_source_vfn pkt_source;
+	int pkt_pipe[2]; /* tun_fd, written by openconnect_packets_ready() */
+	int pkt_kicked; /* Set by openconnect_packets_ready() */
+	int pkt_source_more; /* Source hasn't yet said it's empty */
+	int pkt_sink_full; /* Sink has refused a packet */
+	struct oc_session_group *session_group; /* Shares TLS setup with others */
 
 	int (*ssl_read)(struct openconnect_info *vpninfo, char *buf, size_t len);
+	/* Bytes read from the HTTPS session but not yet consumed */
+	char *ssl_rbuf;
+	int ssl_rbuf_pos, ssl_rbuf_len;
 	int (*ssl_gets)(struct openconnect_info *vpninfo, char *buf, size_t len);
 	int (*ssl_write)(struct openconnect_info *vpninfo, char *buf, size_t len);
 };
 
 #ifdef _WIN32
-#define monitor_read_fd(_v, _n) _v->_n##_monitored |= FD_READ
-#define monitor_write_fd(_v, _n) _v->_n##_monitored |= FD_WRITE
-#define monitor_except_fd(_v, _n) _v->_n##_monitored |= FD_CLOSE
-#define unmonitor_read_fd(_v, _n) _v->_n##_monitored &= ~FD_READ
-#define unmonitor_write_fd(_v, _n) _v->_n##_monitored &= ~FD_WRITE
-#define unmonitor_except_fd(_v, _n) _v->_n##_monitored &= ~FD_CLOSE
+#define MONITOR_READ FD_READ
+#define MONITOR_WRITE FD_WRITE
+#define MONITOR_EXCEPT FD_CLOSE
 
 #define monitor_fd_new(_v, _n) do { if (!_v->_n##_event) _v->_n##_event = CreateEvent(NULL, FALSE, FALSE, NULL); } while (0)
-#define read_fd_monitored(_v, _n) (_v->_n##_monitored & FD_READ)
-
 #else
-#define monitor_read_fd(_v, _n) FD_SET(_v-> _n##_fd, &vpninfo->_select_rfds)
-#define unmonitor_read_fd(_v, _n) FD_CLR(_v-> _n##_fd, &vpninfo->_select_rfds)
-#define monitor_write_fd(_v, _n) FD_SET(_v-> _n##_fd, &vpninfo->_select_wfds)
-#define unmonitor_write_fd(_v, _n) FD_CLR(_v-> _n##_fd, &vpninfo->_select_wfds)
-#define monitor_except_fd(_v, _n) FD_SET(_v-> _n##_fd, &vpninfo->_select_efds)
-#define unmonitor_except_fd(_v, _n) FD_CLR(_v-> _n##_fd, &vpninfo->_select_efds)
-
-#define monitor_fd_new(_v, _n) do { \
-		if (_v->_select_nfds <= vpninfo->_n##_fd) \
-			vpninfo->_select_nfds = vpninfo->_n##_fd + 1; \
-	} while (0)
-
-#define read_fd_monitored(_v, _n) FD_ISSET(_v->_n##_fd, &_v->_select_rfds)
+#define MONITOR_READ OC_POLL_READ
+#define MONITOR_WRITE OC_POLL_WRITE
+#define MONITOR_EXCEPT OC_POLL_EXCEPT
+
+/* Nothing to set up; openconnect_get_poll_fds() reads the bits */
+#define monitor_fd_new(_v, _n) do { } while (0)
 #endif
 
+#define monitor_read_fd(_v, _n) do { _v->_n##_monitored |= MONITOR_READ; } while (0)
+#define monitor_write_fd(_v, _n) do { _v->_n##_monitored |= MONITOR_WRITE; } while (0)
+#define monitor_except_fd(_v, _n) do { _v->_n##_monitored |= MONITOR_EXCEPT; } while (0)
+#define unmonitor_read_fd(_v, _n) do { _v->_n##_monitored &= ~MONITOR_READ; } while (0)
+#define unmonitor_write_fd(_v, _n) do { _v->_n##_monitored &= ~MONITOR_WRITE; } while (0)
+#define unmonitor_except_fd(_v, _n) do { _v->_n##_monitored &= ~MONITOR_EXCEPT; } while (0)
+
+#define read_fd_monitored(_v, _n) (_v->_n##_monitored & MONITOR_READ)
+
 /* Key material for DTLS-PSK */
 #define PSK_LABEL "EXPORTER-openconnect-psk"
 #define PSK_LABEL_SIZE sizeof(PSK_LABEL)-1
@@ -830,6 +1030,41 @@ void os_shutdown_tun(struct openconnect_info *vpninfo);
 int os_read_tun(struct openconnect_info *vpninfo, struct pkt *pkt);
 int os_write_tun(struct openconnect_info *vpninfo, struct pkt *pkt);
 intptr_t os_setup_tun(struct openconnect_info *vpninfo);
+int os_set_tun_mtu(struct openconnect_info *vpninfo);
+
+/* tun-ring.c */
+#if defined(HAVE_MEMFD_CREATE) && defined(HAVE_SYS_EVENTFD_H)
+#define HAVE_TUN_RING 1
+int tun_ring_setup(struct openconnect_info *vpninfo);
+void tun_ring_setenv(struct openconnect_info *vpninfo);
+void tun_ring_forked(struct openconnect_info *vpninfo, int sock_fd);
+int tun_ring_active(struct openconnect_info *vpninfo);
+int tun_ring_activate(struct openconnect_info *vpninfo);
+int tun_ring_read(struct openconnect_info *vpninfo, struct pkt *pkt);
+int tun_ring_write(struct openconnect_info *vpninfo, struct pkt *pkt);
+void tun_ring_free(struct openconnect_info *vpninfo);
+size_t tun_ring_size(struct openconnect_info *vpninfo);
+#endif
+
+/* cidr.c */
+struct oc_cidr {
+	int family;
+	int plen;
+	unsigned char addr[16];
+};
+int parse_cidr(const char *str, struct oc_cidr *c);
+int aggregate_split_routes(struct openconnect_info *vpninfo,
+			   struct oc_split_include *includes,
+			   struct oc_split_include *excludes,
+			   struct oc_split_include **inc_result,
+			   struct oc_split_include **exc_result);
+void free_split_list(struct oc_split_include *list);
+
+/* netlink.c */
+#ifdef HAVE_LINUX_RTNETLINK_H
+int netlink_config_tun(struct openconnect_info *vpninfo, const char *reason);
+void netlink_free_config(struct openconnect_info *vpninfo);
+#endif
 
 /* {gnutls,openssl}-dtls.c */
 int start_dtls_handshake(struct openconnect_info *vpninfo, int dtls_fd);
@@ -854,9 +1089,6 @@ void cstp_common_headers(struct openconnect_info *vpninfo, struct oc_text_buf *b
 int cstp_connect(struct openconnect_info *vpninfo);
 int cstp_mainloop(struct openconnect_info *vpninfo, int *timeout);
 int cstp_bye(struct openconnect_info *vpninfo, const char *reason);
-int decompress_and_queue_packet(struct openconnect_info *vpninfo, int compr_type,
-				unsigned char *buf, int len);
-int compress_packet(struct openconnect_info *vpninfo, int compr_type, struct pkt *this);
 
 /* auth-juniper.c */
 int oncp_obtain_cookie(struct openconnect_info *vpninfo);
@@ -880,19 +1112,40 @@ int gpst_xml_or_error(struct openconnect_info *vpninfo, int result, char *respon
 int gpst_setup(struct openconnect_info *vpninfo);
 int gpst_mainloop(struct openconnect_info *vpninfo, int *timeout);
 
+/* compr.c */
+int compr_init(struct openconnect_info *vpninfo, int compr_types);
+void compr_reset(struct openconnect_info *vpninfo);
+void compr_free(struct openconnect_info *vpninfo);
+int decompress_and_queue_packet(struct openconnect_info *vpninfo, int compr_type,
+				unsigned char *buf, int len);
+int compress_packet(struct openconnect_info *vpninfo, int compr_type, struct pkt *this);
+
 /* lzs.c */
 int lzs_decompress(unsigned char *dst, int dstlen, const unsigned char *src, int srclen);
-int lzs_compress(unsigned char *dst, int dstlen, const unsigned char *src, int srclen);
+struct lzs_state *lzs_alloc_state(void);
+int lzs_compress(struct lzs_state *state, unsigned char *dst, int dstlen,
+		 const unsigned char *src, int srclen, int level);
 
 /* ssl.c */
 unsigned string_is_hostname(const char* str);
 int connect_https_socket(struct openconnect_info *vpninfo);
+void prefetch_https_address(struct openconnect_info *vpninfo);
+void free_dns_prefetch(struct openconnect_info *vpninfo);
+void udp_rtt_start(struct openconnect_info *vpninfo);
+void udp_rtt_sample(struct openconnect_info *vpninfo);
+void tune_socket_buffers(struct openconnect_info *vpninfo);
 int __attribute__ ((format(printf, 4, 5)))
     request_passphrase(struct openconnect_info *vpninfo, const char *label,
 		       char **response, const char *fmt, ...);
 int  __attribute__ ((format (printf, 2, 3)))
     openconnect_SSL_printf(struct openconnect_info *vpninfo, const char *fmt, ...);
 int openconnect_print_err_cb(const char *str, size_t len, void *ptr);
+typedef int (*ssl_read_fn)(struct openconnect_info *vpninfo, char *buf, size_t len);
+int ssl_rbuf_take(struct openconnect_info *vpninfo, void *buf, size_t len);
+int ssl_buffered_read(struct openconnect_info *vpninfo, char *buf, size_t len,
+		      ssl_read_fn raw_read);
+int ssl_buffered_gets(struct openconnect_info *vpninfo, char *buf, size_t len,
+		      ssl_read_fn raw_read);
 #define openconnect_report_ssl_errors(v) ERR_print_errors_cb(openconnect_print_err_cb, (v))
 #if defined(FAKE_ANDROID_KEYSTORE) || defined(__ANDROID__)
 #define ANDROID_KEYSTORE
@@ -911,7 +1164,10 @@ FILE *openconnect_fopen_utf8(struct openconnect_info *vpninfo,
 			     const char *fname, const char *mode);
 int udp_sockaddr(struct openconnect_info *vpninfo, int port);
 int udp_connect(struct openconnect_info *vpninfo);
-int ssl_reconnect(struct openconnect_info *vpninfo);
+int ssl_reconnect(struct openconnect_info *vpninfo, int *timeout);
+void ssl_reconnect_abort(struct openconnect_info *vpninfo);
+int ssl_session_cache_valid(struct openconnect_info *vpninfo);
+void ssl_session_cache_set_host(struct openconnect_info *vpninfo);
 void openconnect_clear_cookies(struct openconnect_info *vpninfo);
 
 /* openssl-pkcs11.c */
@@ -931,12 +1187,14 @@ int esp_send_probes(struct openconnect_info *vpninfo);
 int esp_send_probes_gp(struct openconnect_info *vpninfo);
 int esp_catch_probe(struct openconnect_info *vpninfo, struct pkt *pkt);
 int esp_catch_probe_gp(struct openconnect_info *vpninfo, struct pkt *pkt);
+int esp_send_mtu_probe(struct openconnect_info *vpninfo, int size);
+int esp_send_mtu_probe_gp(struct openconnect_info *vpninfo, int size);
 
 /* {gnutls,openssl}-esp.c */
 int setup_esp_keys(struct openconnect_info *vpninfo, int new_keys);
 void destroy_esp_ciphers(struct esp *esp);
 int decrypt_esp_packet(struct openconnect_info *vpninfo, struct esp *esp, struct pkt *pkt);
-int encrypt_esp_packet(struct openconnect_info *vpninfo, struct pkt *pkt);
+int encrypt_esp_packet(struct openconnect_info *vpninfo, struct pkt *pkt, int next_hdr);
 
 /* {gnutls,openssl}.c */
 int ssl_nonblock_read(struct openconnect_info *vpninfo, void *buf, int maxlen);
@@ -944,6 +1202,7 @@ int ssl_nonblock_write(struct openconnect_info *vpninfo, void *buf, int buflen);
 int openconnect_open_https(struct openconnect_info *vpninfo);
 void openconnect_close_https(struct openconnect_info *vpninfo, int final);
 int cstp_handshake(struct openconnect_info *vpninfo, unsigned init);
+int ssl_ktls_offload(struct openconnect_info *vpninfo, int rx);
 int get_cert_md5_fingerprint(struct openconnect_info *vpninfo, void *cert,
 			     char *buf);
 int openconnect_sha1(unsigned char *result, void *data, int len);
@@ -958,6 +1217,8 @@ int openconnect_hash_yubikey_password(struct openconnect_info *vpninfo,
 				      const char *password, int pwlen,
 				      const void *ident, int id_len);
 int hotp_hmac(struct openconnect_info *vpninfo, const void *challenge);
+int bench_cipher(int cipher, unsigned char *buf, int len, int count);
+void free_shared_trust(void *handle);
 #if defined(OPENCONNECT_OPENSSL)
 #define openconnect_https_connected(_v) ((_v)->https_ssl)
 #elif defined (OPENCONNECT_GNUTLS)
@@ -966,7 +1227,17 @@ int hotp_hmac(struct openconnect_info *vpninfo, const void *challenge);
 
 /* mainloop.c */
 int tun_mainloop(struct openconnect_info *vpninfo, int *timeout);
-int queue_new_packet(struct pkt_q *q, void *buf, int len);
+struct pkt *alloc_pkt(struct openconnect_info *vpninfo, int len);
+void free_pkt(struct openconnect_info *vpninfo, struct pkt *pkt);
+void free_pkt_pool(struct openconnect_info *vpninfo);
+int queue_new_packet(struct openconnect_info *vpninfo, struct pkt_q *q,
+		     void *buf, int len);
+int pkt_get_tos(const struct pkt *p);
+uint32_t pkt_flow_hash(const struct pkt *p);
+void init_outgoing_queue(struct openconnect_info *vpninfo);
+void queue_outgoing(struct openconnect_info *vpninfo, struct pkt *p);
+void requeue_outgoing(struct openconnect_info *vpninfo, struct pkt *p);
+struct pkt *dequeue_outgoing(struct openconnect_info *vpninfo);
 int keepalive_action(struct keepalive_info *ka, int *timeout);
 int ka_stalled_action(struct keepalive_info *ka, int *timeout);
 int ka_check_deadline(int *timeout, time_t now, time_t due);
@@ -1086,6 +1357,8 @@ int digest_authorization(struct openconnect_info *vpninfo, int proxy, struct htt
 void nuke_opt_values(struct oc_form_opt *opt);
 void free_optlist(struct oc_vpn_option *opt);
 int process_auth_form(struct openconnect_info *vpninfo, struct oc_auth_form *form);
+void *session_group_trust(struct openconnect_info *vpninfo);
+int session_group_share_trust(struct openconnect_info *vpninfo, void *handle);
 /* This is private for now since we haven't yet worked out what the API will be */
 void openconnect_set_juniper(struct openconnect_info *vpninfo);
 
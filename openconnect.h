@@ -39,6 +39,20 @@ extern "C" {
  * API version 5.5:
  *  - Add openconnect_get_supported_protocols()
  *  - Add openconnect_free_supported_protocols()
+ *  - Add openconnect_set_ktls()
+ *  - Add openconnect_get_socket_stats()
+ *  - Add openconnect_set_dscp_priority()
+ *  - Add openconnect_set_compression_level()
+ *  - Add openconnect_benchmark_ciphers()
+ *  - Add openconnect_get_cipher_speeds()
+ *  - Add openconnect_set_netlink_config()
+ *  - Add struct oc_ring_header for openconnect_setup_tun_script()
+ *  - Add openconnect_setup_packet_callbacks(), openconnect_packets_ready()
+ *  - Add openconnect_mainloop_start(), openconnect_get_poll_fds()
+ *  - Add openconnect_mainloop_dispatch()
+ *  - Add openconnect_session_group_new(), openconnect_session_group_free()
+ *  - Add openconnect_session_group_add()
+ *  - Add openconnect_get_session_footprint()
  *
  * API version 5.4 (v7.08; 2016-12-13):
  *  - Add openconnect_set_pass_tos()
@@ -301,6 +315,23 @@ struct oc_stats {
 	uint64_t rx_bytes;
 };
 
+/* Smoothed round-trip times in milliseconds (0 if not yet measured)
+   and the socket buffer sizes chosen from them. */
+struct oc_socket_stats {
+	uint32_t tcp_rtt;
+	uint32_t udp_rtt;
+	uint32_t tcp_notsent_lowat;
+	uint32_t udp_sndbuf;
+	uint32_t udp_rcvbuf;
+};
+
+/* Measured by openconnect_benchmark_ciphers(). The CBC modes are timed
+   together with the HMAC-SHA1 which they are used with. */
+struct oc_cipher_speed {
+	const char *name;	/* e.g. "AES-128-GCM"; NULL ends the array */
+	unsigned int mbps;	/* MB/s encrypted, or 0 if not available */
+};
+
 struct oc_cert {
 	int der_len;
 	unsigned char *der_data;
@@ -350,6 +381,12 @@ typedef enum {
 	OC_COMPRESSION_MODE_ALL,
 } oc_compression_mode_t;
 
+typedef enum {
+	OC_COMPRESSION_LEVEL_DEFAULT,
+	OC_COMPRESSION_LEVEL_FAST,
+	OC_COMPRESSION_LEVEL_MAX,
+} oc_compression_level_t;
+
 /* All strings are UTF-8. If operating in a legacy environment where
    nl_langinfo(CODESET) returns anything other than UTF-8, or on Windows,
    the library will take appropriate steps to convert back to the legacy
@@ -423,6 +460,17 @@ int openconnect_passphrase_from_fsid(struct openconnect_info *vpninfo);
 int openconnect_obtain_cookie(struct openconnect_info *vpninfo);
 int openconnect_init_ssl(void);
 
+/* Optionally call this once after openconnect_init_ssl() and before
+ * making any connections. It spends a few milliseconds timing each
+ * cipher we might offer, and subsequent connections of this vpninfo
+ * then prefer the ones which are fastest on this CPU. */
+int openconnect_benchmark_ciphers(struct openconnect_info *vpninfo);
+/* Returns NULL until openconnect_benchmark_ciphers() has succeeded. */
+const struct oc_cipher_speed *openconnect_get_cipher_speeds(struct openconnect_info *vpninfo);
+
+/* Valid for the lifetime of the vpninfo, and updated as the session runs */
+const struct oc_socket_stats *openconnect_get_socket_stats(struct openconnect_info *vpninfo);
+
 /* These are strictly cosmetic. The strings differ depending on
  * whether OpenSSL or GnuTLS is being used. And even depending on the
  * version of GnuTLS. Do *not* attempt to do anything meaningful based
@@ -484,6 +532,10 @@ int openconnect_set_stoken_mode(struct openconnect_info *, int, const char *);
 
 int openconnect_set_compression_mode(struct openconnect_info *,
 				     oc_compression_mode_t);
+/* Trade compression ratio against CPU time. Returns -EINVAL for an
+   unknown level. */
+int openconnect_set_compression_level(struct openconnect_info *,
+				      oc_compression_level_t);
 
 /* The size must be 41 bytes, since that's the size of a 20-byte SHA1
    represented as hex with a trailing NUL. */
@@ -572,6 +624,47 @@ int openconnect_setup_tun_device(struct openconnect_info *vpninfo,
 int openconnect_setup_tun_script(struct openconnect_info *vpninfo,
 				 const char *tun_script);
 
+/* The script is always given a SOCK_DGRAM socket in $VPNFD, over which
+   each datagram is an IP packet. On Linux it is also given a memfd in
+   $VPNFD_RING, and two eventfds: $VPNFD_RING_WAIT which is signalled
+   when there is something for it to do, and $VPNFD_RING_KICK which it
+   signals to wake OpenConnect.
+
+   The memfd holds a struct oc_ring_header, and a struct oc_ring_queue
+   in each direction at the given offsets. To use them, check the magic
+   and version, set state to OC_RING_ACTIVE and then send an empty
+   datagram on $VPNFD. After that, packets only go through the queues.
+
+   Each queue is followed by nr_slots slots of slot_size bytes, each
+   holding a 32-bit length and then the packet. The producer fills slot
+   (head % nr_slots), increments head, and then signals the other side
+   if tail was equal to the old head. If the queue is full, it sets
+   need_space and looks again. The consumer reads slot (tail % nr_slots),
+   increments tail, and then signals the other side if need_space was
+   set, clearing it. There must be a full memory barrier between each
+   update and the check which follows it. Everything is host-endian. */
+#define OC_RING_MAGIC		0x4f43524e /* "OCRN" */
+#define OC_RING_VERSION		1
+#define OC_RING_ACTIVE		1
+
+struct oc_ring_header {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t state;
+	uint32_t nr_slots;	/* A power of two */
+	uint32_t slot_size;
+	uint32_t to_peer;	/* Offset of the queue of packets from the VPN */
+	uint32_t from_peer;	/* Offset of the queue of packets to the VPN */
+};
+
+struct oc_ring_queue {
+	uint32_t head;
+	uint32_t need_space;
+	uint32_t _pad1[14];
+	uint32_t tail;
+	uint32_t _pad2[15];
+};
+
 #ifdef _WIN32
 /* Caller will provide an overlap-capable handle for the tunnel traffic. */
 int openconnect_setup_tun_fd(struct openconnect_info *vpninfo, intptr_t tun_fd);
@@ -588,6 +681,59 @@ int openconnect_mainloop(struct openconnect_info *vpninfo,
 			 int reconnect_timeout,
 			 int reconnect_interval);
 
+/* To run many sessions from one thread, under the application's own
+   event loop, call openconnect_mainloop_start() in place of
+   openconnect_mainloop(). Then call openconnect_mainloop_dispatch()
+   whenever one of the fds from openconnect_get_poll_fds() is ready, or
+   the timeout it last returned (in ms, or -1 for none) has passed. It
+   returns 1 while the session is running, and then the fds and their
+   events must be fetched again since they may have changed. Otherwise
+   it returns what openconnect_mainloop() would have done, and the
+   session is paused or finished just as it would be for that.
+
+   The TCP connect for a reconnect is waited for here, as one more fd,
+   but connecting, the TLS handshake and tunnel request once reconnected,
+   and running the vpnc-script still block the thread. Connecting still
+   uses select(), so can fail for a socket beyond FD_SETSIZE. Not
+   supported on Windows. */
+#define OC_POLL_READ	1
+#define OC_POLL_WRITE	2
+#define OC_POLL_EXCEPT	4
+#define OC_MAX_POLL_FDS	5
+
+struct oc_poll_fd {
+	int fd;
+	int events;	/* OC_POLL_* */
+};
+
+int openconnect_mainloop_start(struct openconnect_info *vpninfo,
+			       int reconnect_timeout,
+			       int reconnect_interval);
+/* Returns the number of fds, which may be more than nr_fds */
+int openconnect_get_poll_fds(struct openconnect_info *vpninfo,
+			     struct oc_poll_fd *fds, int nr_fds);
+int openconnect_mainloop_dispatch(struct openconnect_info *vpninfo,
+				  int *timeout);
+
+/* Sessions added to a group share their certificate trust store, which
+   is loaded only once for all that have the same CA file and no client
+   certificate, and the cipher list offered for DTLS. Add each session
+   before it first connects. The sessions in a group must all be used
+   from the same thread; the group itself is freed once both it and all
+   of its sessions have been. */
+struct oc_session_group;
+
+struct oc_session_group *openconnect_session_group_new(void);
+void openconnect_session_group_free(struct oc_session_group *group);
+int openconnect_session_group_add(struct oc_session_group *group,
+				  struct openconnect_info *vpninfo);
+
+/* Approximate memory, in bytes, held by this session alone: the
+   openconnect_info itself, its packet buffers and queues, and any
+   shared-memory packet ring. Memory inside the TLS library, and what
+   the session shares with the rest of its group, is not counted. */
+size_t openconnect_get_session_footprint(struct openconnect_info *vpninfo);
+
 /* The first (privdata) argument to each of these functions is either
    the privdata argument provided to openconnect_vpninfo_new_with_cbdata(),
    or if that argument was NULL then it'll be the vpninfo itself. */
@@ -642,6 +788,20 @@ void openconnect_set_loglevel(struct openconnect_info *vpninfo, int level);
 
 void openconnect_set_pass_tos(struct openconnect_info *vpninfo, int enable);
 
+/* Hand the HTTPS tunnel's TLS record layer to the kernel (Linux kTLS) once
+   the tunnel is established. Only TLS 1.2 with AES-GCM or ChaCha20-Poly1305
+   can be offloaded; otherwise this silently has no effect. */
+void openconnect_set_ktls(struct openconnect_info *vpninfo, int enable);
+
+/* Send packets marked with DSCP EF, CS6 or CS7 ahead of all other queued
+   traffic, rather than fairly alongside it. */
+void openconnect_set_dscp_priority(struct openconnect_info *vpninfo, int enable);
+
+/* Configure the tun device's addresses, MTU and routes directly over
+   rtnetlink instead of running the vpnc-script. DNS is not configured.
+   Returns -EOPNOTSUPP on platforms other than Linux. */
+int openconnect_set_netlink_config(struct openconnect_info *vpninfo, int enable);
+
 /* Callback for obtaining traffic stats via OC_CMD_STATS.
  */
 typedef void (*openconnect_stats_vfn) (void *privdata, const struct oc_stats *stats);
@@ -683,6 +843,29 @@ typedef void (*openconnect_reconnected_vfn) (void *privdata);
 void openconnect_set_reconnected_handler(struct openconnect_info *vpninfo,
 				         openconnect_reconnected_vfn reconnected_fn);
 
+/* Exchange IP packets with the application directly, instead of through
+   a tun device; call this instead of openconnect_setup_tun_fd() et al.
+   Both callbacks are called from openconnect_mainloop() or
+   openconnect_mainloop_dispatch().
+
+   The sink is given each packet received from the VPN, in the library's
+   own buffer which is only valid until it returns. It returns zero if it
+   has dealt with the packet, or non-zero to have it offered again later.
+
+   The source is given a buffer of 'len' bytes to fill with the next packet
+   to send, and returns its length, or zero if there is none. Once it has
+   returned zero, or the sink has refused a packet, neither is tried again
+   until the application calls openconnect_packets_ready(), which it may
+   do from any thread. Not supported on Windows. */
+typedef int (*openconnect_packet_sink_vfn) (void *privdata,
+					    const unsigned char *data, int len);
+typedef int (*openconnect_packet_source_vfn) (void *privdata,
+					      unsigned char *buf, int len);
+int openconnect_setup_packet_callbacks(struct openconnect_info *vpninfo,
+				       openconnect_packet_sink_vfn sink,
+				       openconnect_packet_source_vfn source);
+void openconnect_packets_ready(struct openconnect_info *vpninfo);
+
 #ifdef __cplusplus
 }
 #endif
@@ -451,6 +451,10 @@ int start_dtls_handshake(struct openconnect_info *vpninfo, int dtls_fd)
 
 		/* We don't need our own refcount on it any more */
 		SSL_SESSION_free(dtls_session);
+	} else if (vpninfo->dtls_session) {
+		/* PSK-NEGOTIATE: offer the session from the last handshake on
+		 * this CSTP connection, if there was one. */
+		SSL_set_session(dtls_ssl, vpninfo->dtls_session);
 	}
 
 	dtls_bio = BIO_new_socket(dtls_fd, BIO_NOCLOSE);
@@ -463,6 +467,18 @@ int start_dtls_handshake(struct openconnect_info *vpninfo, int dtls_fd)
 	return 0;
 }
 
+static void save_dtls_session(struct openconnect_info *vpninfo)
+{
+	SSL_SESSION *sess = SSL_get1_session(vpninfo->dtls_ssl);
+
+	if (!sess)
+		return;
+
+	if (vpninfo->dtls_session)
+		SSL_SESSION_free(vpninfo->dtls_session);
+	vpninfo->dtls_session = sess;
+}
+
 int dtls_try_handshake(struct openconnect_info *vpninfo)
 {
 	int ret = SSL_do_handshake(vpninfo->dtls_ssl);
@@ -496,6 +512,12 @@ int dtls_try_handshake(struct openconnect_info *vpninfo)
 					     data_mtu);
 				vpninfo->ip_info.mtu = data_mtu;
 			}
+
+			if (SSL_session_reused(vpninfo->dtls_ssl))
+				vpn_progress(vpninfo, PRG_DEBUG,
+					     _("Resumed previous DTLS session\n"));
+			else
+				save_dtls_session(vpninfo);
 		} else if (!SSL_session_reused(vpninfo->dtls_ssl)) {
 			/* Someone attempting to hijack the DTLS session?
 			 * A real server would never allow a full session
@@ -119,6 +119,57 @@ int openconnect_random(void *bytes, int len)
 	return 0;
 }
 
+int bench_cipher(int cipher, unsigned char *buf, int len, int count)
+{
+	unsigned char key[32] = { 0 }, iv[16] = { 0 }, tag[EVP_MAX_MD_SIZE];
+	unsigned int taglen;
+	const EVP_CIPHER *alg;
+	EVP_CIPHER_CTX *ctx;
+	int aead = 1, outl, ret = -EIO;
+
+	switch (cipher) {
+	case OC_BENCH_AES_128_GCM: alg = EVP_aes_128_gcm(); break;
+	case OC_BENCH_AES_256_GCM: alg = EVP_aes_256_gcm(); break;
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L && !defined(OPENSSL_NO_CHACHA) && !defined(OPENSSL_NO_POLY1305)
+	case OC_BENCH_CHACHA20_POLY1305: alg = EVP_chacha20_poly1305(); break;
+#endif
+	case OC_BENCH_AES_128_CBC: alg = EVP_aes_128_cbc(); aead = 0; break;
+	case OC_BENCH_AES_256_CBC: alg = EVP_aes_256_cbc(); aead = 0; break;
+	default:
+		return -EOPNOTSUPP;
+	}
+
+	ctx = EVP_CIPHER_CTX_new();
+	if (!ctx)
+		return -ENOMEM;
+	if (!EVP_EncryptInit_ex(ctx, alg, NULL, key, iv)) {
+		ret = -EOPNOTSUPP;
+		goto out;
+	}
+	EVP_CIPHER_CTX_set_padding(ctx, 0);
+
+	while (count--) {
+		if (aead) {
+			/* A fresh nonce and the record header, as TLS would */
+			if (!EVP_EncryptInit_ex(ctx, NULL, NULL, NULL, iv) ||
+			    !EVP_EncryptUpdate(ctx, NULL, &outl, key, 13) ||
+			    !EVP_EncryptUpdate(ctx, buf, &outl, buf, len) ||
+			    !EVP_EncryptFinal_ex(ctx, buf + outl, &outl) ||
+			    !EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_GET_TAG, 16, tag))
+				goto out;
+		} else {
+			taglen = sizeof(tag);
+			if (!HMAC(EVP_sha1(), key, 20, buf, len, tag, &taglen) ||
+			    !EVP_EncryptUpdate(ctx, buf, &outl, buf, len))
+				goto out;
+		}
+	}
+	ret = 0;
+ out:
+	EVP_CIPHER_CTX_free(ctx);
+	return ret;
+}
+
 /* Helper functions for reading/writing lines over SSL.
    We could use cURL for the HTTP stuff, but it's overkill */
 
@@ -212,11 +263,16 @@ static int _openconnect_openssl_read(SSL *ssl, int fd, struct openconnect_info *
 	return done;
 }
 
-static int openconnect_openssl_read(struct openconnect_info *vpninfo, char *buf, size_t len)
+static int openconnect_openssl_raw_read(struct openconnect_info *vpninfo, char *buf, size_t len)
 {
 	return _openconnect_openssl_read(vpninfo->https_ssl, vpninfo->ssl_fd, vpninfo, buf, len, 0);
 }
 
+static int openconnect_openssl_read(struct openconnect_info *vpninfo, char *buf, size_t len)
+{
+	return ssl_buffered_read(vpninfo, buf, len, openconnect_openssl_raw_read);
+}
+
 int openconnect_dtls_read(struct openconnect_info *vpninfo, void *buf, size_t len, unsigned ms)
 {
 	return _openconnect_openssl_read(vpninfo->dtls_ssl, vpninfo->dtls_fd, vpninfo, buf, len, ms);
@@ -224,64 +280,18 @@ int openconnect_dtls_read(struct openconnect_info *vpninfo, void *buf, size_t le
 
 static int openconnect_openssl_gets(struct openconnect_info *vpninfo, char *buf, size_t len)
 {
-	int i = 0;
-	int ret;
-
-	if (len < 2)
-		return -EINVAL;
-
-	while (1) {
-		ret = SSL_read(vpninfo->https_ssl, buf + i, 1);
-		if (ret == 1) {
-			if (buf[i] == '\n') {
-				buf[i] = 0;
-				if (i && buf[i-1] == '\r') {
-					buf[i-1] = 0;
-					i--;
-				}
-				return i;
-			}
-			i++;
-
-			if (i >= len - 1) {
-				buf[i] = 0;
-				return i;
-			}
-		} else {
-			fd_set rd_set, wr_set;
-			int maxfd = vpninfo->ssl_fd;
-
-			FD_ZERO(&rd_set);
-			FD_ZERO(&wr_set);
-
-			ret = SSL_get_error(vpninfo->https_ssl, ret);
-			if (ret == SSL_ERROR_WANT_READ)
-				FD_SET(vpninfo->ssl_fd, &rd_set);
-			else if (ret == SSL_ERROR_WANT_WRITE)
-				FD_SET(vpninfo->ssl_fd, &wr_set);
-			else {
-				vpn_progress(vpninfo, PRG_ERR, _("Failed to read from SSL socket\n"));
-				openconnect_report_ssl_errors(vpninfo);
-				ret = -EIO;
-				break;
-			}
-			cmd_fd_set(vpninfo, &rd_set, &maxfd);
-			select(maxfd + 1, &rd_set, &wr_set, NULL, NULL);
-			if (is_cancel_pending(vpninfo, &rd_set)) {
-				vpn_progress(vpninfo, PRG_ERR, _("SSL read cancelled\n"));
-				ret = -EINTR;
-				break;
-			}
-		}
-	}
-	buf[i] = 0;
-	return i ?: ret;
+	return ssl_buffered_gets(vpninfo, buf, len, openconnect_openssl_raw_read);
 }
 
 int ssl_nonblock_read(struct openconnect_info *vpninfo, void *buf, int maxlen)
 {
 	int len, ret;
 
+	/* Anything left over from the HTTP exchange comes first */
+	len = ssl_rbuf_take(vpninfo, buf, maxlen);
+	if (len)
+		return len;
+
 	len = SSL_read(vpninfo->https_ssl, buf, maxlen);
 	if (len > 0)
 		return len;
@@ -1639,10 +1649,61 @@ static int check_certificate_expiry(struct openconnect_info *vpninfo)
 	return 0;
 }
 
+/* Keep the session so the next connection to the same server can
+ * resume it. With TLS 1.3 the ticket arrives after the handshake, so
+ * we do this again when the connection is closed. */
+static void save_https_session(struct openconnect_info *vpninfo)
+{
+	SSL_SESSION *sess = SSL_get1_session(vpninfo->https_ssl);
+
+	if (!sess)
+		return;
+
+	if (vpninfo->https_session)
+		SSL_SESSION_free(vpninfo->https_session);
+	vpninfo->https_session = sess;
+	ssl_session_cache_set_host(vpninfo);
+}
+
+void free_shared_trust(void *handle)
+{
+	X509_STORE_free(handle);
+}
+
+/* Returns a reference for SSL_CTX_set_cert_store() to consume */
+static X509_STORE *shared_trust_store(struct openconnect_info *vpninfo)
+{
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L && !defined(LIBRESSL_VERSION_NUMBER)
+	X509_STORE *store = session_group_trust(vpninfo);
+
+	if (store)
+		X509_STORE_up_ref(store);
+	return store;
+#else
+	return NULL;
+#endif
+}
+
+static void share_trust_store(struct openconnect_info *vpninfo)
+{
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L && !defined(LIBRESSL_VERSION_NUMBER)
+	X509_STORE *store;
+
+	if (!vpninfo->session_group || vpninfo->cert)
+		return;
+
+	store = SSL_CTX_get_cert_store(vpninfo->https_ctx);
+	X509_STORE_up_ref(store);
+	if (session_group_share_trust(vpninfo, store))
+		X509_STORE_free(store);
+#endif
+}
+
 int openconnect_open_https(struct openconnect_info *vpninfo)
 {
 	SSL *https_ssl;
 	BIO *https_bio;
+	X509_STORE *shared_store;
 	int ssl_sock;
 	int err;
 
@@ -1715,14 +1776,20 @@ int openconnect_open_https(struct openconnect_info *vpninfo)
 		SSL_CTX_set_cert_verify_callback(vpninfo->https_ctx,
 						 ssl_app_verify_callback, vpninfo);
 
-		if (!vpninfo->no_system_trust)
+		/* Each session needs its own SSL_CTX for the verify callback,
+		   but the certificates they trust can be shared */
+		shared_store = shared_trust_store(vpninfo);
+		if (shared_store)
+			SSL_CTX_set_cert_store(vpninfo->https_ctx, shared_store);
+		else if (!vpninfo->no_system_trust)
 			SSL_CTX_set_default_verify_paths(vpninfo->https_ctx);
 
 		if (vpninfo->pfs)
 			SSL_CTX_set_cipher_list(vpninfo->https_ctx, "HIGH:!aNULL:!eNULL:-RSA");
 
 #ifdef ANDROID_KEYSTORE
-		if (vpninfo->cafile && !strncmp(vpninfo->cafile, "keystore:", 9)) {
+		if (!shared_store && vpninfo->cafile &&
+		    !strncmp(vpninfo->cafile, "keystore:", 9)) {
 			STACK_OF(X509_INFO) *stack;
 			X509_STORE *store;
 			X509_INFO *info;
@@ -1761,7 +1828,7 @@ int openconnect_open_https(struct openconnect_info *vpninfo)
 			sk_X509_INFO_free(stack);
 		} else
 #endif
-		if (vpninfo->cafile) {
+		if (!shared_store && vpninfo->cafile) {
 			/* OpenSSL does actually manage to cope with UTF-8 for
 			   this one, under Windows. So only convert for legacy
 			   UNIX. */
@@ -1783,6 +1850,8 @@ int openconnect_open_https(struct openconnect_info *vpninfo)
 			}
 		}
 
+		if (!shared_store)
+			share_trust_store(vpninfo);
 	}
 	https_ssl = SSL_new(vpninfo->https_ctx);
 	workaround_openssl_certchain_bug(vpninfo, https_ssl);
@@ -1817,6 +1886,9 @@ int openconnect_open_https(struct openconnect_info *vpninfo)
 #endif
 	SSL_set_verify(https_ssl, SSL_VERIFY_PEER, NULL);
 
+	if (vpninfo->https_session && ssl_session_cache_valid(vpninfo))
+		SSL_set_session(https_ssl, vpninfo->https_session);
+
 	vpn_progress(vpninfo, PRG_INFO, _("SSL negotiation with %s\n"),
 		     vpninfo->hostname);
 
@@ -1850,10 +1922,28 @@ int openconnect_open_https(struct openconnect_info *vpninfo)
 		}
 	}
 
+	if (SSL_session_reused(https_ssl)) {
+		/* ssl_app_verify_callback() isn't called for a resumed
+		 * session, but the certificate is kept in the session. */
+		if (!vpninfo->peer_cert) {
+			vpninfo->peer_cert = SSL_get_peer_certificate(https_ssl);
+			if (!vpninfo->peer_cert) {
+				vpn_progress(vpninfo, PRG_ERR,
+					     _("Resumed TLS session has no usable server certificate\n"));
+				SSL_free(https_ssl);
+				closesocket(ssl_sock);
+				return -EIO;
+			}
+			set_peer_cert_hash(vpninfo);
+		}
+		vpn_progress(vpninfo, PRG_DEBUG, _("Resumed previous TLS session\n"));
+	}
+
 	vpninfo->cstp_cipher = (char *)SSL_get_cipher_name(https_ssl);
 
 	vpninfo->ssl_fd = ssl_sock;
 	vpninfo->https_ssl = https_ssl;
+	save_https_session(vpninfo);
 
 	vpninfo->ssl_read = openconnect_openssl_read;
 	vpninfo->ssl_write = openconnect_openssl_write;
@@ -1871,12 +1961,33 @@ int cstp_handshake(struct openconnect_info *vpninfo, unsigned init)
 	return -EOPNOTSUPP;
 }
 
+/* OpenSSL gives us no way to extract the record-layer keys and sequence
+ * numbers of a live session, so we can't hand it to the kernel. */
+int ssl_ktls_offload(struct openconnect_info *vpninfo, int rx)
+{
+	vpn_progress(vpninfo, PRG_DEBUG,
+		     _("Kernel TLS offload is not supported with OpenSSL\n"));
+	return -EOPNOTSUPP;
+}
+
 void openconnect_close_https(struct openconnect_info *vpninfo, int final)
 {
+	vpninfo->ssl_rbuf_pos = vpninfo->ssl_rbuf_len = 0;
 	if (vpninfo->https_ssl) {
+		if (!final)
+			save_https_session(vpninfo);
 		SSL_free(vpninfo->https_ssl);
 		vpninfo->https_ssl = NULL;
 	}
+	if (final && vpninfo->https_session) {
+		SSL_SESSION_free(vpninfo->https_session);
+		vpninfo->https_session = NULL;
+	}
+	/* A new CSTP connection means a new DTLS PSK */
+	if (vpninfo->dtls_session) {
+		SSL_SESSION_free(vpninfo->dtls_session);
+		vpninfo->dtls_session = NULL;
+	}
 	if (vpninfo->ssl_fd != -1) {
 		closesocket(vpninfo->ssl_fd);
 		unmonitor_read_fd(vpninfo, ssl);
@@ -223,6 +223,9 @@ static void set_banner(struct openconnect_info *vpninfo)
 
 void prepare_script_env(struct openconnect_info *vpninfo)
 {
+	struct oc_split_include *incs, *excs;
+	int aggregated = 1;
+
 	if (vpninfo->ip_info.gateway_addr)
 		script_setenv(vpninfo, "VPNGATEWAY", vpninfo->ip_info.gateway_addr, 0);
 
@@ -316,8 +319,16 @@ void prepare_script_env(struct openconnect_info *vpninfo)
 			free(list);
 		}
 	}
-	if (vpninfo->ip_info.split_includes) {
-		struct oc_split_include *this = vpninfo->ip_info.split_includes;
+	/* Fall back to the lists as the server gave them if we can't
+	 * aggregate them, which can only be for lack of memory. */
+	if (aggregate_split_routes(vpninfo, vpninfo->ip_info.split_includes,
+				   vpninfo->ip_info.split_excludes, &incs, &excs)) {
+		incs = vpninfo->ip_info.split_includes;
+		excs = vpninfo->ip_info.split_excludes;
+		aggregated = 0;
+	}
+	if (incs) {
+		struct oc_split_include *this = incs;
 		int nr_split_includes = 0;
 		int nr_v6_split_includes = 0;
 
@@ -332,8 +343,8 @@ void prepare_script_env(struct openconnect_info *vpninfo)
 		if (nr_v6_split_includes)
 			script_setenv_int(vpninfo, "CISCO_IPV6_SPLIT_INC", nr_v6_split_includes);
 	}
-	if (vpninfo->ip_info.split_excludes) {
-		struct oc_split_include *this = vpninfo->ip_info.split_excludes;
+	if (excs) {
+		struct oc_split_include *this = excs;
 		int nr_split_excludes = 0;
 		int nr_v6_split_excludes = 0;
 
@@ -348,28 +359,18 @@ void prepare_script_env(struct openconnect_info *vpninfo)
 		if (nr_v6_split_excludes)
 			script_setenv_int(vpninfo, "CISCO_IPV6_SPLIT_EXC", nr_v6_split_excludes);
 	}
+	if (aggregated) {
+		free_split_list(incs);
+		free_split_list(excs);
+	}
 	setenv_cstp_opts(vpninfo);
 }
 
 void free_split_routes(struct openconnect_info *vpninfo)
 {
-	struct oc_split_include *inc;
-
-	for (inc = vpninfo->ip_info.split_includes; inc; ) {
-		struct oc_split_include *next = inc->next;
-		free(inc);
-		inc = next;
-	}
-	for (inc = vpninfo->ip_info.split_excludes; inc; ) {
-		struct oc_split_include *next = inc->next;
-		free(inc);
-		inc = next;
-	}
-	for (inc = vpninfo->ip_info.split_dns; inc; ) {
-		struct oc_split_include *next = inc->next;
-		free(inc);
-		inc = next;
-	}
+	free_split_list(vpninfo->ip_info.split_includes);
+	free_split_list(vpninfo->ip_info.split_excludes);
+	free_split_list(vpninfo->ip_info.split_dns);
 	vpninfo->ip_info.split_dns = vpninfo->ip_info.split_includes =
 		vpninfo->ip_info.split_excludes = NULL;
 }
@@ -540,6 +541,10 @@ int script_config_tun(struct openconnect_info *vpninfo, const char *reason)
 	int ret;
 	pid_t pid;
 
+#ifdef HAVE_LINUX_RTNETLINK_H
+	if (vpninfo->netlink_config && !vpninfo->script_tun)
+		return netlink_config_tun(vpninfo, reason);
+#endif
 	if (!vpninfo->vpnc_script || vpninfo->script_tun)
 		return 0;
 
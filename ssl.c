@@ -40,10 +40,18 @@
 
 #include "openconnect-internal.h"
 
+#ifndef _WIN32
+#include <poll.h>
+#endif
+
 #ifdef ANDROID_KEYSTORE
 #include <sys/un.h>
 #endif
 
+#ifndef _WIN32
+#include <netinet/tcp.h>
+#endif
+
 /* OSX < 1.6 doesn't have AI_NUMERICSERV */
 #ifndef AI_NUMERICSERV
 #define AI_NUMERICSERV 0
@@ -64,15 +72,9 @@ static inline int connect_pending()
  * negative value, that's a normal errno and should be handled with
  * strerror(). No, you can't just pass the latter value (negated) to
  * openconnect__win32_strerror() because it gives nonsense results. */
-static int cancellable_connect(struct openconnect_info *vpninfo, int sockfd,
-			       const struct sockaddr *addr, socklen_t addrlen)
+static int start_connect(struct openconnect_info *vpninfo, int sockfd,
+			 const struct sockaddr *addr, socklen_t addrlen)
 {
-	struct sockaddr_storage peer;
-	socklen_t peerlen = sizeof(peer);
-	fd_set wr_set, rd_set, ex_set;
-	int maxfd = sockfd;
-	int err;
-
 	set_sock_nonblock(sockfd);
 	if (vpninfo->protect_socket)
 		vpninfo->protect_socket(vpninfo->cbdata, sockfd);
@@ -84,23 +86,16 @@ static int cancellable_connect(struct openconnect_info *vpninfo, int sockfd,
 		return -errno;
 #endif
 	}
+	return 0;
+}
 
-	do {
-		FD_ZERO(&wr_set);
-		FD_ZERO(&rd_set);
-		FD_ZERO(&ex_set);
-		FD_SET(sockfd, &wr_set);
-#ifdef _WIN32 /* Windows indicates failure this way, not in wr_set */
-		FD_SET(sockfd, &ex_set);
-#endif
-		cmd_fd_set(vpninfo, &rd_set, &maxfd);
-		select(maxfd + 1, &rd_set, &wr_set, &ex_set, NULL);
-		if (is_cancel_pending(vpninfo, &rd_set)) {
-			vpn_progress(vpninfo, PRG_ERR, _("Socket connect cancelled\n"));
-			return -EINTR;
-		}
-	} while (!FD_ISSET(sockfd, &wr_set) && !FD_ISSET(sockfd, &ex_set) &&
-		 !vpninfo->got_pause_cmd);
+/* Once a non-blocking connect() has signalled completion, find out
+ * whether it actually succeeded. */
+static int finish_connect(int sockfd)
+{
+	struct sockaddr_storage peer;
+	socklen_t peerlen = sizeof(peer);
+	int err;
 
 	/* Check whether connect() succeeded or failed by using
 	   getpeername(). See http://cr.yp.to/docs/connect.html */
@@ -131,6 +126,62 @@ static int cancellable_connect(struct openconnect_info *vpninfo, int sockfd,
 	return err;
 }
 
+static int cancellable_connect(struct openconnect_info *vpninfo, int sockfd,
+			       const struct sockaddr *addr, socklen_t addrlen)
+{
+	fd_set wr_set, rd_set, ex_set;
+	int maxfd = sockfd;
+	int err;
+
+	err = start_connect(vpninfo, sockfd, addr, addrlen);
+	if (err)
+		return err;
+
+	do {
+		FD_ZERO(&wr_set);
+		FD_ZERO(&rd_set);
+		FD_ZERO(&ex_set);
+		FD_SET(sockfd, &wr_set);
+#ifdef _WIN32 /* Windows indicates failure this way, not in wr_set */
+		FD_SET(sockfd, &ex_set);
+#endif
+		cmd_fd_set(vpninfo, &rd_set, &maxfd);
+		select(maxfd + 1, &rd_set, &wr_set, &ex_set, NULL);
+		if (is_cancel_pending(vpninfo, &rd_set)) {
+			vpn_progress(vpninfo, PRG_ERR, _("Socket connect cancelled\n"));
+			return -EINTR;
+		}
+	} while (!FD_ISSET(sockfd, &wr_set) && !FD_ISSET(sockfd, &ex_set) &&
+		 !vpninfo->got_pause_cmd);
+
+	return finish_connect(sockfd);
+}
+
+static void reconnect_error(struct openconnect_info *vpninfo, int err)
+{
+	char *errstr;
+
+#ifdef _WIN32
+	if (err > 0)
+		errstr = openconnect__win32_strerror(err);
+	else
+#endif
+		errstr = strerror(-err);
+	if (vpninfo->proxy) {
+		vpn_progress(vpninfo, PRG_ERR,
+			     _("Failed to reconnect to proxy %s: %s\n"),
+			     vpninfo->proxy, errstr);
+	} else {
+		vpn_progress(vpninfo, PRG_ERR,
+			     _("Failed to reconnect to host %s: %s\n"),
+			     vpninfo->hostname, errstr);
+	}
+#ifdef _WIN32
+	if (err > 0)
+		free(errstr);
+#endif
+}
+
 /* checks whether the provided string is an IP or a hostname.
  */
 unsigned string_is_hostname(const char *str)
@@ -163,6 +214,449 @@ static int match_sockaddr(struct sockaddr *a, struct sockaddr *b)
 		return 0;
 }
 
+/* RFC8305 "Happy Eyeballs". Rather than waiting for each address in turn
+ * to time out, start a new connection attempt every HAPPY_EYEBALLS_DELAY
+ * milliseconds (or immediately when one fails) while the earlier ones are
+ * still pending. The first to complete wins and the rest are abandoned.
+ * Addresses are interleaved by family, so that a black-holed IPv6 path
+ * only costs us one delay before IPv4 is tried. */
+#define HAPPY_EYEBALLS_DELAY 250
+
+struct connect_attempt {
+	struct addrinfo *rp;
+	int fd;
+	char host[80];
+};
+
+static long ms_since(struct timeval *start)
+{
+	struct timeval now;
+
+	gettimeofday(&now, NULL);
+	return (now.tv_sec - start->tv_sec) * 1000 +
+		(now.tv_usec - start->tv_usec) / 1000;
+}
+
+static void connect_attempt_failed(struct openconnect_info *vpninfo,
+				   struct connect_attempt *a, const char *port,
+				   int err)
+{
+	if (a->host[0]) {
+		char *errstr;
+#ifdef _WIN32
+		if (err > 0)
+			errstr = openconnect__win32_strerror(err);
+		else
+#endif
+			errstr = strerror(-err);
+
+		vpn_progress(vpninfo, PRG_INFO, _("Failed to connect to %s%s%s:%s: %s\n"),
+			     a->rp->ai_family == AF_INET6 ? "[" : "",
+			     a->host,
+			     a->rp->ai_family == AF_INET6 ? "]" : "",
+			     port, errstr);
+#ifdef _WIN32
+		if (err > 0)
+			free(errstr);
+#endif
+	}
+	if (a->fd >= 0)
+		closesocket(a->fd);
+	a->fd = -1;
+
+	/* If we're in DynDNS mode but this *was* the cached IP address,
+	 * don't bother falling back to it if it didn't work. */
+	if (vpninfo->peer_addr && vpninfo->peer_addrlen == a->rp->ai_addrlen &&
+	    match_sockaddr(vpninfo->peer_addr, a->rp->ai_addr)) {
+		vpn_progress(vpninfo, PRG_TRACE,
+			     _("Forgetting non-functional previous peer address\n"));
+		free(vpninfo->peer_addr);
+		vpninfo->peer_addr = 0;
+		vpninfo->peer_addrlen = 0;
+		free(vpninfo->ip_info.gateway_addr);
+		vpninfo->ip_info.gateway_addr = NULL;
+	}
+}
+
+static int race_connect(struct openconnect_info *vpninfo, struct addrinfo *result,
+			const char *port, struct addrinfo **winner, char *winner_host)
+{
+	struct connect_attempt *attempts;
+	struct addrinfo *rp, *other;
+	struct timeval start;
+	int nr_attempts = 0, next = 0, nr_pending = 0;
+	/* Set when an attempt fails, to start the next without waiting */
+	int start_now = 0;
+	long last_start = 0;
+	int i, ret = -EINVAL;
+
+	for (rp = result; rp; rp = rp->ai_next)
+		nr_attempts++;
+	if (!nr_attempts)
+		return -EINVAL;
+
+	attempts = calloc(nr_attempts, sizeof(*attempts));
+	if (!attempts)
+		return -ENOMEM;
+
+	/* Alternate between the family of the first result and the rest */
+	rp = result;
+	other = result->ai_next;
+	while (other && other->ai_family == result->ai_family)
+		other = other->ai_next;
+	for (i = 0; i < nr_attempts; ) {
+		if (rp) {
+			attempts[i++].rp = rp;
+			do
+				rp = rp->ai_next;
+			while (rp && rp->ai_family != result->ai_family);
+		}
+		if (other) {
+			attempts[i++].rp = other;
+			do
+				other = other->ai_next;
+			while (other && other->ai_family == result->ai_family);
+		}
+	}
+
+	for (i = 0; i < nr_attempts; i++) {
+		attempts[i].fd = -1;
+		attempts[i].host[0] = 0;
+		getnameinfo(attempts[i].rp->ai_addr, attempts[i].rp->ai_addrlen,
+			    attempts[i].host, sizeof(attempts[i].host),
+			    NULL, 0, NI_NUMERICHOST);
+	}
+
+	gettimeofday(&start, NULL);
+
+	while (1) {
+		fd_set wr_set, rd_set, ex_set;
+		struct timeval tv, *tvp = NULL;
+		long now = ms_since(&start);
+		int maxfd = 0;
+
+		if (next < nr_attempts &&
+		    (!nr_pending || start_now ||
+		     now - last_start >= HAPPY_EYEBALLS_DELAY)) {
+			struct connect_attempt *a = &attempts[next++];
+			int err;
+
+			start_now = 0;
+			if (a->host[0])
+				vpn_progress(vpninfo, PRG_DEBUG, vpninfo->proxy_type ?
+					     _("Attempting to connect to proxy %s%s%s:%s\n") :
+					     _("Attempting to connect to server %s%s%s:%s\n"),
+					     a->rp->ai_family == AF_INET6 ? "[" : "",
+					     a->host,
+					     a->rp->ai_family == AF_INET6 ? "]" : "",
+					     port);
+			if (next > 1)
+				vpn_progress(vpninfo, PRG_DEBUG,
+					     _("Connection attempt %d started at %ld ms (%d still pending)\n"),
+					     next, now, nr_pending);
+
+			a->fd = socket(a->rp->ai_family, a->rp->ai_socktype,
+				       a->rp->ai_protocol);
+			if (a->fd < 0) {
+				start_now = 1;
+				continue;
+			}
+			set_fd_cloexec(a->fd);
+
+			err = start_connect(vpninfo, a->fd, a->rp->ai_addr, a->rp->ai_addrlen);
+			if (err) {
+				connect_attempt_failed(vpninfo, a, port, err);
+				start_now = 1;
+				continue;
+			}
+			nr_pending++;
+			last_start = now;
+			continue;
+		}
+
+		if (!nr_pending)
+			break;
+
+		FD_ZERO(&wr_set);
+		FD_ZERO(&rd_set);
+		FD_ZERO(&ex_set);
+		for (i = 0; i < next; i++) {
+			if (attempts[i].fd < 0)
+				continue;
+			FD_SET(attempts[i].fd, &wr_set);
+#ifdef _WIN32 /* Windows indicates failure this way, not in wr_set */
+			FD_SET(attempts[i].fd, &ex_set);
+#endif
+			if (attempts[i].fd > maxfd)
+				maxfd = attempts[i].fd;
+		}
+		cmd_fd_set(vpninfo, &rd_set, &maxfd);
+
+		if (next < nr_attempts) {
+			long wait = HAPPY_EYEBALLS_DELAY - (now - last_start);
+
+			if (wait < 0)
+				wait = 0;
+			tv.tv_sec = wait / 1000;
+			tv.tv_usec = (wait % 1000) * 1000;
+			tvp = &tv;
+		}
+		select(maxfd + 1, &rd_set, &wr_set, &ex_set, tvp);
+		if (is_cancel_pending(vpninfo, &rd_set) || vpninfo->got_pause_cmd) {
+			vpn_progress(vpninfo, PRG_ERR, _("Socket connect cancelled\n"));
+			ret = -EINTR;
+			break;
+		}
+
+		for (i = 0; i < next; i++) {
+			struct connect_attempt *a = &attempts[i];
+			int err;
+
+			if (a->fd < 0 ||
+			    (!FD_ISSET(a->fd, &wr_set) && !FD_ISSET(a->fd, &ex_set)))
+				continue;
+
+			nr_pending--;
+			err = finish_connect(a->fd);
+			if (err) {
+				connect_attempt_failed(vpninfo, a, port, err);
+				start_now = 1;
+				continue;
+			}
+
+			vpn_progress(vpninfo, PRG_DEBUG,
+				     _("Connection attempt %d won after %ld ms\n"),
+				     i + 1, ms_since(&start));
+			ret = a->fd;
+			a->fd = -1;
+			*winner = a->rp;
+			strcpy(winner_host, a->host);
+			goto out;
+		}
+	}
+ out:
+	for (i = 0; i < next; i++) {
+		if (attempts[i].fd < 0)
+			continue;
+		vpn_progress(vpninfo, PRG_DEBUG,
+			     _("Abandoning connection attempt to %s%s%s:%s\n"),
+			     attempts[i].rp->ai_family == AF_INET6 ? "[" : "",
+			     attempts[i].host,
+			     attempts[i].rp->ai_family == AF_INET6 ? "]" : "",
+			     port);
+		closesocket(attempts[i].fd);
+	}
+	free(attempts);
+	return ret;
+}
+
+/* The result of the last lookup of the server (or proxy) name. This is
+ * not a cache: getaddrinfo() doesn't tell us the TTL, so every connection
+ * does a fresh lookup and leaves any caching to the system resolver. The
+ * one exception is a lookup started by prefetch_https_address() when the
+ * connection looked like it was dying, which the reconnect that follows
+ * may use once, if it hasn't been sitting there for more than
+ * DNS_PREFETCH_MAX seconds. Where getaddrinfo_a() exists, the prefetch
+ * runs in the background and waiting for a lookup can be cancelled, but
+ * the lookup in connect_https_socket() still blocks its caller. */
+#define DNS_PREFETCH_MAX 10
+
+struct dns_prefetch {
+	char *host;
+	char port[6];
+	struct addrinfo hints;
+	struct addrinfo *result;
+	int err;
+#ifdef HAVE_GETADDRINFO_A
+	struct gaicb gcb;
+	int pending;
+	int prefetched;	/* Not yet used by a reconnect */
+	time_t started;
+#endif
+};
+
+static void dns_prefetch_clear(struct dns_prefetch *dp)
+{
+#ifdef HAVE_GETADDRINFO_A
+	if (dp->pending) {
+		/* If it can't be cancelled, we have to wait for it; the
+		 * gaicb and the strings it points to are still in use. */
+		if (gai_cancel(&dp->gcb) == EAI_NOTCANCELED) {
+			const struct gaicb *list[1] = { &dp->gcb };
+			while (gai_error(&dp->gcb) == EAI_INPROGRESS)
+				gai_suspend(list, 1, NULL);
+		}
+		if (!gai_error(&dp->gcb) && dp->gcb.ar_result)
+			freeaddrinfo(dp->gcb.ar_result);
+		dp->pending = 0;
+	}
+	dp->prefetched = 0;
+#endif
+	if (dp->result)
+		freeaddrinfo(dp->result);
+	dp->result = NULL;
+	free(dp->host);
+	dp->host = NULL;
+}
+
+void free_dns_prefetch(struct openconnect_info *vpninfo)
+{
+	if (vpninfo->dns_prefetch) {
+		dns_prefetch_clear(vpninfo->dns_prefetch);
+		free(vpninfo->dns_prefetch);
+		vpninfo->dns_prefetch = NULL;
+	}
+}
+
+static struct dns_prefetch *dns_prefetch_entry(struct openconnect_info *vpninfo,
+					       const char *host, const char *port,
+					       const struct addrinfo *hints)
+{
+	struct dns_prefetch *dp = vpninfo->dns_prefetch;
+
+	if (!dp) {
+		dp = vpninfo->dns_prefetch = calloc(1, sizeof(*dp));
+		if (!dp)
+			return NULL;
+	}
+
+	if (dp->host && (strcmp(dp->host, host) || strcmp(dp->port, port) ||
+			 dp->hints.ai_flags != hints->ai_flags))
+		dns_prefetch_clear(dp);
+
+	if (!dp->host) {
+		dp->host = strdup(host);
+		if (!dp->host)
+			return NULL;
+		snprintf(dp->port, sizeof(dp->port), "%s", port);
+		dp->hints = *hints;
+	}
+	return dp;
+}
+
+static void dns_prefetch_store(struct dns_prefetch *dp, int err, struct addrinfo *result)
+{
+	if (dp->result)
+		freeaddrinfo(dp->result);
+	dp->result = err ? NULL : result;
+	dp->err = err;
+}
+
+#ifdef HAVE_GETADDRINFO_A
+static int dns_prefetch_start(struct dns_prefetch *dp)
+{
+	struct gaicb *list[1] = { &dp->gcb };
+	int err;
+
+	memset(&dp->gcb, 0, sizeof(dp->gcb));
+	dp->gcb.ar_name = dp->host;
+	dp->gcb.ar_service = dp->port;
+	dp->gcb.ar_request = &dp->hints;
+
+	err = getaddrinfo_a(GAI_NOWAIT, list, 1, NULL);
+	if (!err) {
+		dp->pending = 1;
+		dp->started = time(NULL);
+	}
+	return err;
+}
+
+/* Returns non-zero if the lookup has finished */
+static int dns_prefetch_poll(struct dns_prefetch *dp)
+{
+	int err = gai_error(&dp->gcb);
+
+	if (err == EAI_INPROGRESS)
+		return 0;
+
+	dp->pending = 0;
+	dns_prefetch_store(dp, err, dp->gcb.ar_result);
+	return 1;
+}
+#endif
+
+/* Start refreshing the server address in the background, when the
+ * keepalive code suspects that we may soon need to reconnect. This only
+ * matters when ssl_reconnect() will actually redo the lookup rather
+ * than reusing peer_addr; i.e. for DynDNS servers. */
+void prefetch_https_address(struct openconnect_info *vpninfo)
+{
+#ifdef HAVE_GETADDRINFO_A
+	struct dns_prefetch *dp = vpninfo->dns_prefetch;
+
+	if (!vpninfo->is_dyndns || vpninfo->proxy || vpninfo->getaddrinfo_override ||
+	    !dp || !dp->host || dp->pending)
+		return;
+
+	if (!dns_prefetch_start(dp)) {
+		dp->prefetched = 1;
+		vpn_progress(vpninfo, PRG_DEBUG,
+			     _("Prefetching address of %s\n"), dp->host);
+	}
+#endif
+}
+
+static int dns_prefetch_getaddrinfo(struct openconnect_info *vpninfo,
+				    const char *host, const char *port,
+				    const struct addrinfo *hints,
+				    struct addrinfo **result)
+{
+	struct dns_prefetch *dp = dns_prefetch_entry(vpninfo, host, port, hints);
+	int err;
+
+	if (!dp)
+		return EAI_MEMORY;
+
+#ifdef HAVE_GETADDRINFO_A
+	/* A prefetch is only good for the one reconnect it was made for */
+	if (dp->pending)
+		dns_prefetch_poll(dp);
+	/* Still in flight, it'll be fresh enough when it arrives */
+	if (dp->prefetched && !dp->pending &&
+	    time(NULL) - dp->started > DNS_PREFETCH_MAX)
+		dp->prefetched = 0;
+
+	if (dp->prefetched) {
+		vpn_progress(vpninfo, PRG_TRACE,
+			     _("Using prefetched address of %s\n"), host);
+		dp->prefetched = 0;
+	} else {
+		err = dns_prefetch_start(dp);
+		if (err)
+			return err;
+	}
+
+	/* Either a fresh lookup or a prefetch which hasn't finished yet */
+	while (dp->pending && !dns_prefetch_poll(dp)) {
+		const struct gaicb *list[1] = { &dp->gcb };
+		struct timespec ts = { 0, 100 * 1000 * 1000 };
+		struct timeval tv = { 0, 0 };
+		fd_set rd_set;
+		int maxfd = 0;
+
+		gai_suspend(list, 1, &ts);
+
+		FD_ZERO(&rd_set);
+		cmd_fd_set(vpninfo, &rd_set, &maxfd);
+		select(maxfd + 1, &rd_set, NULL, NULL, &tv);
+		if (is_cancel_pending(vpninfo, &rd_set)) {
+			vpn_progress(vpninfo, PRG_ERR, _("DNS lookup cancelled\n"));
+			dns_prefetch_clear(dp);
+			return EAI_AGAIN;
+		}
+	}
+#else
+	{
+		struct addrinfo *res = NULL;
+
+		err = getaddrinfo(host, port, hints, &res);
+		dns_prefetch_store(dp, err, res);
+	}
+#endif
+	*result = dp->result;
+	return dp->err;
+}
+
 int connect_https_socket(struct openconnect_info *vpninfo)
 {
 	int ssl_sock = -1;
@@ -175,7 +669,12 @@ int connect_https_socket(struct openconnect_info *vpninfo)
 	   just re-use its previous IP address. If we're talking to a proxy, we
 	   can use *its* previous IP address. We expect it'll re-do the DNS
 	   lookup for the server anyway. */
-	if (vpninfo->peer_addr && (!vpninfo->is_dyndns || vpninfo->proxy)) {
+	if (vpninfo->reconnect_fd != -1) {
+		/* ssl_reconnect() has already connected to peer_addr */
+		ssl_sock = vpninfo->reconnect_fd;
+		vpninfo->reconnect_fd = -1;
+		vpninfo->reconnect_monitored = 0;
+	} else if (vpninfo->peer_addr && (!vpninfo->is_dyndns || vpninfo->proxy)) {
 	reconnect:
 #ifdef SOCK_CLOEXEC
 		ssl_sock = socket(vpninfo->peer_addr->sa_family, SOCK_STREAM | SOCK_CLOEXEC, IPPROTO_IP);
@@ -195,27 +694,8 @@ int connect_https_socket(struct openconnect_info *vpninfo)
 		}
 		err = cancellable_connect(vpninfo, ssl_sock, vpninfo->peer_addr, vpninfo->peer_addrlen);
 		if (err) {
-			char *errstr;
 		reconn_err:
-#ifdef _WIN32
-			if (err > 0)
-				errstr = openconnect__win32_strerror(err);
-			else
-#endif
-				errstr = strerror(-err);
-			if (vpninfo->proxy) {
-				vpn_progress(vpninfo, PRG_ERR,
-					     _("Failed to reconnect to proxy %s: %s\n"),
-					     vpninfo->proxy, errstr);
-			} else {
-				vpn_progress(vpninfo, PRG_ERR,
-					     _("Failed to reconnect to host %s: %s\n"),
-					     vpninfo->hostname, errstr);
-			}
-#ifdef _WIN32
-			if (err > 0)
-				free(errstr);
-#endif
+			reconnect_error(vpninfo, err);
 			if (ssl_sock >= 0)
 				closesocket(ssl_sock);
 			ssl_sock = -EINVAL;
@@ -224,6 +704,7 @@ int connect_https_socket(struct openconnect_info *vpninfo)
 	} else {
 		struct addrinfo hints, *result, *rp;
 		char *hostname;
+		char host[80];
 		char port[6];
 
 		memset(&hints, 0, sizeof(struct addrinfo));
@@ -298,10 +779,11 @@ int connect_https_socket(struct openconnect_info *vpninfo)
 			hints.ai_flags |= AI_NUMERICHOST;
 		}
 
+		/* The result from the cache is owned by the cache */
 		if (vpninfo->getaddrinfo_override)
 			err = vpninfo->getaddrinfo_override(vpninfo->cbdata, hostname, port, &hints, &result);
 		else
-			err = getaddrinfo(hostname, port, &hints, &result);
+			err = dns_prefetch_getaddrinfo(vpninfo, hostname, port, &hints, &result);
 
 		if (err) {
 			vpn_progress(vpninfo, PRG_ERR,
@@ -322,115 +804,61 @@ int connect_https_socket(struct openconnect_info *vpninfo)
 		if (hints.ai_flags & AI_NUMERICHOST)
 			free(hostname);
 
-		for (rp = result; rp ; rp = rp->ai_next) {
-			char host[80];
+		ssl_sock = race_connect(vpninfo, result, port, &rp, host);
+		if (ssl_sock >= 0) {
+			/* Store the peer address we actually used, so that DTLS can
+			   use it again later */
+			free(vpninfo->ip_info.gateway_addr);
+			vpninfo->ip_info.gateway_addr = NULL;
 
-			host[0] = 0;
-			if (!getnameinfo(rp->ai_addr, rp->ai_addrlen, host,
-					 sizeof(host), NULL, 0, NI_NUMERICHOST))
-				vpn_progress(vpninfo, PRG_DEBUG, vpninfo->proxy_type ?
-						     _("Attempting to connect to proxy %s%s%s:%s\n") :
-						     _("Attempting to connect to server %s%s%s:%s\n"),
+			if (host[0]) {
+				vpninfo->ip_info.gateway_addr = strdup(host);
+				vpn_progress(vpninfo, PRG_INFO, _("Connected to %s%s%s:%s\n"),
 					     rp->ai_family == AF_INET6 ? "[" : "",
 					     host,
 					     rp->ai_family == AF_INET6 ? "]" : "",
 					     port);
-
-			ssl_sock = socket(rp->ai_family, rp->ai_socktype,
-					  rp->ai_protocol);
-			if (ssl_sock < 0)
-				continue;
-			set_fd_cloexec(ssl_sock);
-			err = cancellable_connect(vpninfo, ssl_sock, rp->ai_addr, rp->ai_addrlen);
-			if (!err) {
-				/* Store the peer address we actually used, so that DTLS can
-				   use it again later */
-				free(vpninfo->ip_info.gateway_addr);
-				vpninfo->ip_info.gateway_addr = NULL;
-
-				if (host[0]) {
-					vpninfo->ip_info.gateway_addr = strdup(host);
-					vpn_progress(vpninfo, PRG_INFO, _("Connected to %s%s%s:%s\n"),
-						     rp->ai_family == AF_INET6 ? "[" : "",
-						     host,
-						     rp->ai_family == AF_INET6 ? "]" : "",
-						     port);
-				}
-
-				free(vpninfo->peer_addr);
-				vpninfo->peer_addrlen = 0;
-				vpninfo->peer_addr = malloc(rp->ai_addrlen);
-				if (!vpninfo->peer_addr) {
-					vpn_progress(vpninfo, PRG_ERR,
-						     _("Failed to allocate sockaddr storage\n"));
-					closesocket(ssl_sock);
-					ssl_sock = -ENOMEM;
-					goto out;
-				}
-				vpninfo->peer_addrlen = rp->ai_addrlen;
-				memcpy(vpninfo->peer_addr, rp->ai_addr, rp->ai_addrlen);
-				/* If no proxy, ensure that we output *this* IP address in
-				 * authentication results because we're going to need to
-				 * reconnect to the *same* server from the rotation. And with
-				 * some trick DNS setups, it might possibly be a "rotation"
-				 * even if we only got one result from getaddrinfo() this
-				 * time.
-				 *
-				 * If there's a proxy, we're kind of screwed; we can't know
-				 * which IP address we connected to. Perhaps we ought to do
-				 * the DNS lookup locally and connect to a specific IP? */
-				if (!vpninfo->proxy && host[0]) {
-					char *p = malloc(strlen(host) + 3);
-					if (p) {
-						free(vpninfo->unique_hostname);
-						vpninfo->unique_hostname = p;
-						if (rp->ai_family == AF_INET6)
-							*p++ = '[';
-						memcpy(p, host, strlen(host));
-						p += strlen(host);
-						if (rp->ai_family == AF_INET6)
-							*p++ = ']';
-						*p = 0;
-					}
-				}
-				break;
 			}
-			if (host[0]) {
-				char *errstr;
-#ifdef _WIN32
-				if (err > 0)
-					errstr = openconnect__win32_strerror(err);
-				else
-#endif
-					errstr = strerror(-err);
 
-				vpn_progress(vpninfo, PRG_INFO, _("Failed to connect to %s%s%s:%s: %s\n"),
-					     rp->ai_family == AF_INET6 ? "[" : "",
-					     host,
-					     rp->ai_family == AF_INET6 ? "]" : "",
-					     port, errstr);
-#ifdef _WIN32
-				if (err > 0)
-					free(errstr);
-#endif
+			free(vpninfo->peer_addr);
+			vpninfo->peer_addrlen = 0;
+			vpninfo->peer_addr = malloc(rp->ai_addrlen);
+			if (!vpninfo->peer_addr) {
+				vpn_progress(vpninfo, PRG_ERR,
+					     _("Failed to allocate sockaddr storage\n"));
+				closesocket(ssl_sock);
+				ssl_sock = -ENOMEM;
+				goto out;
 			}
-			closesocket(ssl_sock);
-			ssl_sock = -1;
-
-			/* If we're in DynDNS mode but this *was* the cached IP address,
-			 * don't bother falling back to it if it didn't work. */
-			if (vpninfo->peer_addr && vpninfo->peer_addrlen == rp->ai_addrlen &&
-			    match_sockaddr(vpninfo->peer_addr, rp->ai_addr)) {
-				vpn_progress(vpninfo, PRG_TRACE,
-					     _("Forgetting non-functional previous peer address\n"));
-				free(vpninfo->peer_addr);
-				vpninfo->peer_addr = 0;
-				vpninfo->peer_addrlen = 0;
-				free(vpninfo->ip_info.gateway_addr);
-				vpninfo->ip_info.gateway_addr = NULL;
+			vpninfo->peer_addrlen = rp->ai_addrlen;
+			memcpy(vpninfo->peer_addr, rp->ai_addr, rp->ai_addrlen);
+			/* If no proxy, ensure that we output *this* IP address in
+			 * authentication results because we're going to need to
+			 * reconnect to the *same* server from the rotation. And with
+			 * some trick DNS setups, it might possibly be a "rotation"
+			 * even if we only got one result from getaddrinfo() this
+			 * time.
+			 *
+			 * If there's a proxy, we're kind of screwed; we can't know
+			 * which IP address we connected to. Perhaps we ought to do
+			 * the DNS lookup locally and connect to a specific IP? */
+			if (!vpninfo->proxy && host[0]) {
+				char *p = malloc(strlen(host) + 3);
+				if (p) {
+					free(vpninfo->unique_hostname);
+					vpninfo->unique_hostname = p;
+					if (rp->ai_family == AF_INET6)
+						*p++ = '[';
+					memcpy(p, host, strlen(host));
+					p += strlen(host);
+					if (rp->ai_family == AF_INET6)
+						*p++ = ']';
+					*p = 0;
+				}
 			}
 		}
-		freeaddrinfo(result);
+		if (vpninfo->getaddrinfo_override)
+			freeaddrinfo(result);
 
 		if (ssl_sock < 0) {
 			vpn_progress(vpninfo, PRG_ERR,
@@ -481,6 +909,98 @@ int  __attribute__ ((format (printf, 2, 3)))
 
 }
 
+/* The HTTPS connection has a single read buffer shared by ssl_gets(),
+ * ssl_read() and ssl_nonblock_read(). Header lines are parsed out of it
+ * in place instead of asking the TLS library for one byte at a time,
+ * and whatever is left over when the tunnel starts is handed to the
+ * first ssl_nonblock_read() call. The backends fill it with at most one
+ * TLS record at a time, so the leftover never spans a record boundary
+ * which the tunnel mainloops would not otherwise have seen. */
+int ssl_rbuf_take(struct openconnect_info *vpninfo, void *buf, size_t len)
+{
+	int avail = vpninfo->ssl_rbuf_len - vpninfo->ssl_rbuf_pos;
+
+	if (avail <= 0)
+		return 0;
+
+	if (len > avail)
+		len = avail;
+
+	memcpy(buf, vpninfo->ssl_rbuf + vpninfo->ssl_rbuf_pos, len);
+	vpninfo->ssl_rbuf_pos += len;
+	if (vpninfo->ssl_rbuf_pos == vpninfo->ssl_rbuf_len)
+		vpninfo->ssl_rbuf_pos = vpninfo->ssl_rbuf_len = 0;
+
+	return len;
+}
+
+int ssl_buffered_read(struct openconnect_info *vpninfo, char *buf, size_t len,
+		      ssl_read_fn raw_read)
+{
+	int ret = ssl_rbuf_take(vpninfo, buf, len);
+
+	if (ret)
+		return ret;
+
+	/* Nothing buffered; read straight into the caller's buffer */
+	return raw_read(vpninfo, buf, len);
+}
+
+int ssl_buffered_gets(struct openconnect_info *vpninfo, char *buf, size_t len,
+		      ssl_read_fn raw_read)
+{
+	size_t i = 0;
+	int ret;
+
+	if (len < 2)
+		return -EINVAL;
+
+	if (!vpninfo->ssl_rbuf) {
+		vpninfo->ssl_rbuf = malloc(SSL_RBUF_SIZE);
+		if (!vpninfo->ssl_rbuf)
+			return -ENOMEM;
+		vpninfo->ssl_rbuf_pos = vpninfo->ssl_rbuf_len = 0;
+	}
+
+	while (1) {
+		char *start = vpninfo->ssl_rbuf + vpninfo->ssl_rbuf_pos;
+		size_t avail = vpninfo->ssl_rbuf_len - vpninfo->ssl_rbuf_pos;
+
+		if (avail) {
+			char *nl = memchr(start, '\n', avail);
+			size_t n = nl ? nl - start + 1 : avail;
+
+			if (n > len - 1 - i)
+				n = len - 1 - i;
+
+			memcpy(buf + i, start, n);
+			i += n;
+			vpninfo->ssl_rbuf_pos += n;
+
+			if (buf[i - 1] == '\n') {
+				buf[--i] = 0;
+				if (i && buf[i-1] == '\r')
+					buf[--i] = 0;
+				return i;
+			}
+			if (i >= len - 1) {
+				buf[i] = 0;
+				return i;
+			}
+			continue;
+		}
+
+		vpninfo->ssl_rbuf_pos = vpninfo->ssl_rbuf_len = 0;
+		ret = raw_read(vpninfo, vpninfo->ssl_rbuf, SSL_RBUF_SIZE);
+		if (ret <= 0) {
+			/* EOF in the middle of the HTTP headers is an error */
+			buf[i] = 0;
+			return i ?: (ret ?: -EIO);
+		}
+		vpninfo->ssl_rbuf_len = ret;
+	}
+}
+
 int __attribute__ ((format(printf, 4, 5)))
     request_passphrase(struct openconnect_info *vpninfo, const char *label,
 		       char **response, const char *fmt, ...)
@@ -767,12 +1287,10 @@ void cmd_fd_set(struct openconnect_info *vpninfo, fd_set *fds, int *maxfd)
 	}
 }
 
-void check_cmd_fd(struct openconnect_info *vpninfo, fd_set *fds)
+static void read_cmd_fd(struct openconnect_info *vpninfo)
 {
 	char cmd;
 
-	if (vpninfo->cmd_fd == -1 || !FD_ISSET(vpninfo->cmd_fd, fds))
-		return;
 	if (vpninfo->cmd_fd_write == -1) {
 		/* legacy openconnect_set_cancel_fd() users */
 		vpninfo->got_cancel_cmd = 1;
@@ -801,6 +1319,12 @@ void check_cmd_fd(struct openconnect_info *vpninfo, fd_set *fds)
 	}
 }
 
+void check_cmd_fd(struct openconnect_info *vpninfo, fd_set *fds)
+{
+	if (vpninfo->cmd_fd != -1 && FD_ISSET(vpninfo->cmd_fd, fds))
+		read_cmd_fd(vpninfo);
+}
+
 int is_cancel_pending(struct openconnect_info *vpninfo, fd_set *fds)
 {
 	check_cmd_fd(vpninfo, fds);
@@ -809,11 +1333,12 @@ int is_cancel_pending(struct openconnect_info *vpninfo, fd_set *fds)
 
 void poll_cmd_fd(struct openconnect_info *vpninfo, int timeout)
 {
-	fd_set rd_set;
-	int maxfd = 0;
 	time_t expiration = time(NULL) + timeout, now = 0;
 
 	while (now < expiration && !vpninfo->got_cancel_cmd && !vpninfo->got_pause_cmd) {
+#ifdef _WIN32
+		fd_set rd_set;
+		int maxfd = 0;
 		struct timeval tv;
 
 		now = time(NULL);
@@ -824,6 +1349,18 @@ void poll_cmd_fd(struct openconnect_info *vpninfo, int timeout)
 		cmd_fd_set(vpninfo, &rd_set, &maxfd);
 		select(maxfd + 1, &rd_set, NULL, NULL, &tv);
 		check_cmd_fd(vpninfo, &rd_set);
+#else
+		/* Not select(), since this is called on every pass of the
+		   mainloop and with many sessions in one process, cmd_fd
+		   may well be beyond FD_SETSIZE. poll() ignores fd -1. */
+		struct pollfd pfd;
+
+		now = time(NULL);
+		pfd.fd = vpninfo->cmd_fd;
+		pfd.events = POLLIN;
+		if (poll(&pfd, 1, now >= expiration ? 0 : (expiration - now) * 1000) > 0)
+			read_cmd_fd(vpninfo);
+#endif
 	}
 }
 
@@ -930,9 +1467,185 @@ int udp_sockaddr(struct openconnect_info *vpninfo, int port)
 	return 0;
 }
 
+/* Socket buffer auto-tuning. Every SOCKBUF_TUNE_INTERVAL seconds we
+ * estimate the bandwidth-delay product of the path from the traffic we
+ * have actually carried and the measured RTT, and size the UDP socket
+ * buffers to twice that so a burst from the tun device doesn't just hit
+ * EAGAIN. For the TCP socket the kernel already autotunes SO_SNDBUF and
+ * SO_RCVBUF (and setting them explicitly would disable that), so we only
+ * bound the amount of unsent data with TCP_NOTSENT_LOWAT, which keeps
+ * latency down without starving the pipe. */
+#define SOCKBUF_TUNE_INTERVAL 10
+#define SOCKBUF_MIN_PKTS 32
+#define SOCKBUF_MAX (4 << 20)
+#define NOTSENT_LOWAT_MIN 16384
+
+/* Called when a DTLS DPD request or a set of ESP probes is sent... */
+void udp_rtt_start(struct openconnect_info *vpninfo)
+{
+	gettimeofday(&vpninfo->udp_rtt_probe, NULL);
+}
+
+/* ... and this when the response arrives. */
+void udp_rtt_sample(struct openconnect_info *vpninfo)
+{
+	long rtt;
+
+	if (!vpninfo->udp_rtt_probe.tv_sec)
+		return;
+
+	rtt = ms_since(&vpninfo->udp_rtt_probe);
+	vpninfo->udp_rtt_probe.tv_sec = 0;
+	if (rtt < 0)
+		return;
+	if (!rtt)
+		rtt = 1;
+
+	/* Smooth it the same way TCP does (RFC6298) */
+	if (vpninfo->sock_stats.udp_rtt)
+		vpninfo->sock_stats.udp_rtt = (7 * vpninfo->sock_stats.udp_rtt + rtt) / 8;
+	else
+		vpninfo->sock_stats.udp_rtt = rtt;
+
+	vpn_progress(vpninfo, PRG_DEBUG,
+		     _("UDP round-trip time %ld ms (smoothed %u ms)\n"),
+		     rtt, vpninfo->sock_stats.udp_rtt);
+}
+
+static int udp_sockbuf_size(struct openconnect_info *vpninfo, uint64_t bdp)
+{
+	uint64_t min = (uint64_t)SOCKBUF_MIN_PKTS * (MAX(vpninfo->ip_info.mtu, 1280));
+
+	bdp *= 2;
+	if (bdp < min)
+		bdp = min;
+	if (bdp > SOCKBUF_MAX)
+		bdp = SOCKBUF_MAX;
+	return bdp;
+}
+
+static void set_udp_sockbuf(struct openconnect_info *vpninfo, int fd, int size)
+{
+	socklen_t len;
+	int val;
+
+	setsockopt(fd, SOL_SOCKET, SO_SNDBUF, (void *)&size, sizeof(size));
+	setsockopt(fd, SOL_SOCKET, SO_RCVBUF, (void *)&size, sizeof(size));
+	vpninfo->udp_sockbuf = size;
+
+	/* Record what we actually got; the kernel may round the request
+	 * up, or cap it at its configured maximum. */
+	len = sizeof(val);
+	if (!getsockopt(fd, SOL_SOCKET, SO_SNDBUF, (void *)&val, &len))
+		vpninfo->sock_stats.udp_sndbuf = val;
+	len = sizeof(val);
+	if (!getsockopt(fd, SOL_SOCKET, SO_RCVBUF, (void *)&val, &len))
+		vpninfo->sock_stats.udp_rcvbuf = val;
+}
+
+#ifdef TCP_NOTSENT_LOWAT
+/* Returns the current congestion window of the TCP socket in bytes, which
+ * is the kernel's own estimate of the BDP, and updates sock_stats.tcp_rtt. */
+static uint64_t tcp_cwnd_bytes(struct openconnect_info *vpninfo)
+{
+#if defined(__linux__) && defined(TCP_INFO)
+	struct tcp_info ti;
+	socklen_t len = sizeof(ti);
+
+	if (vpninfo->ssl_fd == -1 ||
+	    getsockopt(vpninfo->ssl_fd, IPPROTO_TCP, TCP_INFO, (void *)&ti, &len))
+		return 0;
+
+	vpninfo->sock_stats.tcp_rtt = ti.tcpi_rtt / 1000 ? : 1;
+	return (uint64_t)ti.tcpi_snd_cwnd * ti.tcpi_snd_mss;
+#else
+	return 0;
+#endif
+}
+
+static void tune_notsent_lowat(struct openconnect_info *vpninfo, uint64_t rate)
+{
+	uint64_t cwnd = tcp_cwnd_bytes(vpninfo);
+	uint64_t lowat;
+	int val;
+
+	/* No TCP_INFO, so no RTT either */
+	if (!cwnd)
+		return;
+
+	lowat = MAX(cwnd, rate * vpninfo->sock_stats.tcp_rtt / 1000);
+	if (lowat < NOTSENT_LOWAT_MIN)
+		lowat = NOTSENT_LOWAT_MIN;
+	if (lowat > SOCKBUF_MAX)
+		lowat = SOCKBUF_MAX;
+	val = lowat;
+
+	if (!setsockopt(vpninfo->ssl_fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT,
+			(void *)&val, sizeof(val)) &&
+	    vpninfo->sock_stats.tcp_notsent_lowat != val) {
+		vpninfo->sock_stats.tcp_notsent_lowat = val;
+		vpn_progress(vpninfo, PRG_DEBUG,
+			     _("TCP RTT %u ms, cwnd %lu bytes; set TCP_NOTSENT_LOWAT to %d\n"),
+			     vpninfo->sock_stats.tcp_rtt, (unsigned long)cwnd, val);
+	}
+}
+#endif /* TCP_NOTSENT_LOWAT */
+
+void tune_socket_buffers(struct openconnect_info *vpninfo)
+{
+	time_t now = time(NULL);
+	uint64_t tx, rx, rate;
+	int interval;
+
+	if (now < vpninfo->sockbuf_last_tune + SOCKBUF_TUNE_INTERVAL)
+		return;
+
+	interval = now - vpninfo->sockbuf_last_tune;
+	tx = vpninfo->stats.tx_bytes - vpninfo->sockbuf_last_tx;
+	rx = vpninfo->stats.rx_bytes - vpninfo->sockbuf_last_rx;
+	vpninfo->sockbuf_last_tx = vpninfo->stats.tx_bytes;
+	vpninfo->sockbuf_last_rx = vpninfo->stats.rx_bytes;
+
+	/* The first call just establishes the baseline for the rate */
+	if (!vpninfo->sockbuf_last_tune) {
+		vpninfo->sockbuf_last_tune = now;
+		return;
+	}
+	vpninfo->sockbuf_last_tune = now;
+
+	rate = (MAX(tx, rx)) / interval;
+
+#ifdef TCP_NOTSENT_LOWAT
+	if (vpninfo->ssl_fd != -1)
+		tune_notsent_lowat(vpninfo, rate);
+#endif
+
+	/* The UDP path may be quite different from the TCP one, so only its
+	 * own RTT counts here; until that's measured, leave it alone. Its
+	 * MTU is the one in ip_info, as DTLS and ESP detection update it. */
+	if (vpninfo->dtls_fd != -1 && vpninfo->sock_stats.udp_rtt) {
+		uint32_t rtt = vpninfo->sock_stats.udp_rtt;
+		int size;
+
+		size = udp_sockbuf_size(vpninfo, rate * rtt / 1000);
+		if (size != vpninfo->udp_sockbuf) {
+			set_udp_sockbuf(vpninfo, vpninfo->dtls_fd, size);
+			vpn_progress(vpninfo, PRG_DEBUG,
+				     _("UDP RTT %u ms, %lu bytes/s; socket buffers now %u/%u bytes (send/receive)\n"),
+				     rtt, (unsigned long)rate,
+				     vpninfo->sock_stats.udp_sndbuf, vpninfo->sock_stats.udp_rcvbuf);
+		}
+	}
+}
+
+const struct oc_socket_stats *openconnect_get_socket_stats(struct openconnect_info *vpninfo)
+{
+	return &vpninfo->sock_stats;
+}
+
 int udp_connect(struct openconnect_info *vpninfo)
 {
-	int fd, sndbuf;
+	int fd;
 
 	fd = socket(vpninfo->peer_addr->sa_family, SOCK_DGRAM, IPPROTO_UDP);
 	if (fd < 0) {
@@ -942,8 +1655,9 @@ int udp_connect(struct openconnect_info *vpninfo)
 	if (vpninfo->protect_socket)
 		vpninfo->protect_socket(vpninfo->cbdata, fd);
 
-	sndbuf = vpninfo->ip_info.mtu * 2;
-	setsockopt(fd, SOL_SOCKET, SO_SNDBUF, (void *)&sndbuf, sizeof(sndbuf));
+	/* Start with whatever we last tuned the buffers to, or the minimum */
+	set_udp_sockbuf(vpninfo, fd, vpninfo->udp_sockbuf ? :
+			udp_sockbuf_size(vpninfo, 0));
 
 	if (vpninfo->dtls_local_port) {
 		union {
@@ -993,48 +1707,262 @@ int udp_connect(struct openconnect_info *vpninfo)
 	return fd;
 }
 
-int ssl_reconnect(struct openconnect_info *vpninfo)
+/* The TLS backends keep the session from the last HTTPS connection so
+ * that ssl_reconnect() can resume it and skip the full handshake. That
+ * is only valid when we're talking to the same server again. */
+int ssl_session_cache_valid(struct openconnect_info *vpninfo)
 {
+	return vpninfo->https_session_host &&
+		vpninfo->https_session_port == vpninfo->port &&
+		!strcasecmp(vpninfo->https_session_host, vpninfo->hostname);
+}
+
+void ssl_session_cache_set_host(struct openconnect_info *vpninfo)
+{
+	if (ssl_session_cache_valid(vpninfo))
+		return;
+
+	free(vpninfo->https_session_host);
+	vpninfo->https_session_host = strdup(vpninfo->hostname);
+	vpninfo->https_session_port = vpninfo->port;
+}
+
+/* Start connecting to the previous peer address in the background. We
+ * can only do that when connect_https_socket() would use it anyway;
+ * otherwise returns -EOPNOTSUPP. */
+static int reconnect_start(struct openconnect_info *vpninfo)
+{
+	int fd, err;
+
+	if (!vpninfo->peer_addr || (vpninfo->is_dyndns && !vpninfo->proxy))
+		return -EOPNOTSUPP;
+
+#ifdef SOCK_CLOEXEC
+	fd = socket(vpninfo->peer_addr->sa_family, SOCK_STREAM | SOCK_CLOEXEC, IPPROTO_IP);
+	if (fd < 0)
+#endif
+	{
+		fd = socket(vpninfo->peer_addr->sa_family, SOCK_STREAM, IPPROTO_IP);
+		if (fd < 0) {
+#ifdef _WIN32
+			return WSAGetLastError();
+#else
+			return -errno;
+#endif
+		}
+		set_fd_cloexec(fd);
+	}
+
+	err = start_connect(vpninfo, fd, vpninfo->peer_addr, vpninfo->peer_addrlen);
+	if (err) {
+		closesocket(fd);
+		return err;
+	}
+
+	vpninfo->reconnect_fd = fd;
+	monitor_fd_new(vpninfo, reconnect);
+	monitor_write_fd(vpninfo, reconnect);
+	return 0;
+}
+
+/* Returns -EAGAIN while the background connect is still in progress */
+static int reconnect_poll(struct openconnect_info *vpninfo)
+{
+	int fd = vpninfo->reconnect_fd;
+#ifdef _WIN32
+	fd_set wr_set, ex_set;
+	struct timeval tv = { 0, 0 };
+
+	FD_ZERO(&wr_set);
+	FD_ZERO(&ex_set);
+	FD_SET(fd, &wr_set);
+	FD_SET(fd, &ex_set);
+	if (select(fd + 1, NULL, &wr_set, &ex_set, &tv) <= 0)
+		return -EAGAIN;
+#else
+	struct pollfd pfd;
+
+	pfd.fd = fd;
+	pfd.events = POLLOUT;
+	pfd.revents = 0;
+	if (poll(&pfd, 1, 0) <= 0)
+		return -EAGAIN;
+#endif
+	return finish_connect(fd);
+}
+
+void ssl_reconnect_abort(struct openconnect_info *vpninfo)
+{
+	if (vpninfo->reconnect_fd != -1) {
+		closesocket(vpninfo->reconnect_fd);
+		vpninfo->reconnect_fd = -1;
+		vpninfo->reconnect_monitored = 0;
+	}
+}
+
+/* Reconnecting is make before break, and driven from the mainloop. The
+ * old connection stays open but idle, while DTLS or ESP carry on. Each
+ * attempt starts connecting to the server (or proxy) in the background,
+ * and only once that TCP connection is up do we close the old one and
+ * redo TLS and the tunnel request on the new socket, synchronously. A
+ * DynDNS server has to be looked up again, so for that the whole
+ * attempt is synchronous. Until it succeeds, this returns -EAGAIN with
+ * the timeout set for the next attempt; then zero, or a negative error
+ * once we've given up. */
+int ssl_reconnect(struct openconnect_info *vpninfo, int *timeout)
+{
+	time_t now = time(NULL);
 	int ret;
-	int timeout;
-	int interval;
 
-	openconnect_close_https(vpninfo, 0);
+	if (!vpninfo->ssl_reconnect_due) {
+		unmonitor_read_fd(vpninfo, ssl);
+		unmonitor_write_fd(vpninfo, ssl);
+		unmonitor_except_fd(vpninfo, ssl);
+		vpninfo->ssl_reconnect_left = vpninfo->reconnect_timeout;
+		vpninfo->ssl_reconnect_cur_interval = vpninfo->reconnect_interval;
+		vpninfo->ssl_reconnect_due = now;
+	}
 
+	if (vpninfo->reconnect_fd != -1) {
+		ret = reconnect_poll(vpninfo);
+		if (ret == -EAGAIN)
+			return ret;
+		if (!ret)
+			goto connect;
+
+		ssl_reconnect_abort(vpninfo);
+		goto failed;
+	}
+
+	if (!ka_check_deadline(timeout, now, vpninfo->ssl_reconnect_due))
+		return -EAGAIN;
 
-	timeout = vpninfo->reconnect_timeout;
-	interval = vpninfo->reconnect_interval;
+	ret = reconnect_start(vpninfo);
+	if (!ret)
+		return -EAGAIN;
+	if (ret != -EOPNOTSUPP)
+		goto failed;
 
+ connect:
+	openconnect_close_https(vpninfo, 0);
+	ret = vpninfo->proto->tcp_connect(vpninfo);
+	/* In case it failed before getting as far as connect_https_socket() */
+	ssl_reconnect_abort(vpninfo);
+	if (!ret)
+		goto connected;
+	goto retry;
+
+ failed:
+	reconnect_error(vpninfo, ret);
+	ret = -EINVAL;
+
+ retry:
+	if (vpninfo->got_cancel_cmd) {
+		ret = -EINTR;
+		goto fail;
+	}
+	if (ret == -EPERM) {
+		vpn_progress(vpninfo, PRG_ERR,
+			     _("Cookie is no longer valid, ending session\n"));
+		goto fail;
+	}
+	if (vpninfo->ssl_reconnect_left <= 0)
+		goto fail;
+
+	vpn_progress(vpninfo, PRG_INFO,
+		     _("Retrying in %ds, remaining timeout %ds\n"),
+		     vpninfo->ssl_reconnect_cur_interval,
+		     vpninfo->ssl_reconnect_left);
+	now = time(NULL);
+	vpninfo->ssl_reconnect_due = now + vpninfo->ssl_reconnect_cur_interval;
+	vpninfo->ssl_reconnect_left -= vpninfo->ssl_reconnect_cur_interval;
+	vpninfo->ssl_reconnect_cur_interval += vpninfo->reconnect_interval;
+	if (vpninfo->ssl_reconnect_cur_interval > RECONNECT_INTERVAL_MAX)
+		vpninfo->ssl_reconnect_cur_interval = RECONNECT_INTERVAL_MAX;
+	ka_check_deadline(timeout, now, vpninfo->ssl_reconnect_due);
+	return -EAGAIN;
+
+ fail:
+	openconnect_close_https(vpninfo, 0);
+	vpninfo->ssl_reconnect_due = 0;
+	return ret;
+
+ connected:
+	vpninfo->ssl_reconnect_due = 0;
+
+	/* The MTU may have changed; let these be reallocated */
 	free(vpninfo->dtls_pkt);
 	vpninfo->dtls_pkt = NULL;
 	free(vpninfo->tun_pkt);
 	vpninfo->tun_pkt = NULL;
 
-	while ((ret = vpninfo->proto->tcp_connect(vpninfo))) {
-		if (timeout <= 0)
-			return ret;
-		if (ret == -EPERM) {
-			vpn_progress(vpninfo, PRG_ERR,
-				     _("Cookie is no longer valid, ending session\n"));
-			return ret;
-		}
-		vpn_progress(vpninfo, PRG_INFO,
-			     _("sleep %ds, remaining timeout %ds\n"),
-			     interval, timeout);
-		poll_cmd_fd(vpninfo, interval);
-		if (vpninfo->got_cancel_cmd)
-			return -EINTR;
-		if (vpninfo->got_pause_cmd)
-			return 0;
-		timeout -= interval;
-		interval += vpninfo->reconnect_interval;
-		if (interval > RECONNECT_INTERVAL_MAX)
-			interval = RECONNECT_INTERVAL_MAX;
-	}
-
 	script_config_tun(vpninfo, "reconnect");
 	if (vpninfo->reconnected)
 		vpninfo->reconnected(vpninfo->cbdata);
 
 	return 0;
 }
+
+/* Each cipher is timed for this long, encrypting records of this size */
+#define BENCH_USECS 2000
+#define BENCH_LEN 16384
+
+static const char * const bench_names[OC_BENCH_MAX] = {
+	[OC_BENCH_AES_128_GCM] = "AES-128-GCM",
+	[OC_BENCH_AES_256_GCM] = "AES-256-GCM",
+	[OC_BENCH_CHACHA20_POLY1305] = "CHACHA20-POLY1305",
+	[OC_BENCH_AES_128_CBC] = "AES-128-CBC",
+	[OC_BENCH_AES_256_CBC] = "AES-256-CBC",
+};
+
+int openconnect_benchmark_ciphers(struct openconnect_info *vpninfo)
+{
+	struct oc_cipher_speed *speeds = vpninfo->cipher_speeds;
+	struct timeval start, now;
+	unsigned char *buf;
+	int i;
+
+	/* Room for the MAC too, for the crypto libraries which append it */
+	buf = calloc(1, BENCH_LEN + 64);
+	if (!buf)
+		return -ENOMEM;
+
+	for (i = 0; i < OC_BENCH_MAX; i++) {
+		long long bytes = 0;
+		long usecs = 0;
+
+		speeds[i].name = bench_names[i];
+		speeds[i].mbps = 0;
+
+		/* An untimed pass, to see if it's supported at all */
+		if (bench_cipher(i, buf, BENCH_LEN, 1))
+			continue;
+
+		gettimeofday(&start, NULL);
+		do {
+			if (bench_cipher(i, buf, BENCH_LEN, 8))
+				break;
+			bytes += 8 * BENCH_LEN;
+
+			gettimeofday(&now, NULL);
+			usecs = (now.tv_sec - start.tv_sec) * 1000000 +
+				now.tv_usec - start.tv_usec;
+		} while (usecs < BENCH_USECS);
+
+		/* Bytes per microsecond is MB/s */
+		if (bytes && usecs > 0)
+			speeds[i].mbps = bytes / usecs;
+	}
+
+	speeds[OC_BENCH_MAX].name = NULL;
+	speeds[OC_BENCH_MAX].mbps = 0;
+
+	free(buf);
+	vpninfo->ciphers_benchmarked = 1;
+	return 0;
+}
+
+const struct oc_cipher_speed *openconnect_get_cipher_speeds(struct openconnect_info *vpninfo)
+{
+	return vpninfo->ciphers_benchmarked ? vpninfo->cipher_speeds : NULL;
+}
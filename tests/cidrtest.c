@@ -0,0 +1,359 @@
+/*
+ * OpenConnect (SSL + DTLS) VPN client
+ *
+ * Copyright © 2008-2015 Intel Corporation.
+ *
+ * Author: David Woodhouse <dwmw2@infradead.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ */
+
+#include <config.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+
+#define __OPENCONNECT_INTERNAL_H__
+
+#define vpn_progress(v, d, ...) printf(__VA_ARGS__)
+#define _(x) x
+
+#include "../openconnect.h"
+
+struct oc_cidr {
+	int family;
+	int plen;
+	unsigned char addr[16];
+};
+
+#include "../cidr.c"
+
+static uint32_t rnd_state = 1;
+
+static uint32_t rnd(void)
+{
+	rnd_state = rnd_state * 1103515245 + 12345;
+	return (rnd_state >> 8) ^ (rnd_state << 13);
+}
+
+static struct oc_split_include *add_route(struct oc_split_include *list,
+					  const char *str)
+{
+	struct oc_split_include *inc = malloc(sizeof(*inc) + strlen(str) + 1);
+
+	if (!inc) {
+		fprintf(stderr, "Out of memory\n");
+		exit(1);
+	}
+	inc->route = strcpy((char *)(inc + 1), str);
+	inc->next = list;
+	return inc;
+}
+
+static struct oc_split_include *add_v4(struct oc_split_include *list,
+				       uint32_t addr, int plen)
+{
+	char buf[32];
+
+	snprintf(buf, sizeof(buf), "%u.%u.%u.%u/%d", addr >> 24,
+		 (addr >> 16) & 255, (addr >> 8) & 255, addr & 255, plen);
+	return add_route(list, buf);
+}
+
+static int nr_routes(struct oc_split_include *list)
+{
+	int nr = 0;
+
+	for (; list; list = list->next)
+		nr++;
+	return nr;
+}
+
+/* Does @list contain exactly the routes in @expected, in any order? */
+static int check_list(const char *what, struct oc_split_include *list,
+		      const char **expected, int nr)
+{
+	struct oc_split_include *inc;
+	int i;
+
+	for (i = 0; i < nr; i++) {
+		for (inc = list; inc; inc = inc->next)
+			if (!strcmp(inc->route, expected[i]))
+				break;
+		if (!inc) {
+			printf("%s: missing %s\n", what, expected[i]);
+			return 1;
+		}
+	}
+	if (nr_routes(list) != nr) {
+		printf("%s: got %d routes, expected %d\n", what,
+		       nr_routes(list), nr);
+		for (inc = list; inc; inc = inc->next)
+			printf("  %s\n", inc->route);
+		return 1;
+	}
+	return 0;
+}
+
+static int check_case(const char *what, const char **in, int nr_in,
+		      const char **ex, int nr_ex, const char **exp_in,
+		      int nr_exp_in, const char **exp_ex, int nr_exp_ex)
+{
+	struct oc_split_include *incs = NULL, *excs = NULL, *res_in, *res_ex;
+	int i, ret;
+
+	for (i = 0; i < nr_in; i++)
+		incs = add_route(incs, in[i]);
+	for (i = 0; i < nr_ex; i++)
+		excs = add_route(excs, ex[i]);
+
+	if (aggregate_split_routes(NULL, incs, excs, &res_in, &res_ex)) {
+		printf("%s: aggregation failed\n", what);
+		return 1;
+	}
+	ret = check_list(what, res_in, exp_in, nr_exp_in) ||
+		check_list(what, res_ex, exp_ex, nr_exp_ex);
+
+	free_split_list(incs);
+	free_split_list(excs);
+	free_split_list(res_in);
+	free_split_list(res_ex);
+	return ret;
+}
+
+/* The leading NULL is just so that an empty list is valid C */
+#define LIST(name, ...)							\
+	static const char *name[] = { NULL, __VA_ARGS__ }
+#define ARGS(name) name + 1, (int)(sizeof(name) / sizeof(name[0])) - 1
+
+#define CASE(what, in, ex, exp_in, exp_ex) do {				\
+		LIST(_in, in);						\
+		LIST(_ex, ex);						\
+		LIST(_exp_in, exp_in);					\
+		LIST(_exp_ex, exp_ex);					\
+		if (check_case(what, ARGS(_in), ARGS(_ex),		\
+			       ARGS(_exp_in), ARGS(_exp_ex)))		\
+			return 1;					\
+	} while (0)
+
+#define L(...) __VA_ARGS__
+
+static int fixed_cases(void)
+{
+	CASE("adjacent", L("10.0.0.0/25", "10.0.0.128/25"), L(),
+	     L("10.0.0.0/24"), L());
+	CASE("overlap", L("10.1.0.0/16", "10.0.0.0/8", "10.1.2.3/32"), L(),
+	     L("10.0.0.0/8"), L());
+	CASE("duplicate", L("10.0.0.0/8", "10.0.0.0/255.0.0.0"), L(),
+	     L("10.0.0.0/8"), L());
+	CASE("host bits", L("10.1.2.3/8"), L(), L("10.0.0.0/8"), L());
+	CASE("subtract", L("10.0.0.0/24"), L("10.0.0.0/25"),
+	     L("10.0.0.128/25"), L());
+	CASE("hole", L("10.0.0.0/30"), L("10.0.0.1/32"),
+	     L("10.0.0.0/32", "10.0.0.2/31"), L());
+	CASE("include in exclude", L("10.0.0.0/8", "10.1.2.0/24"),
+	     L("10.1.0.0/16"),
+	     L("10.0.0.0/16", "10.1.2.0/24", "10.2.0.0/15", "10.4.0.0/14",
+	       "10.8.0.0/13", "10.16.0.0/12", "10.32.0.0/11", "10.64.0.0/10",
+	       "10.128.0.0/9"),
+	     L());
+	CASE("same prefix", L("10.0.0.0/8", "192.168.0.0/16"),
+	     L("10.0.0.0/8"), L("192.168.0.0/16"), L());
+	CASE("longer include", L("10.0.0.0/24"), L("10.0.0.0/16"),
+	     L("10.0.0.0/24"), L());
+	CASE("swallowed", L("10.0.0.0/24"), L("10.0.0.0/25", "10.0.0.128/25"),
+	     L("10.0.0.0/24"), L("10.0.0.0/24"));
+	CASE("excludes only", L(), L("10.0.0.0/9", "10.128.0.0/9", "10.1.0.0/16"),
+	     L(), L("10.0.0.0/8"));
+	CASE("default", L("0.0.0.0/1", "128.0.0.0/1"), L(),
+	     L("0.0.0.0/0"), L());
+	CASE("bad", L("10.0.0.0/33", "fish", "10.0.0.0/", "10.0.0.0/8"), L(),
+	     L("10.0.0.0/8"), L());
+	CASE("ipv6", L("2001:db8::/33", "2001:db8:8000::/33", "2001:db8::1/128"),
+	     L(), L("2001:db8:0:0:0:0:0:0/32"), L());
+	CASE("ipv6 subtract", L("2001:db8::/32"), L("2001:db8::/34"),
+	     L("2001:db8:4000:0:0:0:0:0/34", "2001:db8:8000:0:0:0:0:0/33"), L());
+	CASE("mixed families", L("10.0.0.0/8", "2001:db8::/32"),
+	     L("10.0.0.0/9", "192.168.0.0/16", "2001:db8::/33"),
+	     L("10.128.0.0/9", "2001:db8:8000:0:0:0:0:0/33"), L());
+	CASE("per family", L("10.0.0.0/8"), L("2001:db8::/32", "2001:db9::/32"),
+	     L("10.0.0.0/8"), L("2001:db8:0:0:0:0:0:0/31"));
+	return 0;
+}
+
+/* Every /24 in 10.0.0.0/8 must come back as the /8, and with the lower
+ * half of each excluded, as 65536 /25s. */
+static int large_contiguous(void)
+{
+	struct oc_split_include *incs = NULL, *excs = NULL, *res_in, *res_ex;
+	uint32_t i;
+	int ret = 1;
+
+	for (i = 0; i < 65536; i++)
+		incs = add_v4(incs, 0x0a000000 | (i << 8), 24);
+
+	if (aggregate_split_routes(NULL, incs, NULL, &res_in, &res_ex) ||
+	    res_ex || nr_routes(res_in) != 1 ||
+	    strcmp(res_in->route, "10.0.0.0/8")) {
+		printf("Failed to merge 65536 /24s\n");
+		goto out;
+	}
+	free_split_list(res_in);
+
+	for (i = 0; i < 65536; i++)
+		excs = add_v4(excs, 0x0a000000 | (i << 8), 25);
+
+	if (aggregate_split_routes(NULL, incs, excs, &res_in, &res_ex) ||
+	    res_ex || nr_routes(res_in) != 65536) {
+		printf("Failed to subtract 65536 /25s\n");
+		goto out;
+	}
+	free_split_list(res_in);
+	ret = 0;
+ out:
+	free_split_list(incs);
+	free_split_list(excs);
+	return ret;
+}
+
+struct prefix {
+	uint32_t addr;
+	int plen;
+};
+
+static uint32_t v4_mask(int plen)
+{
+	return plen ? 0xffffffff << (32 - plen) : 0;
+}
+
+/* Longest match wins, and an exclude beats an include of the same length */
+static int brute_force(struct prefix *in, int nr_in, struct prefix *ex,
+		       int nr_ex, uint32_t addr)
+{
+	int i, best_in = -1, best_ex = -1;
+
+	for (i = 0; i < nr_in; i++)
+		if (in[i].plen > best_in &&
+		    !((addr ^ in[i].addr) & v4_mask(in[i].plen)))
+			best_in = in[i].plen;
+	for (i = 0; i < nr_ex; i++)
+		if (ex[i].plen > best_ex &&
+		    !((addr ^ ex[i].addr) & v4_mask(ex[i].plen)))
+			best_ex = ex[i].plen;
+
+	return best_in >= 0 && best_in > best_ex;
+}
+
+#define NR_IN	4000
+#define NR_EX	1000
+#define NR_PROBES 20000
+
+/* Random overlapping prefixes in 10.0.0.0/12, checked against the
+ * obvious longest-match lookup on the original lists. */
+static int large_random(void)
+{
+	static struct prefix in[NR_IN], ex[NR_EX], *res;
+	struct oc_split_include *incs = NULL, *excs = NULL, *res_in, *res_ex, *inc;
+	struct oc_cidr c;
+	int i, j, nr_res, ret = 1;
+
+	for (i = 0; i < NR_IN; i++) {
+		/* Plenty of short ones for overlaps, and long ones for holes */
+		in[i].plen = (i & 1) ? 12 + rnd() % 21 : 24 + rnd() % 9;
+		in[i].addr = (0x0a000000 | (rnd() & 0xfffff)) & v4_mask(in[i].plen);
+		incs = add_v4(incs, in[i].addr, in[i].plen);
+	}
+	for (i = 0; i < NR_EX; i++) {
+		ex[i].plen = 16 + rnd() % 17;
+		ex[i].addr = (0x0a000000 | (rnd() & 0xfffff)) & v4_mask(ex[i].plen);
+		excs = add_v4(excs, ex[i].addr, ex[i].plen);
+	}
+
+	if (aggregate_split_routes(NULL, incs, excs, &res_in, &res_ex) || res_ex) {
+		printf("Failed to aggregate random routes\n");
+		goto out;
+	}
+
+	nr_res = nr_routes(res_in);
+	res = calloc(nr_res, sizeof(*res));
+	if (!res)
+		goto out_res;
+	for (i = 0, inc = res_in; inc; inc = inc->next, i++) {
+		if (parse_cidr(inc->route, &c) || c.family != AF_INET) {
+			printf("Bad result route %s\n", inc->route);
+			goto out_res;
+		}
+		res[i].addr = ntohl(*(uint32_t *)c.addr);
+		res[i].plen = c.plen;
+		if (res[i].addr & ~v4_mask(res[i].plen)) {
+			printf("Result %s has host bits\n", inc->route);
+			goto out_res;
+		}
+	}
+
+	/* Minimal means disjoint, with no pair that could merge */
+	for (i = 0; i < nr_res; i++) {
+		for (j = i + 1; j < nr_res; j++) {
+			int plen = res[i].plen < res[j].plen ? res[i].plen : res[j].plen;
+
+			if (!((res[i].addr ^ res[j].addr) & v4_mask(plen))) {
+				printf("Result routes overlap\n");
+				goto out_res;
+			}
+			if (res[i].plen == res[j].plen &&
+			    (res[i].addr ^ res[j].addr) == (1U << (32 - plen))) {
+				printf("Result routes are mergeable\n");
+				goto out_res;
+			}
+		}
+	}
+
+	for (i = 0; i < NR_PROBES; i++) {
+		uint32_t addr = 0x0a000000 | (rnd() & 0xfffff);
+		int want, got = 0;
+
+		/* Make sure we test the edges too */
+		if (i & 1) {
+			struct prefix *p = (i & 2) ? &in[rnd() % NR_IN] : &ex[rnd() % NR_EX];
+
+			addr = p->addr;
+			if (i & 4)
+				addr |= ~v4_mask(p->plen);
+		}
+		want = brute_force(in, NR_IN, ex, NR_EX, addr);
+		for (j = 0; j < nr_res && !got; j++)
+			got = !((addr ^ res[j].addr) & v4_mask(res[j].plen));
+		if (got != want) {
+			printf("Mismatch for %08x: %d vs. %d\n", addr, got, want);
+			goto out_res;
+		}
+	}
+	ret = 0;
+ out_res:
+	free(res);
+	free_split_list(res_in);
+ out:
+	free_split_list(incs);
+	free_split_list(excs);
+	return ret;
+}
+
+int main(void)
+{
+	if (fixed_cases() || large_contiguous() || large_random())
+		return 1;
+	return 0;
+}
@@ -0,0 +1,366 @@
+/*
+ * OpenConnect (SSL + DTLS) VPN client
+ *
+ * Copyright © 2008-2015 Intel Corporation.
+ *
+ * Author: David Woodhouse <dwmw2@infradead.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/wait.h>
+
+#include "../gnutls-ktls.c"
+
+/* gnutls-ktls.c only needs these for the blocking HTTP paths, which
+   aren't exercised here. */
+void cmd_fd_set(struct openconnect_info *vpninfo, fd_set *fds, int *maxfd)
+{
+}
+
+int is_cancel_pending(struct openconnect_info *vpninfo, fd_set *fds)
+{
+	return 0;
+}
+
+int ssl_buffered_read(struct openconnect_info *vpninfo, char *buf, size_t len,
+		      int (*raw_read)(struct openconnect_info *, char *, size_t))
+{
+	return raw_read(vpninfo, buf, len);
+}
+
+int ssl_buffered_gets(struct openconnect_info *vpninfo, char *buf, size_t len,
+		      int (*raw_read)(struct openconnect_info *, char *, size_t))
+{
+	return -EINVAL;
+}
+
+#ifdef HAVE_KTLS
+
+#define PRIO_BASE "NORMAL:-VERS-ALL:+VERS-TLS1.2:-KX-ALL:+PSK:-CIPHER-ALL:"
+#define NR_MSGS 256
+#define MAX_MSG 20000
+
+static gnutls_datum_t psk_key = { (unsigned char *)"0123456789abcdef", 16 };
+
+static void progress(void *cbdata, int level, const char *fmt, ...)
+{
+	va_list args;
+
+	va_start(args, fmt);
+	vprintf(fmt, args);
+	va_end(args);
+}
+
+static int psk_server_cb(gnutls_session_t session, const char *username,
+			 gnutls_datum_t *key)
+{
+	key->data = gnutls_malloc(psk_key.size);
+	if (!key->data)
+		return -1;
+	memcpy(key->data, psk_key.data, psk_key.size);
+	key->size = psk_key.size;
+	return 0;
+}
+
+/* Plain GnuTLS at the other end, echoing everything back */
+static void run_server(int fd, const char *prio)
+{
+	gnutls_psk_server_credentials_t cred;
+	gnutls_session_t sess;
+	char buf[16384];
+	int ret;
+
+	gnutls_psk_allocate_server_credentials(&cred);
+	gnutls_psk_set_server_credentials_function(cred, psk_server_cb);
+	gnutls_init(&sess, GNUTLS_SERVER);
+	gnutls_priority_set_direct(sess, prio, NULL);
+	gnutls_credentials_set(sess, GNUTLS_CRD_PSK, cred);
+	gnutls_transport_set_int(sess, fd);
+
+	do {
+		ret = gnutls_handshake(sess);
+	} while (ret < 0 && !gnutls_error_is_fatal(ret));
+	if (ret < 0)
+		_exit(1);
+
+	while ((ret = gnutls_record_recv(sess, buf, sizeof(buf))) != 0) {
+		if (ret == GNUTLS_E_AGAIN || ret == GNUTLS_E_INTERRUPTED)
+			continue;
+		if (ret < 0 || gnutls_record_send(sess, buf, ret) != ret)
+			_exit(1);
+	}
+	_exit(0);
+}
+
+static int tcp_pair(int *cfd, int *sfd)
+{
+	struct sockaddr_in sin;
+	socklen_t len = sizeof(sin);
+	int bufsize = 4096;
+	int lfd;
+
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	lfd = socket(AF_INET, SOCK_STREAM, 0);
+	*cfd = socket(AF_INET, SOCK_STREAM, 0);
+	if (lfd < 0 || *cfd < 0)
+		return -1;
+
+	/* Small buffers, so that short writes actually happen */
+	setsockopt(lfd, SOL_SOCKET, SO_RCVBUF, &bufsize, sizeof(bufsize));
+	setsockopt(*cfd, SOL_SOCKET, SO_SNDBUF, &bufsize, sizeof(bufsize));
+	if (bind(lfd, (void *)&sin, sizeof(sin)) ||
+	    getsockname(lfd, (void *)&sin, &len) || listen(lfd, 1))
+		return -1;
+	if (connect(*cfd, (void *)&sin, sizeof(sin)))
+		return -1;
+
+	*sfd = accept(lfd, NULL, NULL);
+	close(lfd);
+	return *sfd < 0 ? -1 : 0;
+}
+
+/* Each message must be accepted whole or not at all, however little
+   room the socket has, and the echo must come back intact in order. */
+static int echo_test(struct openconnect_info *vpninfo, const char *name)
+{
+	unsigned char *out, *in;
+	int out_len = 0, sent = 0, rcvd = 0, tails = 0;
+	int i, ret, result = 1;
+
+	out = malloc(NR_MSGS * MAX_MSG);
+	in = malloc(NR_MSGS * MAX_MSG);
+	srandom(1);
+	for (i = 0; i < NR_MSGS * MAX_MSG; i++)
+		out[i] = random();
+
+	fcntl(vpninfo->ssl_fd, F_SETFL, fcntl(vpninfo->ssl_fd, F_GETFL) | O_NONBLOCK);
+
+	while (rcvd < out_len || sent < NR_MSGS) {
+		struct pollfd pfd = { vpninfo->ssl_fd, POLLIN, 0 };
+		int blocked = 0;
+
+		if (sent < NR_MSGS) {
+			int len = 1 + random() % MAX_MSG;
+
+			ret = ktls_nonblock_send(vpninfo, out + out_len, len);
+			if (ret < 0)
+				break;
+			if (ret) {
+				if (ret != len) {
+					fprintf(stderr, "%s: sent %d of %d\n", name, ret, len);
+					break;
+				}
+				if (vpninfo->ssl_ktls_tail_len)
+					tails++;
+				out_len += len;
+				sent++;
+			} else
+				blocked = 1;
+		}
+
+		if (blocked || vpninfo->ssl_ktls_tail_len)
+			pfd.events |= POLLOUT;
+		poll(&pfd, 1, 1000);
+
+		/* As ssl_nonblock_read() would */
+		if (vpninfo->ssl_ktls_tail_len && ktls_flush_tail(vpninfo) < 0)
+			break;
+		if (rcvd < out_len) {
+			ret = ktls_nonblock_recv(vpninfo, in + rcvd, out_len - rcvd);
+			if (ret < 0)
+				break;
+			rcvd += ret;
+		}
+	}
+
+	if (sent == NR_MSGS && rcvd == out_len && !memcmp(in, out, out_len)) {
+		printf("%s: %d bytes echoed, %d short writes\n", name, rcvd, tails);
+		result = 0;
+	} else
+		fprintf(stderr, "%s: echo mismatch (%d of %d bytes)\n", name, rcvd, out_len);
+
+	free(out);
+	free(in);
+	return result;
+}
+
+/* The send side doesn't care whether the kernel is encrypting, so its
+   handling of short writes can be tested over plain TCP anyway. */
+static int test_plain(void)
+{
+	struct openconnect_info *vpninfo;
+	char buf[16384];
+	int cfd, sfd, ret, status;
+	pid_t pid;
+
+	if (tcp_pair(&cfd, &sfd)) {
+		perror("socket setup");
+		return 1;
+	}
+
+	pid = fork();
+	if (!pid) {
+		close(cfd);
+		while ((ret = read(sfd, buf, sizeof(buf))) > 0)
+			if (write(sfd, buf, ret) != ret)
+				_exit(1);
+		_exit(0);
+	}
+	close(sfd);
+
+	vpninfo = calloc(1, sizeof(*vpninfo));
+	vpninfo->progress = progress;
+	vpninfo->verbose = PRG_DEBUG;
+	vpninfo->ssl_fd = cfd;
+
+	ret = echo_test(vpninfo, "plain TCP");
+
+	close(cfd);
+	waitpid(pid, &status, 0);
+	free(vpninfo->ssl_ktls_tail);
+	free(vpninfo);
+	return ret;
+}
+
+/* Returns 0 on success, 1 on failure or 77 if the kernel can't do it */
+static int test_cipher(const char *cipher, int expect_offload)
+{
+	struct openconnect_info *vpninfo;
+	gnutls_psk_client_credentials_t cred;
+	char prio[256], buf[5];
+	int cfd, sfd, ret, status;
+	int result = 1;
+	pid_t pid;
+
+	snprintf(prio, sizeof(prio), PRIO_BASE "+%s", cipher);
+
+	if (tcp_pair(&cfd, &sfd)) {
+		perror("socket setup");
+		return 1;
+	}
+
+	pid = fork();
+	if (!pid) {
+		close(cfd);
+		run_server(sfd, prio);
+	}
+	close(sfd);
+
+	vpninfo = calloc(1, sizeof(*vpninfo));
+	vpninfo->progress = progress;
+	vpninfo->verbose = PRG_DEBUG;
+	vpninfo->ssl_fd = cfd;
+	vpninfo->cstp_cipher = (char *)cipher;
+
+	gnutls_psk_allocate_client_credentials(&cred);
+	gnutls_psk_set_client_credentials(cred, "test", &psk_key, GNUTLS_PSK_KEY_RAW);
+	gnutls_init(&vpninfo->https_sess, GNUTLS_CLIENT);
+	gnutls_priority_set_direct(vpninfo->https_sess, prio, NULL);
+	gnutls_credentials_set(vpninfo->https_sess, GNUTLS_CRD_PSK, cred);
+	gnutls_transport_set_int(vpninfo->https_sess, cfd);
+	do {
+		ret = gnutls_handshake(vpninfo->https_sess);
+	} while (ret < 0 && !gnutls_error_is_fatal(ret));
+	if (ret < 0) {
+		fprintf(stderr, "%s: handshake failed: %s\n", cipher, gnutls_strerror(ret));
+		goto out;
+	}
+
+	ret = ssl_ktls_offload(vpninfo, 1);
+	if (!expect_offload) {
+		/* The fallback must leave a working GnuTLS session behind */
+		if (ret != -EOPNOTSUPP || vpninfo->ssl_ktls) {
+			fprintf(stderr, "%s: expected -EOPNOTSUPP, got %d\n", cipher, ret);
+			goto out;
+		}
+		if (gnutls_record_send(vpninfo->https_sess, "hello", 5) != 5 ||
+		    gnutls_record_recv(vpninfo->https_sess, buf, sizeof(buf)) != 5 ||
+		    memcmp(buf, "hello", 5)) {
+			fprintf(stderr, "%s: no round trip after fallback\n", cipher);
+			goto out;
+		}
+		result = 0;
+		goto out;
+	}
+	if (ret) {
+		printf("%s: no kernel TLS offload; skipping\n", cipher);
+		result = 77;
+		goto out;
+	}
+	if (vpninfo->ssl_ktls != (KTLS_TX | KTLS_RX)) {
+		fprintf(stderr, "%s: offload gave %d\n", cipher, vpninfo->ssl_ktls);
+		goto out;
+	}
+
+	result = echo_test(vpninfo, cipher);
+
+ out:
+	close(cfd);
+	waitpid(pid, &status, 0);
+	gnutls_deinit(vpninfo->https_sess);
+	gnutls_psk_free_client_credentials(cred);
+	free(vpninfo->ssl_ktls_tail);
+	free(vpninfo);
+	return result;
+}
+
+int main(void)
+{
+	int ret;
+
+	signal(SIGPIPE, SIG_IGN);
+
+	if (test_plain())
+		return 1;
+
+	/* Not something the kernel does, so this must fall back */
+	if (test_cipher("AES-128-CBC", 0))
+		return 1;
+
+	ret = test_cipher("AES-128-GCM", 1);
+	if (ret == 77)
+		return 77;
+	if (ret)
+		return 1;
+
+	/* The kernel may do AES-GCM but not these */
+	if (test_cipher("AES-256-GCM", 1) == 1)
+		return 1;
+#ifdef TLS_CIPHER_CHACHA20_POLY1305
+	if (test_cipher("CHACHA20-POLY1305", 1) == 1)
+		return 1;
+#endif
+
+	return 0;
+}
+
+#else /* !HAVE_KTLS */
+
+int main(void)
+{
+	printf("Kernel TLS not supported by this build; skipping\n");
+	return 77;
+}
+
+#endif /* HAVE_KTLS */
@@ -0,0 +1,428 @@
+/*
+ * OpenConnect (SSL + DTLS) VPN client
+ *
+ * Copyright © 2008-2015 Intel Corporation.
+ *
+ * Author: David Woodhouse <dwmw2@infradead.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ */
+
+#include "../lzo.c"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <sys/time.h>
+
+#define NR_PKTS 4096
+#define MAX_PKT 65536
+
+#define NR_BENCH_PKTS 4096
+#define BENCH_PKT 1400
+
+/* Guard bytes after the output padding, which must never be touched */
+#define GUARD 16
+
+static unsigned char pktbuf[MAX_PKT];
+static unsigned char comprbuf[MAX_PKT * 2 + 16 + AV_LZO_INPUT_PADDING];
+static unsigned char uncomprbuf[MAX_PKT + AV_LZO_OUTPUT_PADDING + GUARD];
+static struct lzo_state *state;
+
+/*
+ * The real compressor only uses a few of the encodings, so here's a
+ * simple greedy one for testing the decoder. It isn't meant to compress
+ * well; it's meant to use every encoding that the decoder has to handle,
+ * choosing between them at random where more than one would do.
+ */
+enum {
+	ST_MATCH,	/* After a match with no trailing literals, or at the start */
+	ST_SHORT,	/* After a match with 1-3 trailing literals */
+	ST_RUN,		/* After a run of 4 or more literals */
+	ST_FIRST,	/* After the initial literal run */
+};
+
+struct lzo_enc {
+	unsigned char *out;
+	int outpos;
+	int state;
+	int nn_pos;	/* Where the last match keeps its trailing literal count */
+};
+
+static void put_len(struct lzo_enc *e, int cnt, int mask)
+{
+	/* The caller has already emitted the opcode with zero in 'mask' */
+	cnt -= mask;
+	while (cnt > 255) {
+		e->out[e->outpos++] = 0;
+		cnt -= 255;
+	}
+	e->out[e->outpos++] = cnt;
+}
+
+static void put_literals(struct lzo_enc *e, const unsigned char *lit, int len)
+{
+	if (!len)
+		return;
+
+	if (!e->outpos && len <= 238) {
+		e->out[e->outpos++] = 17 + len;
+		e->state = ST_FIRST;
+	} else if (e->outpos && e->state == ST_MATCH && len <= 3) {
+		e->out[e->nn_pos] |= len;
+		e->state = ST_SHORT;
+	} else {
+		/* Only allowed at the start or after a match with no
+		 * literals, and the caller makes sure len >= 4 */
+		if (len - 3 <= 15)
+			e->out[e->outpos++] = len - 3;
+		else {
+			e->out[e->outpos++] = 0;
+			put_len(e, len - 3, 15);
+		}
+		e->state = ST_RUN;
+	}
+	memcpy(e->out + e->outpos, lit, len);
+	e->outpos += len;
+}
+
+static void put_match(struct lzo_enc *e, int len, int back)
+{
+	if (e->state == ST_SHORT && len == 2) {
+		/* 0000bbnn BBBBBBBB, back <= 1024 */
+		e->nn_pos = e->outpos;
+		e->out[e->outpos++] = ((back - 1) & 3) << 2;
+		e->out[e->outpos++] = (back - 1) >> 2;
+	} else if (e->state == ST_RUN && len == 3 && back > 2048 && back <= 3072) {
+		/* 0000bbnn BBBBBBBB, after a literal run */
+		e->nn_pos = e->outpos;
+		e->out[e->outpos++] = ((back - 2049) & 3) << 2;
+		e->out[e->outpos++] = (back - 2049) >> 2;
+	} else if (len <= 8 && back <= 2048 && (rand() & 3)) {
+		/* cccbbbnn BBBBBBBB */
+		e->nn_pos = e->outpos;
+		e->out[e->outpos++] = ((len - 1) << 5) | (((back - 1) & 7) << 2);
+		e->out[e->outpos++] = (back - 1) >> 3;
+	} else if (back <= 16384) {
+		/* 001ccccc (cccccccc...) bbbbbbnn BBBBBBBB */
+		if (len - 2 <= 31)
+			e->out[e->outpos++] = 0x20 | (len - 2);
+		else {
+			e->out[e->outpos++] = 0x20;
+			put_len(e, len - 2, 31);
+		}
+		e->nn_pos = e->outpos;
+		e->out[e->outpos++] = ((back - 1) & 63) << 2;
+		e->out[e->outpos++] = (back - 1) >> 6;
+	} else {
+		/* 0001bccc (cccccccc...) bbbbbbnn BBBBBBBB */
+		int b = back - 16384;
+		int hi = 0;
+
+		if (b >= 16384) {
+			hi = 8;
+			b -= 16384;
+		}
+		if (len - 2 <= 7)
+			e->out[e->outpos++] = 0x10 | hi | (len - 2);
+		else {
+			e->out[e->outpos++] = 0x10 | hi;
+			put_len(e, len - 2, 7);
+		}
+		e->nn_pos = e->outpos;
+		e->out[e->outpos++] = (b & 63) << 2;
+		e->out[e->outpos++] = b >> 6;
+	}
+	e->state = ST_MATCH;
+}
+
+#define HASH_BITS 14
+#define MAX_BACK 49151
+
+static int lzo_test_compress(unsigned char *out, const unsigned char *in, int len)
+{
+	static int last3[1 << HASH_BITS], last2[1 << 16];
+	struct lzo_enc e = { out, 0, ST_MATCH, 0 };
+	int ip = 0, lit = 0;
+	int max_len = (rand() & 1) ? 300 : 8 + rand() % 40;
+
+	memset(last3, 0xff, sizeof(last3));
+	memset(last2, 0xff, sizeof(last2));
+
+	while (ip + 3 <= len) {
+		uint32_t h = ((in[ip] << 16 | in[ip + 1] << 8 | in[ip + 2]) * 2654435761U) >> (32 - HASH_BITS);
+		int h2 = in[ip] << 8 | in[ip + 1];
+		int cand = last3[h], mlen = 0, back = 0;
+
+		if (cand >= 0 && ip - cand <= MAX_BACK) {
+			while (mlen < max_len && ip + mlen < len &&
+			       in[cand + mlen] == in[ip + mlen])
+				mlen++;
+			back = ip - cand;
+		}
+
+		/* Two-byte matches can only follow a match with 1-3 trailing
+		 * literals, which is what these literals will become. */
+		if (mlen < 3 && e.outpos && lit >= 1 && lit <= 3 &&
+		    last2[h2] >= 0 && ip - last2[h2] <= 1024) {
+			mlen = 2;
+			back = ip - last2[h2];
+		}
+		last3[h] = ip;
+		last2[h2] = ip;
+
+		if (mlen < 2) {
+			ip++;
+			lit++;
+			continue;
+		}
+		put_literals(&e, in + ip - lit, lit);
+		put_match(&e, mlen, back);
+		ip += mlen;
+		lit = 0;
+	}
+	lit += len - ip;
+	put_literals(&e, in + len - lit, lit);
+
+	/* End of stream marker */
+	e.out[e.outpos++] = 0x11;
+	e.out[e.outpos++] = 0;
+	e.out[e.outpos++] = 0;
+	return e.outpos;
+}
+
+/* Something vaguely like the text and headers that actually compress
+ * in real traffic: runs copied from earlier in the packet, with the odd
+ * random byte thrown in. */
+static void fill_compressible(unsigned char *buf, int len)
+{
+	int i = 0;
+
+	while (i < len) {
+		if (i < 16 || !(rand() % 4)) {
+			buf[i++] = 'a' + rand() % 26;
+		} else {
+			int ofs = 1 + rand() % (i < MAX_BACK ? i : MAX_BACK);
+			int n = 2 + rand() % 64;
+
+			if (rand() & 1)
+				ofs = 1 + rand() % (i < 32 ? i : 32);
+			while (n-- && i < len) {
+				buf[i] = buf[i - ofs];
+				i++;
+			}
+		}
+	}
+}
+
+static int roundtrip(int i, int pktlen)
+{
+	int clen, inlen, outlen, ret, size;
+
+	clen = lzo_test_compress(comprbuf, pktbuf, pktlen);
+
+	memset(uncomprbuf, 0x5a, sizeof(uncomprbuf));
+	inlen = clen;
+	outlen = pktlen;
+	ret = av_lzo1x_decode(uncomprbuf, &outlen, comprbuf, &inlen);
+	if (ret || inlen || outlen) {
+		fprintf(stderr, "Decompressing packet %d failed: %d (in %d, out %d left)\n",
+			i, ret, inlen, outlen);
+		return -1;
+	}
+	if (memcmp(uncomprbuf, pktbuf, pktlen)) {
+		fprintf(stderr, "Comparing packet %d failed\n", i);
+		return -1;
+	}
+
+	/* Now with too small an output buffer, which must be reported and
+	 * must not be overrun by more than the permitted padding. */
+	if (pktlen > 1) {
+		memset(uncomprbuf, 0x5a, sizeof(uncomprbuf));
+		inlen = clen;
+		outlen = size = rand() % pktlen;
+		ret = av_lzo1x_decode(uncomprbuf, &outlen, comprbuf, &inlen);
+		if (!(ret & AV_LZO_OUTPUT_FULL)) {
+			fprintf(stderr, "Truncated output of packet %d not detected: %d\n",
+				i, ret);
+			return -1;
+		}
+		for (ret = 0; ret < GUARD; ret++) {
+			if (uncomprbuf[size + AV_LZO_OUTPUT_PADDING + ret] != 0x5a) {
+				fprintf(stderr, "Output padding of packet %d overrun\n", i);
+				return -1;
+			}
+		}
+	}
+
+	/* And with the input cut short, which must be reported too. The
+	 * input padding means the decoder may read past the end. */
+	if (clen > 3) {
+		inlen = rand() % (clen - 3);
+		outlen = pktlen;
+		if (!av_lzo1x_decode(uncomprbuf, &outlen, comprbuf, &inlen)) {
+			fprintf(stderr, "Truncated input of packet %d not detected\n", i);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/* And through the real compressor, which must either produce something
+ * that decodes to the original or refuse because it didn't fit. */
+static int roundtrip_compress(int i, int pktlen)
+{
+	int clen, inlen, outlen, ret;
+
+	clen = lzo1x_compress(state, comprbuf, sizeof(comprbuf) - AV_LZO_INPUT_PADDING,
+			      pktbuf, pktlen);
+	if (clen < 0) {
+		fprintf(stderr, "Compressing packet %d failed: %d\n", i, clen);
+		return -1;
+	}
+
+	inlen = clen;
+	outlen = pktlen;
+	ret = av_lzo1x_decode(uncomprbuf, &outlen, comprbuf, &inlen);
+	if (ret || inlen || outlen) {
+		fprintf(stderr, "Decompressing compressed packet %d failed: %d (in %d, out %d left)\n",
+			i, ret, inlen, outlen);
+		return -1;
+	}
+	if (memcmp(uncomprbuf, pktbuf, pktlen)) {
+		fprintf(stderr, "Comparing compressed packet %d failed\n", i);
+		return -1;
+	}
+
+	/* Any smaller output buffer must be refused, not overrun */
+	if (clen > 1) {
+		int size = rand() % clen;
+
+		memset(comprbuf, 0x5a, sizeof(comprbuf));
+		if (lzo1x_compress(state, comprbuf, size, pktbuf, pktlen) != -EFBIG) {
+			fprintf(stderr, "Compressing packet %d into %d bytes didn't fail\n",
+				i, size);
+			return -1;
+		}
+		for (ret = size; ret < sizeof(comprbuf); ret++) {
+			if (comprbuf[ret] != 0x5a) {
+				fprintf(stderr, "Compressing packet %d overran %d bytes\n",
+					i, size);
+				return -1;
+			}
+		}
+	}
+	return 0;
+}
+
+static void benchmark(void)
+{
+	static unsigned char bench_pkts[NR_BENCH_PKTS][BENCH_PKT];
+	static unsigned char bench_compr[NR_BENCH_PKTS][BENCH_PKT * 2];
+	static int bench_len[NR_BENCH_PKTS];
+	struct timeval start, end;
+	long long in = 0, out = 0;
+	long usecs;
+	int i, j;
+
+	for (i = 0; i < NR_BENCH_PKTS; i++) {
+		fill_compressible(bench_pkts[i], BENCH_PKT);
+		bench_len[i] = lzo_test_compress(bench_compr[i], bench_pkts[i], BENCH_PKT);
+	}
+
+	gettimeofday(&start, NULL);
+	for (j = 0; j < 16; j++) {
+		for (i = 0; i < NR_BENCH_PKTS; i++) {
+			int inlen = bench_len[i], outlen = BENCH_PKT;
+
+			if (av_lzo1x_decode(uncomprbuf, &outlen, bench_compr[i], &inlen)) {
+				fprintf(stderr, "Benchmark decompression failed\n");
+				exit(1);
+			}
+			in += bench_len[i];
+			out += BENCH_PKT;
+		}
+	}
+	gettimeofday(&end, NULL);
+
+	usecs = (end.tv_sec - start.tv_sec) * 1000000 +
+		end.tv_usec - start.tv_usec;
+	printf("LZO decompress: %lld -> %lld bytes, %.1f MB/s\n",
+	       in, out, usecs ? (double)out / usecs : 0.0);
+
+	in = out = 0;
+	gettimeofday(&start, NULL);
+	for (j = 0; j < 16; j++) {
+		for (i = 0; i < NR_BENCH_PKTS; i++) {
+			int ret = lzo1x_compress(state, comprbuf, BENCH_PKT,
+						 bench_pkts[i], BENCH_PKT);
+			if (ret < 0) {
+				fprintf(stderr, "Benchmark compression failed\n");
+				exit(1);
+			}
+			in += BENCH_PKT;
+			out += ret;
+		}
+	}
+	gettimeofday(&end, NULL);
+
+	usecs = (end.tv_sec - start.tv_sec) * 1000000 +
+		end.tv_usec - start.tv_usec;
+	printf("LZO compress: %lld -> %lld bytes (%.1f%%), %.1f MB/s\n",
+	       in, out, 100.0 * out / in, usecs ? (double)in / usecs : 0.0);
+}
+
+int main(void)
+{
+	int i, j;
+	int pktlen;
+
+	srand(0xdeadbeef);
+
+	state = lzo_alloc_state();
+	if (!state) {
+		fprintf(stderr, "Failed to allocate LZO state\n");
+		exit(1);
+	}
+
+	for (i = 0; i < NR_PKTS; i++) {
+		if (!i)
+			pktlen = MAX_PKT;
+		else if (i & 3)
+			pktlen = (rand() % 2048) + 1;
+		else
+			pktlen = (rand() % MAX_PKT) + 1;
+
+		if (i % 8 == 1) {
+			for (j = 0; j < pktlen; j++)
+				pktbuf[j] = rand();
+		} else
+			fill_compressible(pktbuf, pktlen);
+
+		if (roundtrip(i, pktlen) || roundtrip_compress(i, pktlen))
+			exit(1);
+	}
+
+	/* Entries left in the hash table from earlier packets must be
+	 * ignored, including when the base wraps around. */
+	state->base = -4 * LZO_MAX_INPUT;
+	for (i = 0; i < 8; i++) {
+		pktlen = (rand() % MAX_PKT) + 1;
+		fill_compressible(pktbuf, pktlen);
+
+		if (roundtrip_compress(i, pktlen))
+			exit(1);
+	}
+
+	benchmark();
+
+	return 0;
+}
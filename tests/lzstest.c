@@ -21,8 +21,12 @@ struct oc_packed_uint16_t {
 	unsigned short d;
 } __attribute__((packed));
 
+#include "../openconnect.h"
+
 int lzs_decompress(unsigned char *dst, int dstlen, const unsigned char *src, int srclen);
-int lzs_compress(unsigned char *dst, int dstlen, const unsigned char *src, int srclen);
+struct lzs_state *lzs_alloc_state(void);
+int lzs_compress(struct lzs_state *state, unsigned char *dst, int dstlen,
+		 const unsigned char *src, int srclen, int level);
 
 #include "../lzs.c"
 
@@ -30,20 +34,120 @@ int lzs_compress(unsigned char *dst, int dstlen, const unsigned char *src, int s
 #include <stdlib.h>
 #include <errno.h>
 #include <string.h>
+#include <sys/time.h>
 
 #define NR_PKTS 2048
+#define NR_LEVEL_PKTS 256
 #define MAX_PKT 65536
 
+#define NR_BENCH_PKTS 4096
+#define BENCH_PKT 1400
+
+static const char *level_names[] = {
+	[OC_COMPRESSION_LEVEL_DEFAULT] = "default",
+	[OC_COMPRESSION_LEVEL_FAST] = "fast",
+	[OC_COMPRESSION_LEVEL_MAX] = "max",
+};
+
+static unsigned char pktbuf[MAX_PKT + 3];
+static unsigned char comprbuf[MAX_PKT * 9 / 8 + 2];
+static unsigned char uncomprbuf[MAX_PKT];
+static struct lzs_state *state;
+
+/* Something vaguely like the text and headers that actually compress
+ * in real traffic: runs copied from earlier in the packet, with the odd
+ * random byte thrown in. */
+static void fill_compressible(unsigned char *buf, int len)
+{
+	int i = 0;
+
+	while (i < len) {
+		if (i < 16 || !(rand() % 4)) {
+			buf[i++] = 'a' + rand() % 26;
+		} else {
+			int ofs = 1 + rand() % (i < 2047 ? i : 2047);
+			int n = 2 + rand() % 24;
+
+			while (n-- && i < len) {
+				buf[i] = buf[i - ofs];
+				i++;
+			}
+		}
+	}
+}
+
+static int roundtrip(int i, int level, int pktlen)
+{
+	int ret;
+
+	ret = lzs_compress(state, comprbuf, sizeof(comprbuf), pktbuf, pktlen, level);
+	if (ret < 0) {
+		fprintf(stderr, "Compressing packet %d at level %s failed: %s\n",
+			i, level_names[level], strerror(-ret));
+		return -1;
+	}
+	ret = lzs_decompress(uncomprbuf, pktlen, comprbuf, sizeof(comprbuf));
+	if (ret != pktlen) {
+		fprintf(stderr, "Compressing packet %d at level %s failed\n",
+			i, level_names[level]);
+		return -1;
+	}
+	if (memcmp(uncomprbuf, pktbuf, pktlen)) {
+		fprintf(stderr, "Comparing packet %d at level %s failed\n",
+			i, level_names[level]);
+		return -1;
+	}
+	return 0;
+}
+
+static void benchmark(void)
+{
+	static unsigned char bench_pkts[NR_BENCH_PKTS][BENCH_PKT];
+	struct timeval start, end;
+	int i, level;
+
+	for (i = 0; i < NR_BENCH_PKTS; i++)
+		fill_compressible(bench_pkts[i], BENCH_PKT);
+
+	for (level = 0; level < 3; level++) {
+		long long in = 0, out = 0;
+		long usecs;
+
+		gettimeofday(&start, NULL);
+		for (i = 0; i < NR_BENCH_PKTS; i++) {
+			int ret = lzs_compress(state, comprbuf, sizeof(comprbuf), bench_pkts[i],
+					       BENCH_PKT, level);
+			if (ret < 0) {
+				fprintf(stderr, "Benchmark compression failed: %s\n",
+					strerror(-ret));
+				exit(1);
+			}
+			in += BENCH_PKT;
+			out += ret;
+		}
+		gettimeofday(&end, NULL);
+
+		usecs = (end.tv_sec - start.tv_sec) * 1000000 +
+			end.tv_usec - start.tv_usec;
+		printf("LZS level %-7s: %lld -> %lld bytes (%.1f%%), %.1f MB/s\n",
+		       level_names[level], in, out, 100.0 * out / in,
+		       usecs ? (double)in / usecs : 0.0);
+	}
+}
+
 int main(void)
 {
-	int i, j, ret;
+	int i, j, level;
 	int pktlen;
-	unsigned char pktbuf[MAX_PKT + 3];
-	unsigned char comprbuf[MAX_PKT * 9 / 8 + 2];
-	unsigned char uncomprbuf[MAX_PKT];
 
 	srand(0xdeadbeef);
 
+	state = lzs_alloc_state();
+	if (!state) {
+		fprintf(stderr, "Failed to allocate LZS state\n");
+		exit(1);
+	}
+
 	for (i = 0; i < NR_PKTS; i++) {
 		if (i)
 			pktlen = (rand() % MAX_PKT) + 1;
@@ -53,21 +157,38 @@ int main(void)
 		for (j = 0; j < pktlen; j++)
 			pktbuf[j] = rand();
 
-		ret = lzs_compress(comprbuf, sizeof(comprbuf), pktbuf, pktlen);
-		if (ret < 0) {
-			fprintf(stderr, "Compressing packet %d failed: %s\n", i, strerror(-ret));
-			exit(1);
-		}
-		ret = lzs_decompress(uncomprbuf, pktlen, comprbuf, sizeof(comprbuf));
-		if (ret != pktlen) {
-			fprintf(stderr, "Compressing packet %d failed\n", i);
+		if (roundtrip(i, OC_COMPRESSION_LEVEL_DEFAULT, pktlen))
 			exit(1);
+	}
+
+	/* The other levels, with both random and compressible data */
+	for (level = 0; level < 3; level++) {
+		for (i = 0; i < NR_LEVEL_PKTS; i++) {
+			pktlen = (rand() % MAX_PKT) + 1;
+
+			if (i & 1) {
+				for (j = 0; j < pktlen; j++)
+					pktbuf[j] = rand();
+			} else
+				fill_compressible(pktbuf, pktlen);
+
+			if (roundtrip(i, level, pktlen))
+				exit(1);
 		}
-		if (memcmp(uncomprbuf, pktbuf, pktlen)) {
-			fprintf(stderr, "Comparing packet %d failed\n", i);
+	}
+
+	/* Entries left in the hash table from earlier packets must be
+	 * ignored, including when the base wraps around. */
+	state->base = -4 * (INVALID_OFS + 1);
+	for (i = 0; i < 8; i++) {
+		pktlen = (rand() % MAX_PKT) + 1;
+		fill_compressible(pktbuf, pktlen);
+
+		if (roundtrip(i, OC_COMPRESSION_LEVEL_DEFAULT, pktlen))
 			exit(1);
-		}
 	}
 
+	benchmark();
+
 	return 0;
 }
@@ -0,0 +1,366 @@
+/*
+ * OpenConnect (SSL + DTLS) VPN client
+ *
+ * Copyright © 2008-2015 Intel Corporation.
+ *
+ * Author: David Woodhouse <dwmw2@infradead.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ */
+
+#include <config.h>
+
+#include "openconnect-internal.h"
+
+#ifdef HAVE_TUN_RING
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/eventfd.h>
+#include <sys/epoll.h>
+#include <poll.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+/*
+ * The shared-memory alternative to the socketpair for --script-tun. See
+ * struct oc_ring_header in openconnect.h for the protocol. Packets are
+ * still copied once in each direction, but there is no syscall per
+ * packet; only when one side has to wake the other.
+ */
+
+#define RING_SLOTS	256
+#define RING_SLOT_SIZE	2048
+
+struct tun_ring {
+	struct oc_ring_header *hdr;
+	size_t map_size;
+	/* Our own copies; the script can scribble on the header */
+	uint32_t nr_slots, slot_size;
+	struct oc_ring_queue *to_peer, *from_peer;
+	int memfd;
+	int wait_fd;	/* We read this one */
+	int kick_fd;	/* and the script reads this one */
+	int sock_fd;	/* The original socketpair */
+	int gone_fd;	/* Hangs up when the script exits */
+	int gone_wfd;	/* which holds this end of the pipe */
+	int epoll_fd;	/* wait_fd and gone_fd, as the tun fd */
+	int active;
+	int broken;	/* The script corrupted the ring indices */
+};
+
+static unsigned char *ring_slot(struct tun_ring *r, struct oc_ring_queue *q,
+				uint32_t idx)
+{
+	return (unsigned char *)(q + 1) + (idx & (r->nr_slots - 1)) * r->slot_size;
+}
+
+static void ring_kick(int fd)
+{
+	uint64_t one = 1;
+
+	/* Can only fail if the counter is about to overflow, in which
+	 * case it's readable already. */
+	if (write(fd, &one, sizeof(one)) < 0)
+		return;
+}
+
+/* The write end of the pipe is only held by the script, so this works
+ * even though a datagram socketpair never reports the peer closing. */
+static int ring_peer_gone(struct tun_ring *r)
+{
+	struct pollfd pfd;
+
+	pfd.fd = r->gone_fd;
+	pfd.events = POLLIN;
+	pfd.revents = 0;
+
+	return poll(&pfd, 1, 0) > 0;
+}
+
+int tun_ring_setup(struct openconnect_info *vpninfo)
+{
+	struct tun_ring *r;
+	uint32_t slot_size = RING_SLOT_SIZE;
+	size_t qsize;
+	int gone[2];
+
+	if (vpninfo->ip_info.mtu + 4 > slot_size)
+		slot_size = (vpninfo->ip_info.mtu + 4 + 63) & ~63;
+
+	r = calloc(1, sizeof(*r));
+	if (!r)
+		return -ENOMEM;
+	r->wait_fd = r->kick_fd = r->sock_fd = -1;
+	r->gone_fd = r->gone_wfd = r->epoll_fd = -1;
+	r->nr_slots = RING_SLOTS;
+	r->slot_size = slot_size;
+
+	qsize = sizeof(struct oc_ring_queue) + r->nr_slots * r->slot_size;
+	r->map_size = 64 + 2 * qsize;
+
+	r->memfd = memfd_create("openconnect-ring", 0);
+	if (r->memfd < 0 || ftruncate(r->memfd, r->map_size))
+		goto err;
+
+	r->hdr = mmap(NULL, r->map_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+		      r->memfd, 0);
+	if (r->hdr == MAP_FAILED) {
+		r->hdr = NULL;
+		goto err;
+	}
+
+	r->wait_fd = eventfd(0, EFD_NONBLOCK);
+	r->kick_fd = eventfd(0, EFD_NONBLOCK);
+	if (r->wait_fd < 0 || r->kick_fd < 0)
+		goto err;
+
+	if (pipe(gone))
+		goto err;
+	r->gone_fd = gone[0];
+	r->gone_wfd = gone[1];
+
+	r->hdr->magic = OC_RING_MAGIC;
+	r->hdr->version = OC_RING_VERSION;
+	r->hdr->nr_slots = r->nr_slots;
+	r->hdr->slot_size = r->slot_size;
+	r->hdr->to_peer = 64;
+	r->hdr->from_peer = 64 + qsize;
+	r->to_peer = (void *)((char *)r->hdr + r->hdr->to_peer);
+	r->from_peer = (void *)((char *)r->hdr + r->hdr->from_peer);
+
+	vpninfo->tun_ring = r;
+	return 0;
+
+ err:
+	vpn_progress(vpninfo, PRG_DEBUG,
+		     _("Failed to set up shared-memory ring: %s\n"),
+		     strerror(errno));
+	vpninfo->tun_ring = r;
+	tun_ring_free(vpninfo);
+	return -EIO;
+}
+
+/* In the child, before running the script */
+void tun_ring_setenv(struct openconnect_info *vpninfo)
+{
+	struct tun_ring *r = vpninfo->tun_ring;
+
+	script_setenv_int(vpninfo, "VPNFD_RING", r->memfd);
+	script_setenv_int(vpninfo, "VPNFD_RING_WAIT", r->kick_fd);
+	script_setenv_int(vpninfo, "VPNFD_RING_KICK", r->wait_fd);
+	close(r->gone_fd);
+}
+
+/* In the parent, once the script has its copies */
+void tun_ring_forked(struct openconnect_info *vpninfo, int sock_fd)
+{
+	struct tun_ring *r = vpninfo->tun_ring;
+
+	close(r->memfd);
+	r->memfd = -1;
+	r->sock_fd = sock_fd;
+	close(r->gone_wfd);
+	r->gone_wfd = -1;
+	set_fd_cloexec(r->wait_fd);
+	set_fd_cloexec(r->kick_fd);
+	set_fd_cloexec(r->gone_fd);
+}
+
+int tun_ring_active(struct openconnect_info *vpninfo)
+{
+	return vpninfo->tun_ring && vpninfo->tun_ring->active;
+}
+
+/* The script sent an empty datagram. If that means it wants to use the
+ * rings, switch the tun fd over to an epoll fd which wakes us both for
+ * the doorbell and when the script exits. Returns 1 if so. */
+int tun_ring_activate(struct openconnect_info *vpninfo)
+{
+	struct tun_ring *r = vpninfo->tun_ring;
+	struct epoll_event ev;
+
+	if (r->active ||
+	    __atomic_load_n(&r->hdr->state, __ATOMIC_ACQUIRE) != OC_RING_ACTIVE)
+		return 0;
+
+	vpn_progress(vpninfo, PRG_INFO,
+		     _("Script is using shared-memory packet rings\n"));
+	r->active = 1;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	r->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (r->epoll_fd < 0 ||
+	    epoll_ctl(r->epoll_fd, EPOLL_CTL_ADD, r->wait_fd, &ev) ||
+	    epoll_ctl(r->epoll_fd, EPOLL_CTL_ADD, r->gone_fd, &ev)) {
+		/* Then we only find out when the ring to it fills up */
+		vpn_progress(vpninfo, PRG_DEBUG,
+			     _("Failed to set up epoll for packet rings: %s\n"),
+			     strerror(errno));
+		if (r->epoll_fd >= 0)
+			close(r->epoll_fd);
+		r->epoll_fd = -1;
+	}
+
+	unmonitor_write_fd(vpninfo, tun);
+	openconnect_setup_tun_fd(vpninfo, r->epoll_fd >= 0 ? r->epoll_fd : r->wait_fd);
+	return 1;
+}
+
+int tun_ring_read(struct openconnect_info *vpninfo, struct pkt *pkt)
+{
+	struct tun_ring *r = vpninfo->tun_ring;
+	struct oc_ring_queue *q = r->from_peer;
+	uint32_t tail = q->tail;
+	uint32_t head, len, discards = 0;
+	unsigned char *slot;
+	int ret = 0;
+
+	if (r->broken)
+		return -1;
+
+	while (1) {
+		head = __atomic_load_n(&q->head, __ATOMIC_ACQUIRE);
+		if (head - tail > r->nr_slots) {
+			/* The script owns head; it can't have written more
+			 * slots than there are. Give up on it. */
+			vpn_progress(vpninfo, PRG_ERR,
+				     _("Script moved packet ring head from %u to %u; closing connection\n"),
+				     tail, head);
+			r->broken = 1;
+			vpninfo->quit_reason = "Packet ring corrupted by script";
+			return -1;
+		}
+		if (tail == head) {
+			uint64_t count;
+
+			/* Empty. Clear the doorbell before looking again, in
+			 * case a packet arrived in between. If it wasn't rung,
+			 * perhaps it was the script exiting which woke us. */
+			if (read(r->wait_fd, &count, sizeof(count)) < 0) {
+				if (ring_peer_gone(r))
+					vpninfo->quit_reason = "Client connection terminated";
+				return -1;
+			}
+			if (tail == __atomic_load_n(&q->head, __ATOMIC_ACQUIRE))
+				return -1;
+		}
+
+		slot = ring_slot(r, q, tail);
+		memcpy(&len, slot, sizeof(len));
+		if (len && len <= (uint32_t)pkt->len &&
+		    len <= r->slot_size - sizeof(len)) {
+			memcpy(pkt->data, slot + sizeof(len), len);
+			pkt->len = len;
+			break;
+		}
+		vpn_progress(vpninfo, PRG_ERR,
+			     _("Discarding packet of length %u from script\n"),
+			     len);
+		tail++;
+		/* Head may keep moving; leave the rest for next time, and
+		 * ring our own doorbell so that there is one. */
+		if (++discards >= r->nr_slots) {
+			ring_kick(r->wait_fd);
+			ret = -1;
+			goto out;
+		}
+	}
+	tail++;
+
+ out:
+	__atomic_store_n(&q->tail, tail, __ATOMIC_RELEASE);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&q->need_space, __ATOMIC_RELAXED)) {
+		q->need_space = 0;
+		ring_kick(r->kick_fd);
+	}
+	return ret;
+}
+
+int tun_ring_write(struct openconnect_info *vpninfo, struct pkt *pkt)
+{
+	struct tun_ring *r = vpninfo->tun_ring;
+	struct oc_ring_queue *q = r->to_peer;
+	uint32_t head = q->head;
+	uint32_t len = pkt->len;
+	unsigned char *slot;
+
+	if (len > r->slot_size - sizeof(len)) {
+		vpn_progress(vpninfo, PRG_ERR,
+			     _("Packet of length %u too large for shared-memory ring\n"),
+			     len);
+		return 0;
+	}
+
+	if (head - __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE) >= r->nr_slots) {
+		__atomic_store_n(&q->need_space, 1, __ATOMIC_RELAXED);
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+		if (head - __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE) >= r->nr_slots) {
+			/* Full. Is anyone still there? */
+			if (ring_peer_gone(r))
+				vpninfo->quit_reason = "Client connection terminated";
+			/* We'll be woken by wait_fd when there is space */
+			return -1;
+		}
+	}
+
+	slot = ring_slot(r, q, head);
+	memcpy(slot, &len, sizeof(len));
+	memcpy(slot + sizeof(len), pkt->data, len);
+	__atomic_store_n(&q->head, head + 1, __ATOMIC_RELEASE);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&q->tail, __ATOMIC_RELAXED) == head)
+		ring_kick(r->kick_fd);
+	return 0;
+}
+
+size_t tun_ring_size(struct openconnect_info *vpninfo)
+{
+	struct tun_ring *r = vpninfo->tun_ring;
+
+	return r ? sizeof(*r) + r->map_size : 0;
+}
+
+void tun_ring_free(struct openconnect_info *vpninfo)
+{
+	struct tun_ring *r = vpninfo->tun_ring;
+
+	if (!r)
+		return;
+	if (r->hdr)
+		munmap(r->hdr, r->map_size);
+	if (r->memfd >= 0)
+		close(r->memfd);
+	if (r->kick_fd >= 0)
+		close(r->kick_fd);
+	if (r->gone_fd >= 0)
+		close(r->gone_fd);
+	if (r->gone_wfd >= 0)
+		close(r->gone_wfd);
+	/* If active, vpninfo->tun_fd is the epoll fd (or wait_fd without
+	   it), and the socket isn't */
+	if (r->active) {
+		if (r->sock_fd >= 0)
+			close(r->sock_fd);
+		if (r->epoll_fd >= 0 && r->wait_fd >= 0)
+			close(r->wait_fd);
+	} else if (r->wait_fd >= 0)
+		close(r->wait_fd);
+	free(r);
+	vpninfo->tun_ring = NULL;
+}
+
+#endif /* HAVE_TUN_RING */
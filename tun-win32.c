@@ -379,6 +379,11 @@ int os_write_tun(struct openconnect_info *vpninfo, struct pkt *pkt)
 	return -1;
 }
 
+int os_set_tun_mtu(struct openconnect_info *vpninfo)
+{
+	return -EOPNOTSUPP;
+}
+
 void os_shutdown_tun(struct openconnect_info *vpninfo)
 {
 	script_config_tun(vpninfo, "disconnect");
@@ -175,6 +175,11 @@ intptr_t os_setup_tun(struct openconnect_info *vpninfo)
 
 	return tun_fd;
 }
+
+int os_set_tun_mtu(struct openconnect_info *vpninfo)
+{
+	return -EOPNOTSUPP;
+}
 #elif defined(__native_client__)
 
 intptr_t os_setup_tun(struct openconnect_info *vpninfo)
@@ -184,6 +189,11 @@ intptr_t os_setup_tun(struct openconnect_info *vpninfo)
 	return -EOPNOTSUPP;
 }
 
+int os_set_tun_mtu(struct openconnect_info *vpninfo)
+{
+	return -EOPNOTSUPP;
+}
+
 #else /* !__sun__ && !__native_client__ */
 
 /* MTU setting code for both Linux and BSD systems */
@@ -195,7 +205,7 @@ static void ifreq_set_ifname(struct openconnect_info *vpninfo, struct ifreq *ifr
 		free(ifname);
 }
 
-static int set_tun_mtu(struct openconnect_info *vpninfo)
+int os_set_tun_mtu(struct openconnect_info *vpninfo)
 {
 	struct ifreq ifr;
 	int net_fd;
@@ -264,7 +274,7 @@ intptr_t os_setup_tun(struct openconnect_info *vpninfo)
 		vpninfo->ifname = strdup(ifr.ifr_name);
 
 	/* Ancient vpnc-scripts might not get this right */
-	set_tun_mtu(vpninfo);
+	os_set_tun_mtu(vpninfo);
 
 	return tun_fd;
 }
@@ -441,7 +451,7 @@ intptr_t os_setup_tun(struct openconnect_info *vpninfo)
 #endif
 
 	/* Ancient vpnc-scripts might not get this right */
-	set_tun_mtu(vpninfo);
+	os_set_tun_mtu(vpninfo);
 
 	return tun_fd;
 }
@@ -479,21 +489,38 @@ int openconnect_setup_tun_script(struct openconnect_info *vpninfo,
 		vpn_progress(vpninfo, PRG_ERR, _("socketpair failed: %s\n"), strerror(errno));
 		return -EIO;
 	}
+#ifdef HAVE_TUN_RING
+	/* Offer it, and keep using the socket if it's not wanted */
+	tun_ring_setup(vpninfo);
+#endif
 	child = fork();
 	if (child < 0) {
 		vpn_progress(vpninfo, PRG_ERR, _("fork failed: %s\n"), strerror(errno));
+#ifdef HAVE_TUN_RING
+		tun_ring_free(vpninfo);
+#endif
+		close(fds[0]);
+		close(fds[1]);
 		return -EIO;
 	} else if (!child) {
 		if (setpgid(0, getpid()) < 0)
 			perror(_("setpgid"));
 		close(fds[0]);
 		script_setenv_int(vpninfo, "VPNFD", fds[1]);
+#ifdef HAVE_TUN_RING
+		if (vpninfo->tun_ring)
+			tun_ring_setenv(vpninfo);
+#endif
 		apply_script_env(vpninfo->script_env);
 		execl("/bin/sh", "/bin/sh", "-c", vpninfo->vpnc_script, NULL);
 		perror(_("execl"));
 		exit(1);
 	}
 	close(fds[1]);
+#ifdef HAVE_TUN_RING
+	if (vpninfo->tun_ring)
+		tun_ring_forked(vpninfo, fds[0]);
+#endif
 	vpninfo->script_tun = child;
 	vpninfo->ifname = strdup(_("(script)"));
 
@@ -505,6 +532,10 @@ int os_read_tun(struct openconnect_info *vpninfo, struct pkt *pkt)
 	int prefix_size = 0;
 	int len;
 
+#ifdef HAVE_TUN_RING
+	if (tun_ring_active(vpninfo))
+		return tun_ring_read(vpninfo, pkt);
+#endif
 #ifdef TUN_HAS_AF_PREFIX
 	if (!vpninfo->script_tun)
 		prefix_size = sizeof(int);
@@ -512,6 +543,11 @@ int os_read_tun(struct openconnect_info *vpninfo, struct pkt *pkt)
 
 	/* Sanity. Just non-blocking reads on a select()able file descriptor... */
 	len = read(vpninfo->tun_fd, pkt->data - prefix_size, pkt->len + prefix_size);
+#ifdef HAVE_TUN_RING
+	/* An empty datagram from the script asks for the rings */
+	if (!len && vpninfo->tun_ring && tun_ring_activate(vpninfo) > 0)
+		return tun_ring_read(vpninfo, pkt);
+#endif
 	if (len <= prefix_size)
 		return -1;
 
@@ -524,6 +560,10 @@ int os_write_tun(struct openconnect_info *vpninfo, struct pkt *pkt)
 	unsigned char *data = pkt->data;
 	int len = pkt->len;
 
+#ifdef HAVE_TUN_RING
+	if (tun_ring_active(vpninfo))
+		return tun_ring_write(vpninfo, pkt);
+#endif
 #ifdef TUN_HAS_AF_PREFIX
 	if (!vpninfo->script_tun) {
 		struct ip *iph = (void *)data;
@@ -575,6 +615,13 @@ void os_shutdown_tun(struct openconnect_info *vpninfo)
 	if (vpninfo->script_tun) {
 		/* nuke the whole process group */
 		kill(-vpninfo->script_tun, SIGHUP);
+#ifdef HAVE_TUN_RING
+		tun_ring_free(vpninfo);
+#endif
+	} else if (vpninfo->pkt_source) {
+		/* No tun; the pipe is closed in openconnect_vpninfo_free() */
+		vpninfo->tun_fd = -1;
+		return;
 	} else {
 		script_config_tun(vpninfo, "disconnect");
 #ifdef __sun__